@@ -0,0 +1,763 @@
+/*
+ * MiniVHD	Minimalist VHD implementation in C.
+ *
+ *		This file is part of the MiniVHD Project.
+ *
+ *		Asynchronous I/O, using io_uring on Linux, or a pool of threads.
+ *
+ * Version:	@(#)async.c	1.0.0	2021/04/16
+ *
+ * Author:	Sherman Perry, <shermperry@gmail.com>
+ *
+ *		Copyright 2019-2021 Sherman Perry.
+ *
+ *		MIT License
+ *
+ *		Permission is hereby granted, free of  charge, to any person
+ *		obtaining a copy of this software  and associated documenta-
+ *		tion files (the "Software"), to deal in the Software without
+ *		restriction, including without limitation the rights to use,
+ *		copy, modify, merge, publish, distribute, sublicense, and/or
+ *		sell copies of  the Software, and  to permit persons to whom
+ *		the Software is furnished to do so, subject to the following
+ *		conditions:
+ *
+ *		The above  copyright notice and this permission notice shall
+ *		be included in  all copies or  substantial  portions of  the
+ *		Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING  BUT NOT LIMITED TO THE  WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN  NO EVENT  SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER  IN AN ACTION OF  CONTRACT, TORT OR  OTHERWISE, ARISING
+ * FROM, OUT OF  O R IN  CONNECTION WITH THE  SOFTWARE OR  THE USE  OR  OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifndef _FILE_OFFSET_BITS
+# define _FILE_OFFSET_BITS 64
+#endif
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  include <linux/io_uring.h>
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#  include <sys/uio.h>
+#  include <unistd.h>
+#  if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#   define MVHD_HAVE_IO_URING
+#  endif
+# endif
+#endif
+#define BUILDING_LIBRARY
+#include "minivhd.h"
+#include "internal.h"
+
+
+struct MVHDAsyncReq;
+
+/* A contiguous range of one image file, transferred to or from one or more buffers */
+typedef struct MVHDAsyncOp {
+    struct MVHDAsyncReq* req;
+    MVHDMeta*		owner;
+    int64_t		addr;
+    MVHDIOVec*		segs;
+    int			nsegs;
+    size_t		bytes;
+    bool		write;
+#ifdef MVHD_HAVE_IO_URING
+    struct iovec*	iov;
+    bool		ok;		/* the whole op was transferred, set when reaped */
+#endif
+    struct MVHDAsyncOp*	next;		/* next op in the work queue */
+} MVHDAsyncOp;
+
+typedef struct MVHDAsyncReq {
+    MVHDRequest		req;
+    void*		cookie;
+    int			pending;	/* ops that have not completed yet */
+    bool		failed;
+    MVHDAsyncOp*	ops;
+    int			num_ops;
+    MVHDMark*		marks;		/* sectors to mark as written once the data is on disk */
+    int			num_marks;
+    struct MVHDAsyncReq* next;		/* next request in the completed list */
+} MVHDAsyncReq;
+
+struct MVHDAsync {
+    int			in_flight;	/* submitted requests that have not been reaped */
+    MVHDMutex*		lock;
+    MVHDCond*		done_cond;
+    MVHDAsyncReq*	done_head;
+    MVHDAsyncReq*	done_tail;
+
+    /* Thread pool backend */
+    MVHDCond*		work_cond;
+    MVHDAsyncOp*	work_head;
+    MVHDAsyncOp*	work_tail;
+    MVHDThread*		threads[MVHD_ASYNC_MAX_THREADS];
+    int			num_threads;
+    bool		stop;
+
+#ifdef MVHD_HAVE_IO_URING
+    /* io_uring backend, used if sqes is not NULL */
+    int			ring_fd;
+    unsigned		ring_ops;	/* ops submitted to the ring, not yet completed */
+    unsigned		cq_entries;
+    void*		sq_ring;
+    size_t		sq_ring_size;
+    void*		cq_ring;
+    size_t		cq_ring_size;
+    struct io_uring_sqe* sqes;
+    size_t		sqes_size;
+    unsigned*		sq_head;
+    unsigned*		sq_tail;
+    unsigned*		sq_mask;
+    unsigned*		sq_array;
+    unsigned*		cq_head;
+    unsigned*		cq_tail;
+    unsigned*		cq_mask;
+    struct io_uring_cqe* cqes;
+#endif
+};
+
+
+/**
+ * \brief Finish an op with ordinary positional I/O
+ * 
+ * \param [in] op The op
+ * \param [in] done The number of bytes of the op that have already been transferred
+ * 
+ * \return true if the rest of the op was transferred
+ */
+static bool
+finish_op_sync(MVHDAsyncOp* op, size_t done)
+{
+    MVHDIOVec segs[MVHD_IOV_BATCH];
+    int64_t addr = op->addr + (int64_t)done;
+    size_t bytes, remain = op->bytes - done;
+    int i = 0, n;
+
+    /* Skip the segments that have been transferred */
+    while (i < op->nsegs && done >= op->segs[i].len) {
+        done -= op->segs[i++].len;
+    }
+    while (remain > 0 && i < op->nsegs) {
+        bytes = 0;
+        for (n = 0; n < MVHD_IOV_BATCH && i < op->nsegs; n++, i++) {
+            segs[n].base = (uint8_t*)op->segs[i].base + done;
+            segs[n].len = op->segs[i].len - done;
+            bytes += segs[n].len;
+            done = 0;
+        }
+        if (op->write) {
+            if (mvhd_pwritev(op->owner->fd, segs, n, addr) != (int64_t)bytes) {
+                return false;
+            }
+        } else if (mvhd_preadv(op->owner->fd, segs, n, addr) != (int64_t)bytes) {
+            return false;
+        }
+        addr += (int64_t)bytes;
+        remain -= bytes;
+    }
+
+    return true;
+}
+
+
+/**
+ * \brief Record that an op has completed, and move its request to the completed list 
+ * once all of its ops have. Must be called with the lock held.
+ */
+static void
+complete_op(MVHDAsync* as, MVHDAsyncReq* r, bool ok)
+{
+    if (!ok) {
+        r->failed = true;
+    }
+    if (--r->pending > 0) {
+        return;
+    }
+    r->next = NULL;
+    if (as->done_tail != NULL) {
+        as->done_tail->next = r;
+    } else {
+        as->done_head = r;
+    }
+    as->done_tail = r;
+    mvhd_cond_signal(as->done_cond);
+}
+
+
+static void
+worker(void* arg)
+{
+    MVHDAsync* as = (MVHDAsync*)arg;
+    MVHDAsyncOp* op;
+    bool ok;
+
+    mvhd_mutex_lock(as->lock);
+    for (;;) {
+        while (as->work_head == NULL && !as->stop) {
+            mvhd_cond_wait(as->work_cond, as->lock);
+        }
+        if (as->work_head == NULL) {
+            break;
+        }
+        op = as->work_head;
+        as->work_head = op->next;
+        if (as->work_head == NULL) {
+            as->work_tail = NULL;
+        }
+        mvhd_mutex_unlock(as->lock);
+
+        ok = finish_op_sync(op, 0);
+
+        mvhd_mutex_lock(as->lock);
+        complete_op(as, op->req, ok);
+    }
+    mvhd_mutex_unlock(as->lock);
+}
+
+
+static bool
+pool_init(MVHDAsync* as, int depth)
+{
+    int i, count = (depth < MVHD_ASYNC_MAX_THREADS) ? depth : MVHD_ASYNC_MAX_THREADS;
+
+    as->work_cond = mvhd_cond_create();
+    if (as->work_cond == NULL) {
+        return false;
+    }
+    for (i = 0; i < count; i++) {
+        as->threads[i] = mvhd_thread_create(worker, as);
+        if (as->threads[i] == NULL) {
+            break;
+        }
+    }
+    as->num_threads = i;
+
+    return as->num_threads > 0;
+}
+
+
+static void
+pool_submit(MVHDAsync* as, MVHDAsyncReq* r)
+{
+    int i;
+
+    mvhd_mutex_lock(as->lock);
+    for (i = 0; i < r->num_ops; i++) {
+        r->ops[i].next = NULL;
+        if (as->work_tail != NULL) {
+            as->work_tail->next = &r->ops[i];
+        } else {
+            as->work_head = &r->ops[i];
+        }
+        as->work_tail = &r->ops[i];
+    }
+    mvhd_cond_broadcast(as->work_cond);
+    mvhd_mutex_unlock(as->lock);
+}
+
+
+#ifdef MVHD_HAVE_IO_URING
+static bool
+uring_init(MVHDAsync* as, int depth)
+{
+    struct io_uring_params p;
+    uint8_t* sq;
+    uint8_t* cq;
+
+    memset(&p, 0, sizeof p);
+    as->ring_fd = (int)syscall(__NR_io_uring_setup, (unsigned)depth, &p);
+    if (as->ring_fd < 0) {
+        return false;
+    }
+
+    /* IORING_FEAT_NODROP and IORING_FEAT_SINGLE_MMAP are needed for the ring handling below */
+    if (!(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        goto fail;
+    }
+    as->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    as->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (as->cq_ring_size > as->sq_ring_size) {
+        as->sq_ring_size = as->cq_ring_size;
+    }
+    as->sq_ring = mmap(NULL, as->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, as->ring_fd, IORING_OFF_SQ_RING);
+    if (as->sq_ring == MAP_FAILED) {
+        as->sq_ring = NULL;
+        goto fail;
+    }
+    as->cq_ring = as->sq_ring;
+    as->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    as->sqes = mmap(NULL, as->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, as->ring_fd, IORING_OFF_SQES);
+    if (as->sqes == MAP_FAILED) {
+        as->sqes = NULL;
+        goto fail;
+    }
+
+    sq = (uint8_t*)as->sq_ring;
+    cq = (uint8_t*)as->cq_ring;
+    as->sq_head = (unsigned*)(sq + p.sq_off.head);
+    as->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    as->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    as->sq_array = (unsigned*)(sq + p.sq_off.array);
+    as->cq_head = (unsigned*)(cq + p.cq_off.head);
+    as->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    as->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    as->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    as->cq_entries = p.cq_entries;
+
+    return true;
+
+fail:
+    if (as->sq_ring != NULL) {
+        munmap(as->sq_ring, as->sq_ring_size);
+        as->sq_ring = NULL;
+    }
+    close(as->ring_fd);
+    as->ring_fd = -1;
+
+    return false;
+}
+
+
+static void
+uring_close(MVHDAsync* as)
+{
+    munmap(as->sqes, as->sqes_size);
+    munmap(as->sq_ring, as->sq_ring_size);
+    close(as->ring_fd);
+    as->ring_fd = -1;
+}
+
+
+/**
+ * \brief Handle the completions in the ring
+ * 
+ * Short transfers are finished with blocking I/O before the lock is taken, so other 
+ * threads waiting on it are not held up.
+ * 
+ * \param [in] as The async state
+ * \param [in] wait If true, and no completion is ready, block until one is
+ */
+static void
+uring_reap(MVHDAsync* as, bool wait)
+{
+    struct io_uring_cqe* cqe;
+    MVHDAsyncOp* op;
+    unsigned head, tail, i;
+
+    head = *as->cq_head;
+    tail = __atomic_load_n(as->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail && wait) {
+        syscall(__NR_io_uring_enter, as->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        tail = __atomic_load_n(as->cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    for (i = head; i != tail; i++) {
+        cqe = &as->cqes[i & *as->cq_mask];
+        op = (MVHDAsyncOp*)(uintptr_t)cqe->user_data;
+        if (cqe->res < 0) {
+            op->ok = false;
+        } else if ((size_t)cqe->res < op->bytes) {
+            /* Short transfers are rare for regular files. Finish them the simple way */
+            op->ok = (cqe->res > 0 || op->write) && finish_op_sync(op, (size_t)cqe->res);
+        } else {
+            op->ok = true;
+        }
+    }
+
+    mvhd_mutex_lock(as->lock);
+    for (i = head; i != tail; i++) {
+        op = (MVHDAsyncOp*)(uintptr_t)as->cqes[i & *as->cq_mask].user_data;
+        as->ring_ops--;
+        complete_op(as, op->req, op->ok);
+    }
+    mvhd_mutex_unlock(as->lock);
+    __atomic_store_n(as->cq_head, tail, __ATOMIC_RELEASE);
+}
+
+
+static void
+uring_submit(MVHDAsync* as, MVHDAsyncReq* r)
+{
+    struct io_uring_sqe* sqe;
+    MVHDAsyncOp* op;
+    unsigned tail, idx, queued = 0;
+    int i, j;
+
+    for (i = 0; i < r->num_ops; i++) {
+        op = &r->ops[i];
+
+        /* Never have more ops in the ring than there is space for their completions */
+        while (as->ring_ops >= as->cq_entries || queued > *as->sq_mask) {
+            if (queued > 0) {
+                syscall(__NR_io_uring_enter, as->ring_fd, queued, 0, 0, NULL, 0);
+                queued = 0;
+            }
+            if (as->ring_ops >= as->cq_entries) {
+                uring_reap(as, true);
+            }
+        }
+
+        for (j = 0; j < op->nsegs; j++) {
+            op->iov[j].iov_base = op->segs[j].base;
+            op->iov[j].iov_len = op->segs[j].len;
+        }
+        tail = *as->sq_tail;
+        idx = tail & *as->sq_mask;
+        sqe = &as->sqes[idx];
+        memset(sqe, 0, sizeof *sqe);
+        sqe->opcode = op->write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = op->owner->fd;
+        sqe->off = (uint64_t)op->addr;
+        sqe->addr = (uint64_t)(uintptr_t)op->iov;
+        sqe->len = (unsigned)op->nsegs;
+        sqe->user_data = (uint64_t)(uintptr_t)op;
+        as->sq_array[idx] = idx;
+        __atomic_store_n(as->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        as->ring_ops++;
+        queued++;
+    }
+    if (queued > 0) {
+        syscall(__NR_io_uring_enter, as->ring_fd, queued, 0, 0, NULL, 0);
+    }
+}
+#endif
+
+
+/**
+ * \brief Create the async state of an image
+ * 
+ * io_uring is used where the kernel supports it, and a pool of threads otherwise.
+ */
+static MVHDAsync*
+async_create(MVHDMeta* vhdm)
+{
+    MVHDAsync* as = calloc(1, sizeof *as);
+
+    if (as == NULL) {
+        return NULL;
+    }
+    as->lock = mvhd_mutex_create();
+    as->done_cond = mvhd_cond_create();
+    if (as->lock == NULL || as->done_cond == NULL) {
+        goto fail;
+    }
+#ifdef MVHD_HAVE_IO_URING
+    if (uring_init(as, vhdm->async_depth)) {
+        return as;
+    }
+#endif
+    if (pool_init(as, vhdm->async_depth)) {
+        return as;
+    }
+
+fail:
+    mvhd_cond_destroy(as->work_cond);
+    mvhd_cond_destroy(as->done_cond);
+    mvhd_mutex_destroy(as->lock);
+    free(as);
+
+    return NULL;
+}
+
+
+static bool
+using_uring(MVHDAsync* as)
+{
+#ifdef MVHD_HAVE_IO_URING
+    return as->sqes != NULL;
+#else
+    (void)as;
+    return false;
+#endif
+}
+
+
+/**
+ * \brief Build a request from the extents that it resolved to
+ * 
+ * The request, its ops and their buffer lists are allocated as a single block.
+ */
+static MVHDAsyncReq*
+build_request(MVHDBatch* batch, const MVHDRequest* req, void* cookie)
+{
+    MVHDAsyncReq* r;
+    MVHDAsyncOp* op;
+    MVHDIOVec* segs;
+    size_t size;
+    uint8_t* p;
+    int i, j, k, num_ops = 0;
+
+    mvhd_sort_batch(batch);
+    for (i = 0; i < batch->count; i = mvhd_batch_group(batch, i, MVHD_IOV_BATCH)) {
+        num_ops++;
+    }
+
+    size = sizeof *r + (size_t)num_ops * sizeof *op + (size_t)batch->count * sizeof *segs;
+#ifdef MVHD_HAVE_IO_URING
+    size += (size_t)batch->count * sizeof(struct iovec);
+#endif
+    size += (size_t)batch->mark_count * sizeof *r->marks;
+    r = calloc(1, size);
+    if (r == NULL) {
+        return NULL;
+    }
+    p = (uint8_t*)(r + 1);
+    r->ops = (MVHDAsyncOp*)p;
+    p += (size_t)num_ops * sizeof *op;
+    segs = (MVHDIOVec*)p;
+    p += (size_t)batch->count * sizeof *segs;
+    r->req = *req;
+    r->cookie = cookie;
+    r->num_ops = num_ops;
+    r->pending = num_ops;
+#ifdef MVHD_HAVE_IO_URING
+    r->marks = (MVHDMark*)(p + (size_t)batch->count * sizeof(struct iovec));
+#else
+    r->marks = (MVHDMark*)p;
+#endif
+    r->num_marks = batch->mark_count;
+    if (batch->mark_count > 0) {
+        memcpy(r->marks, batch->marks, (size_t)batch->mark_count * sizeof *r->marks);
+    }
+
+    for (i = 0, k = 0; i < batch->count; i = j, k++) {
+        j = mvhd_batch_group(batch, i, MVHD_IOV_BATCH);
+        op = &r->ops[k];
+        op->req = r;
+        op->owner = batch->extents[i].owner;
+        op->addr = batch->extents[i].addr;
+        op->write = batch->extents[i].write;
+        op->segs = &segs[i];
+        op->nsegs = j - i;
+#ifdef MVHD_HAVE_IO_URING
+        op->iov = (struct iovec*)p + i;
+#endif
+        for (; i < j; i++) {
+            segs[i].base = batch->extents[i].base;
+            segs[i].len = batch->extents[i].len;
+            op->bytes += batch->extents[i].len;
+        }
+    }
+
+    return r;
+}
+
+
+MVHDAPI int
+mvhd_async_submit(MVHDMeta* vhdm, const MVHDRequest* req, void* cookie)
+{
+    MVHDBatch batch = { NULL, 0, 0, NULL, 0, 0, false };
+    MVHDIOVec iov;
+    MVHDIOVCursor cur;
+    MVHDAsyncReq* r;
+    MVHDAsync* as;
+    int result;
+
+    if (req->type != MVHD_REQ_READ && req->type != MVHD_REQ_WRITE) {
+        return MVHD_ERR_INVALID_PARAMS;
+    }
+    if (vhdm->async == NULL) {
+        vhdm->async = async_create(vhdm);
+        if (vhdm->async == NULL) {
+            return MVHD_ERR_MEM;
+        }
+    }
+    as = vhdm->async;
+
+    /* Resolve the request through the BAT and sector bitmaps now. Blocks for writes are
+       allocated here, but the written sectors are only marked when the data is on disk */
+    iov.base = req->buff;
+    iov.len = (req->num_sectors > 0) ? (size_t)req->num_sectors * MVHD_SECTOR_SIZE : 0;
+    cur.iov = &iov;
+    cur.iovcnt = 1;
+    cur.idx = 0;
+    cur.pos = 0;
+    cur.batch = &batch;
+    if (req->type == MVHD_REQ_READ) {
+        result = vhdm->read_sectors(vhdm, req->offset, req->num_sectors, &cur);
+    } else {
+        result = vhdm->write_sectors(vhdm, req->offset, req->num_sectors, &cur);
+    }
+
+    r = build_request(&batch, req, cookie);
+    if (r == NULL) {
+        /* Without memory for the ops, the transfers are done right away */
+        if (mvhd_run_batch(&batch) == 0) {
+            mvhd_mark_written(vhdm, batch.marks, batch.mark_count);
+        } else {
+            result = req->num_sectors;
+        }
+        free(batch.extents);
+        free(batch.marks);
+        r = calloc(1, sizeof *r);
+        if (r == NULL) {
+            return MVHD_ERR_MEM;
+        }
+        r->req = *req;
+        r->cookie = cookie;
+    } else {
+        r->failed = batch.failed;
+        free(batch.extents);
+        free(batch.marks);
+    }
+    r->req.result = result;
+    as->in_flight++;
+
+    if (r->num_ops == 0) {
+        /* Nothing to transfer, for example a read of unallocated blocks */
+        r->pending = 1;
+        mvhd_mutex_lock(as->lock);
+        complete_op(as, r, true);
+        mvhd_mutex_unlock(as->lock);
+    } else if (using_uring(as)) {
+#ifdef MVHD_HAVE_IO_URING
+        uring_submit(as, r);
+#endif
+    } else {
+        pool_submit(as, r);
+    }
+
+    return 0;
+}
+
+
+/**
+ * \brief Take completed requests off the completed list
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [out] completions Array to store the completions in
+ * \param [in] max The size of completions
+ * 
+ * \return The number of completions stored
+ */
+static int
+reap(MVHDMeta* vhdm, MVHDCompletion* completions, int max)
+{
+    MVHDAsync* as = vhdm->async;
+    MVHDAsyncReq* r;
+    int n = 0;
+
+    while (n < max) {
+        mvhd_mutex_lock(as->lock);
+        r = as->done_head;
+        if (r != NULL) {
+            as->done_head = r->next;
+            if (as->done_head == NULL) {
+                as->done_tail = NULL;
+            }
+        }
+        mvhd_mutex_unlock(as->lock);
+        if (r == NULL) {
+            break;
+        }
+
+        if (r->failed) {
+            r->req.result = r->req.num_sectors;
+        } else {
+            /* The data is on disk, so the sectors that were written can now be marked */
+            mvhd_mark_written(vhdm, r->marks, r->num_marks);
+        }
+        if (completions != NULL) {
+            completions[n].cookie = r->cookie;
+            completions[n].result = r->req.result;
+        }
+        free(r);
+        as->in_flight--;
+        n++;
+    }
+
+    return n;
+}
+
+
+MVHDAPI int
+mvhd_async_poll(MVHDMeta* vhdm, MVHDCompletion* completions, int max)
+{
+    if (vhdm->async == NULL) {
+        return 0;
+    }
+#ifdef MVHD_HAVE_IO_URING
+    if (using_uring(vhdm->async)) {
+        uring_reap(vhdm->async, false);
+    }
+#endif
+
+    return reap(vhdm, completions, max);
+}
+
+
+MVHDAPI int
+mvhd_async_wait(MVHDMeta* vhdm, MVHDCompletion* completions, int max)
+{
+    MVHDAsync* as = vhdm->async;
+    int n;
+
+    if (as == NULL || max <= 0) {
+        return 0;
+    }
+    while (as->in_flight > 0) {
+        n = mvhd_async_poll(vhdm, completions, max);
+        if (n > 0) {
+            return n;
+        }
+#ifdef MVHD_HAVE_IO_URING
+        if (using_uring(as)) {
+            uring_reap(as, true);
+            continue;
+        }
+#endif
+        mvhd_mutex_lock(as->lock);
+        while (as->done_head == NULL) {
+            mvhd_cond_wait(as->done_cond, as->lock);
+        }
+        mvhd_mutex_unlock(as->lock);
+    }
+
+    return 0;
+}
+
+
+void
+mvhd_async_close(MVHDMeta* vhdm)
+{
+    MVHDAsync* as = vhdm->async;
+    MVHDCompletion c;
+    int i;
+
+    if (as == NULL) {
+        return;
+    }
+    while (as->in_flight > 0) {
+        mvhd_async_wait(vhdm, &c, 1);
+    }
+
+#ifdef MVHD_HAVE_IO_URING
+    if (using_uring(as)) {
+        uring_close(as);
+    }
+#endif
+    mvhd_mutex_lock(as->lock);
+    as->stop = true;
+    if (as->work_cond != NULL) {
+        mvhd_cond_broadcast(as->work_cond);
+    }
+    mvhd_mutex_unlock(as->lock);
+    for (i = 0; i < as->num_threads; i++) {
+        mvhd_thread_join(as->threads[i]);
+    }
+    mvhd_cond_destroy(as->work_cond);
+    mvhd_cond_destroy(as->done_cond);
+    mvhd_mutex_destroy(as->lock);
+    free(as);
+    vhdm->async = NULL;
+}
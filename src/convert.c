@@ -168,3 +168,117 @@ mvhd_convert_to_raw(const char* utf8_vhd_path, const char* utf8_raw_path, int *e
 
     return raw_img;
 }
+
+
+MVHDAPI MVHDMeta *
+mvhd_flatten(const char* utf8_vhd_path, const char* utf8_out_path, int* err)
+{
+    MVHDCreationOptions options = {0};
+    MVHDMeta *src, *vhdm = NULL, *owner;
+    MVHDBatch batch = { NULL, 0, 0, NULL, 0, 0, false };
+    MVHDIOVCursor cur = {0};
+    MVHDIOVec iov;
+    uint8_t *bitmap = NULL, *data = NULL;
+    size_t bitmap_bytes, data_bytes;
+    uint32_t total_sectors, start, s, end;
+    int blk, run, i, truncated;
+    bool allocated, marked;
+
+    src = mvhd_open(utf8_vhd_path, true, err);
+    if (src == NULL) {
+        return NULL;
+    }
+
+    /* Keep the block size of the top image, so each of its blocks maps to one output block */
+    options.type = MVHD_TYPE_DYNAMIC;
+    options.path = (char*)utf8_out_path;
+    options.size_in_bytes = src->footer.curr_sz;
+    options.geometry = mvhd_get_geometry(src);
+    options.block_size_in_sectors = (src->footer.disk_type == MVHD_TYPE_FIXED) ? MVHD_BLOCK_LARGE : (uint32_t)src->sect_per_block;
+    vhdm = mvhd_create_ex(options, err);
+    if (vhdm == NULL) {
+        goto cleanup_src;
+    }
+
+    bitmap_bytes = (size_t)vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE;
+    data_bytes = (size_t)vhdm->sect_per_block * MVHD_SECTOR_SIZE;
+    bitmap = malloc(bitmap_bytes);
+    data = malloc(data_bytes);
+    if (bitmap == NULL || data == NULL) {
+        *err = MVHD_ERR_MEM;
+        goto cleanup_output;
+    }
+
+    total_sectors = (uint32_t)(src->footer.curr_sz / MVHD_SECTOR_SIZE);
+    for (blk = 0; blk < (int)vhdm->sparse.max_bat_ent; blk++) {
+        start = (uint32_t)blk * vhdm->sect_per_block;
+        end = (total_sectors - start < (uint32_t)vhdm->sect_per_block) ? total_sectors : start + vhdm->sect_per_block;
+        memset(bitmap, 0, bitmap_bytes);
+        memset(data, 0, data_bytes);
+        marked = false;
+
+        /* Read each run that some layer has data for straight from that layer. The rest 
+           stays zero, and unmarked. The reads go through a batch, which reports failures */
+        for (s = start; s < end; s += run) {
+            run = mvhd_resolve_run(src, s, (int)(end - s), &owner, &allocated);
+            if (!allocated) {
+                continue;
+            }
+
+            iov.base = data + (size_t)(s - start) * MVHD_SECTOR_SIZE;
+            iov.len = (size_t)run * MVHD_SECTOR_SIZE;
+            cur.iov = &iov;
+            cur.iovcnt = 1;
+            cur.idx = 0;
+            cur.pos = 0;
+            cur.batch = &batch;
+            if (owner->footer.disk_type == MVHD_TYPE_FIXED) {
+                truncated = mvhd_fixed_read(owner, s, run, &cur);
+            } else {
+                truncated = mvhd_sparse_read(owner, s, run, &cur);
+            }
+            if (mvhd_run_batch(&batch) != 0 || truncated != 0) {
+                *err = MVHD_ERR_FILE;
+                goto cleanup_output;
+            }
+
+            for (i = (int)(s - start); i < (int)(s - start) + run; i++) {
+                /* A fixed image has no bitmap, so only its sectors holding data are marked */
+                if (owner->footer.disk_type == MVHD_TYPE_FIXED && mvhd_is_zero(data + (size_t)i * MVHD_SECTOR_SIZE, MVHD_SECTOR_SIZE)) {
+                    continue;
+                }
+                VHD_SETBIT(bitmap, i);
+                marked = true;
+            }
+        }
+
+        /* Blocks without any data stay sparse */
+        if (marked && mvhd_sparse_write_block(vhdm, blk, bitmap, data) != 0) {
+            *err = MVHD_ERR_FILE;
+            goto cleanup_output;
+        }
+    }
+
+    if (mvhd_flush(vhdm) != 0) {
+        *err = MVHD_ERR_FILE;
+        goto cleanup_output;
+    }
+    goto cleanup_buffers;
+
+cleanup_output:
+    /* A partly flattened image is of no use to anyone */
+    mvhd_close(vhdm);
+    vhdm = NULL;
+    remove(utf8_out_path);
+
+cleanup_buffers:
+    free(batch.extents);
+    free(batch.marks);
+    free(bitmap);
+    free(data);
+
+cleanup_src:
+    mvhd_close(src);
+
+    return vhdm;
+}
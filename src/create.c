@@ -464,7 +464,7 @@ create_sparse_diff(const char* path, const char* par_path, uint64_t size_in_byte
     f = NULL;
     free(vhdm);
     vhdm = mvhd_open(path, false, err);
-    goto end;
+    goto cleanup_par_vhdm;
 
 cleanup_vhdm:
     free(vhdm);
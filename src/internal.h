@@ -48,6 +48,12 @@
 
 #define MVHD_SPARSE_BLK		0xffffffff
 
+/* Number of sectors written at a time when zero filling */
+#define MVHD_ZERO_CHUNK_SECTORS	128
+
+/* Maximum number of buffers handed to the host in one vectored transfer */
+#define MVHD_IOV_BATCH		64
+
 /* For simplicity, we don't handle paths longer than this 
  * Note, this is the max path in characters, as that is what
  * Windows uses
@@ -60,11 +66,101 @@
 
 #define MVHD_START_TS		946684800
 
+/* Default memory budget for cached sector bitmaps, per image */
+#define MVHD_BITMAP_CACHE_DEFAULT	(64 * 1024)
+
+/* Default number of transfers in flight for the asynchronous API, and the 
+   most threads the portable backend uses for them */
+#define MVHD_ASYNC_DEPTH_DEFAULT	64
+#define MVHD_ASYNC_DEPTH_MAX		4096
+#define MVHD_ASYNC_MAX_THREADS		8
+
+/* Number of modified BAT sectors that are collected before they are written back */
+#define MVHD_BAT_DIRTY_MAX		64
+
+/* Block owner map entries that don't name the layer owning a whole block */
+#define MVHD_OWNER_MIXED		0xfe
+#define MVHD_OWNER_UNKNOWN		0xff
+
+/* Most BATs of a differencing chain that are loaded in the background at once */
+#define MVHD_OPEN_MAX_THREADS		8
+
+/* Number of parent paths remembered by parent UUID and name, to skip probing the locators */
+#define MVHD_PATH_CACHE_SIZE		32
+
+/* Default number of blocks that MVHD_PLACE_CHUNKED reserves space for */
+#define MVHD_PLACE_CHUNK_DEFAULT	16
+
+/*
+ * The following bit array macros adapted from:
+ *
+ * http://www.mathcs.emory.edu/~cheung/Courses/255/Syllabus/1-C-intro/bit-array.html
+*/
+#define VHD_SETBIT(A,k)     ( A[(k>>3)] |= (0x80 >> (k&7)) )
+#define VHD_CLEARBIT(A,k)   ( A[(k>>3)] &= ~(0x80 >> (k&7)) )
+#define VHD_TESTBIT(A,k)    ( A[(k>>3)] & (0x80 >> (k&7)) )
+
+
+typedef struct MVHDMutex MVHDMutex;
+typedef struct MVHDCond MVHDCond;
+typedef struct MVHDThread MVHDThread;
+typedef struct MVHDAsync MVHDAsync;
+
+
+/* A contiguous range of the image file, queued by a batch instead of being transferred */
+typedef struct MVHDExtent {
+    struct MVHDMeta*	owner;
+    int64_t		addr;
+    uint8_t*		base;
+    size_t		len;
+    int			seq;
+    bool		write;
+} MVHDExtent;
+
+/* Sectors of a block written by a batch, marked in the sector bitmap once the data is on disk */
+typedef struct MVHDMark {
+    int		blk;
+    int		start;
+    int		end;
+} MVHDMark;
+
+typedef struct MVHDBatch {
+    MVHDExtent*	extents;
+    int		count;
+    int		capacity;
+    MVHDMark*	marks;
+    int		mark_count;
+    int		mark_capacity;
+    bool	failed;		/* a transfer done right away, as the batch could not grow, failed */
+} MVHDBatch;
+
+/* Position within a caller's list of buffers, which advances as sectors are transferred */
+typedef struct MVHDIOVCursor {
+    const MVHDIOVec*	iov;
+    int			iovcnt;
+    int			idx;
+    size_t		pos;
+    MVHDBatch*		batch;		/* if not NULL, file transfers are queued here */
+} MVHDIOVCursor;
+
+typedef struct MVHDBitmapEntry {
+    uint8_t*	bitmap;
+    int		block;		/* cached block, or -1 if unused */
+    int		next;		/* next entry in the same hash chain, or -1 */
+    bool	referenced;
+    bool	dirty;		/* modified, but not yet written to the file */
+} MVHDBitmapEntry;
 
 typedef struct MVHDSectorBitmap {
-    uint8_t*	curr_bitmap;
+    MVHDBitmapEntry* curr_entry;	/* most recently used entry */
     int		sector_count;
     int		curr_block;
+    MVHDBitmapEntry* entries;
+    uint8_t*	data;
+    int*	hash;
+    int		num_entries;
+    int		hash_mask;
+    int		clock_hand;
 } MVHDSectorBitmap;
 
 typedef struct MVHDFooter {
@@ -114,20 +210,47 @@ typedef struct MVHDSparseHeader {
 
 struct MVHDMeta {
     FILE*	f;
+    int		fd;		/* descriptor of f, used for all positional I/O */
     bool	readonly;
+    bool	strict;		/* metadata is written by every write that changes it, instead of lazily */
+    bool	zero_detect;
     char	filename[MVHD_MAX_PATH_BYTES];
     struct MVHDMeta* parent;
+    MVHDMutex*	lock;		/* held while using the caches of a shared parent, or NULL */
+    int		refcount;	/* number of children using a shared parent */
+    struct MVHDMeta* next_shared;
+    MVHDOpenOptions share_options;	/* options a shared parent was opened with */
     MVHDFooter	footer;
     MVHDSparseHeader sparse;
     uint32_t*	block_offset;
+    uint8_t*	bat_dirty;	/* one bit per BAT sector modified since it was last written */
+    uint8_t*	block_owner;	/* differencing images: per block, how many layers down its owner is */
+    int		bat_dirty_count;
+    int64_t	data_end;	/* file offset at which the footer is stored */
     int		sect_per_block;
     MVHDSectorBitmap bitmap;
-    int (*read_sectors)(struct MVHDMeta*, uint32_t, int, void*);
-    int (*write_sectors)(struct MVHDMeta*, uint32_t, int, void*);
+    struct {
+        uint32_t*	offsets;	/* sector offsets of unused, block sized gaps, highest first */
+        int		count;
+        int		capacity;
+    }		free_slots;
+    struct {
+        uint8_t*	addr;		/* read-only mapping of the file, or NULL */
+        int64_t		size;
+        void*		handle;
+    }		map;
+    int (*read_sectors)(struct MVHDMeta*, uint32_t, int, MVHDIOVCursor*);
+    int (*write_sectors)(struct MVHDMeta*, uint32_t, int, MVHDIOVCursor*);
+    int64_t (*place_block)(struct MVHDMeta*, int);
+    int		place_chunk;
+    int		prealloc_blocks;
+    int64_t	prealloc_end;	/* file size while space past data_end is preallocated, or 0 */
     struct {
         uint8_t*	zero_data;
         int		sector_count;
     }	format_buffer;
+    int		async_depth;
+    MVHDAsync*	async;		/* created by the first asynchronous request */
 };
 
 
@@ -141,6 +264,17 @@ extern "C" {
 uint16_t mvhd_from_be16(uint16_t val);
 uint32_t mvhd_from_be32(uint32_t val);
 uint64_t mvhd_from_be64(uint64_t val);
+void mvhd_from_be32_array(uint32_t* vals, size_t count);
+
+/**
+ * \brief Check whether a buffer only contains zero bytes
+ * 
+ * \param [in] buf The buffer
+ * \param [in] len The length of the buffer in bytes
+ * 
+ * \return true if every byte is zero
+ */
+bool mvhd_is_zero(const void* buf, size_t len);
 uint16_t mvhd_to_be16(uint16_t val);
 uint32_t mvhd_to_be32(uint32_t val);
 uint64_t mvhd_to_be64(uint64_t val);
@@ -235,6 +369,146 @@ int64_t mvhd_ftello64(FILE* stream);
  */
 int mvhd_fseeko64(FILE* stream, int64_t offset, int origin);
 
+/**
+ * \brief Set the size of a file
+ * 
+ * This is a portable version of the POSIX ftruncate(). If the file grows, 
+ * the new space reads as zeros.
+ * 
+ * \param [in] fd The file descriptor of the file to resize
+ * \param [in] length The new size of the file in bytes
+ * 
+ * \return 0 on success, non-zero if the file could not be resized
+ */
+int mvhd_ftruncate64(int fd, int64_t length);
+
+/**
+ * \brief Write everything written to a file so far through to the disk
+ * 
+ * This is a portable version of the POSIX fsync().
+ * 
+ * \param [in] fd The file descriptor of the file to sync
+ * 
+ * \return 0 on success, non-zero if the file could not be synced
+ */
+int mvhd_fsync(int fd);
+
+/**
+ * \brief Allocate disk space for a range of a file, extending it if needed
+ * 
+ * \param [in] fd File descriptor
+ * \param [in] offset Start of the range
+ * \param [in] length Length of the range in bytes
+ * 
+ * \retval 0 on success
+ * \retval -1 if the host does not support it, or the space could not be allocated
+ */
+int mvhd_fallocate(int fd, int64_t offset, int64_t length);
+
+/**
+ * \brief Zero a range of a file, and return its storage to the host if possible
+ * 
+ * On Linux the range is deallocated with FALLOC_FL_PUNCH_HOLE. Where that is not 
+ * supported, zeros are written instead. The file size does not change.
+ * 
+ * \param [in] fd The file descriptor
+ * \param [in] offset The absolute file offset of the range
+ * \param [in] sector_count The length of the range in sectors
+ */
+void mvhd_punch_hole(int fd, int64_t offset, int sector_count);
+
+/**
+ * \brief Get the size of a file
+ * 
+ * \param [in] fd The file descriptor
+ * 
+ * \return The size of the file in bytes, or -1 on error
+ */
+int64_t mvhd_file_size(int fd);
+
+/**
+ * \brief Map a file into memory for reading
+ * 
+ * The mapping is shared, so it is backed by the host's page cache and 
+ * stays coherent with writes made through the file descriptor.
+ * 
+ * \param [in] fd The file descriptor
+ * \param [in] size The number of bytes to map, starting at the beginning of the file
+ * \param [out] handle Platform specific handle, to be passed to mvhd_unmap_file()
+ * 
+ * \return The address of the mapping, or NULL if the file could not be mapped
+ */
+void* mvhd_map_file(int fd, int64_t size, void** handle);
+
+/**
+ * \brief Remove a mapping created by mvhd_map_file()
+ * 
+ * \param [in] addr The address of the mapping
+ * \param [in] size The size of the mapping in bytes
+ * \param [in] handle The handle returned by mvhd_map_file()
+ */
+void mvhd_unmap_file(void* addr, int64_t size, void* handle);
+
+/**
+ * \brief Read from an absolute file offset
+ * 
+ * This is a portable version of the POSIX pread(). It neither uses nor changes 
+ * a file position, so any number of transfers may be in flight on one file. On 
+ * Windows the file pointer does move during the transfer, and is put back after 
+ * it, so stream I/O on the same file must not run at the same time. Short reads 
+ * are retried until count bytes are read or the end of the file is reached.
+ * 
+ * \param [in] fd The file descriptor
+ * \param [out] buf The buffer to read into
+ * \param [in] count The number of bytes to read
+ * \param [in] offset The absolute file offset to read from
+ * 
+ * \return The number of bytes read, or -1 on error. If -1, mvhd_errno is set
+ */
+int64_t mvhd_pread(int fd, void* buf, size_t count, int64_t offset);
+
+/**
+ * \brief Write to an absolute file offset
+ * 
+ * This is a portable version of the POSIX pwrite(). See mvhd_pread().
+ * 
+ * \param [in] fd The file descriptor
+ * \param [in] buf The buffer to write from
+ * \param [in] count The number of bytes to write
+ * \param [in] offset The absolute file offset to write to
+ * 
+ * \return The number of bytes written, or -1 on error. If -1, mvhd_errno is set
+ */
+int64_t mvhd_pwrite(int fd, const void* buf, size_t count, int64_t offset);
+
+/**
+ * \brief Read from an absolute file offset into a list of buffers
+ * 
+ * This is a portable version of the POSIX preadv(). See mvhd_pread().
+ * 
+ * \param [in] fd The file descriptor
+ * \param [in] iov The list of buffers to fill, in order
+ * \param [in] iovcnt The number of buffers in iov
+ * \param [in] offset The absolute file offset to read from
+ * 
+ * \return The number of bytes read, or -1 on error. If -1, mvhd_errno is set
+ */
+int64_t mvhd_preadv(int fd, const MVHDIOVec* iov, int iovcnt, int64_t offset);
+
+/**
+ * \brief Write a list of buffers to an absolute file offset
+ * 
+ * This is a portable version of the POSIX pwritev(). See mvhd_pread().
+ * 
+ * \param [in] fd The file descriptor
+ * \param [in] iov The list of buffers to write, in order
+ * \param [in] iovcnt The number of buffers in iov
+ * \param [in] offset The absolute file offset to write to
+ * 
+ * \return The number of bytes written, or -1 on error. If -1, mvhd_errno is set
+ */
+int64_t mvhd_pwritev(int fd, const MVHDIOVec* iov, int iovcnt, int64_t offset);
+
 /**
  * \brief Calculate the CRC32 of a data buffer.
  * 
@@ -260,6 +534,17 @@ uint32_t mvhd_crc32(const void* data, size_t n_bytes);
  */
 uint32_t mvhd_file_mod_timestamp(const char* path, int *err);
 
+/**
+ * \brief Calculate the file modification timestamp of an open file.
+ * 
+ * \param [in] f The open file
+ * \param [out] err The error value, if an error occurrs
+ * 
+ * \return The file modified timestamp, in VHD compatible timestamp.
+ * 'err' will be set to non-zero on error
+ */
+uint32_t mvhd_file_mod_timestamp_f(FILE* f, int *err);
+
 struct MVHDMeta* mvhd_create_fixed_raw(const char* path, FILE* raw_img, uint64_t size_in_bytes, MVHDGeom* geom, int* err, mvhd_progress_callback progress_callback);
 
 /**
@@ -273,6 +558,71 @@ struct MVHDMeta* mvhd_create_fixed_raw(const char* path, FILE* raw_img, uint64_t
  */
 void mvhd_write_empty_sectors(FILE* f, int sector_count);
 
+/**
+ * \brief Write zero filled sectors to an absolute file offset
+ * 
+ * \param [in] fd File descriptor to write sectors to
+ * \param [in] offset The absolute file offset to start writing at
+ * \param [in] sector_count The number of sectors to write
+ */
+void mvhd_pwrite_empty_sectors(int fd, int64_t offset, int sector_count);
+
+/**
+ * \brief Write all modified sector bitmaps in the bitmap cache to file
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * 
+ * \retval 0 if all bitmaps were written
+ * \retval -1 if any bitmap could not be written. mvhd_errno will be set
+ */
+int mvhd_flush_sect_bitmaps(struct MVHDMeta* vhdm);
+
+/**
+ * \brief Write all modified BAT sectors to file
+ * 
+ * Modified sector bitmaps are written first, so the BAT in the file never points at a 
+ * block whose bitmap is not there yet. Adjacent modified sectors are written together.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * 
+ * \retval 0 if everything was written
+ * \retval -1 if anything could not be written. mvhd_errno will be set
+ */
+int mvhd_flush_bat(struct MVHDMeta* vhdm);
+
+/**
+ * \brief Sort the extents of a batch by file and offset
+ * 
+ * \param [in] batch The batch to sort
+ */
+void mvhd_sort_batch(MVHDBatch* batch);
+
+/**
+ * \brief Find the extents of a sorted batch that can be transferred together
+ * 
+ * \param [in] batch The sorted batch
+ * \param [in] first Index of the first extent of the group
+ * \param [in] max_extents The largest number of extents in the group
+ * 
+ * \return Index of the first extent after the group. The extents in between are 
+ *         adjacent ranges of the same file, transferred in the same direction
+ */
+int mvhd_batch_group(const MVHDBatch* batch, int first, int max_extents);
+
+/**
+ * \brief Perform the transfers queued in a batch
+ * 
+ * The extents are sorted by file and offset, and each run of extents that are adjacent 
+ * in the file is transferred with a single vectored system call. The batch is emptied, 
+ * apart from its marks, which the caller applies with mvhd_mark_written() on success.
+ * 
+ * \param [in] batch The batch to run
+ * 
+ * \retval 0 if every transfer completed
+ * \retval -1 if any transfer failed or was short, including those done while it was built
+ */
+int mvhd_run_batch(MVHDBatch* batch);
+
 /**
  * \brief Read a fixed VHD image
  * 
@@ -282,13 +632,13 @@ void mvhd_write_empty_sectors(FILE* f, int sector_count);
  * \param [in] vhdm MiniVHD data structure
  * \param [in] offset Sector offset to read from
  * \param [in] num_sectors The desired number of sectors to read
- * \param [out] out_buff An output buffer to store read sectors. Must be 
- * large enough to hold num_sectors worth of sectors.
+ * \param [out] out_iov The buffers to store read sectors in, advanced past the 
+ * sectors that were read. Must be large enough to hold num_sectors worth of sectors.
  * 
  * \retval 0 num_sectors were read from file
  * \retval >0 < num_sectors were read from file
  */
-int mvhd_fixed_read(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buff);
+int mvhd_fixed_read(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOVCursor* out_iov);
 
 /**
  * \brief Read a sparse VHD image
@@ -302,13 +652,13 @@ int mvhd_fixed_read(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, voi
  * \param [in] vhdm MiniVHD data structure
  * \param [in] offset Sector offset to read from
  * \param [in] num_sectors The desired number of sectors to read
- * \param [out] out_buff An output buffer to store read sectors. Must be 
- * large enough to hold num_sectors worth of sectors.
+ * \param [out] out_iov The buffers to store read sectors in, advanced past the 
+ * sectors that were read. Must be large enough to hold num_sectors worth of sectors.
  * 
  * \retval 0 num_sectors were read from file
  * \retval >0 < num_sectors were read from file
  */
-int mvhd_sparse_read(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buff);
+int mvhd_sparse_read(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOVCursor* out_iov);
 
 /**
  * \brief Read a differencing VHD image
@@ -325,13 +675,57 @@ int mvhd_sparse_read(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, vo
  * \param [in] vhdm MiniVHD data structure
  * \param [in] offset Sector offset to read from
  * \param [in] num_sectors The desired number of sectors to read
- * \param [out] out_buff An output buffer to store read sectors. Must be 
- * large enough to hold num_sectors worth of sectors.
+ * \param [out] out_iov The buffers to store read sectors in, advanced past the 
+ * sectors that were read. Must be large enough to hold num_sectors worth of sectors.
  * 
  * \retval 0 num_sectors were read from file
  * \retval >0 < num_sectors were read from file
  */
-int mvhd_diff_read(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buff);
+int mvhd_diff_read(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOVCursor* out_iov);
+
+/**
+ * \brief Find which image of a chain holds a run of sectors, and if it holds data for it
+ * 
+ * Sectors that no image in the chain has data for read as zero. Fixed images are taken 
+ * to hold data for every sector.
+ * 
+ * \param [in] vhdm MiniVHD data structure of the top image
+ * \param [in] offset Sector offset the run starts at
+ * \param [in] num_sectors The maximum length of the run. The run must be within the image
+ * \param [out] owner The image that the run should be read from
+ * \param [out] allocated Whether owner has data for the run (true) or the run reads as zero (false)
+ * 
+ * \return The number of sectors in the run, between 1 and num_sectors
+ */
+int mvhd_resolve_run(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, struct MVHDMeta** owner, bool* allocated);
+
+/**
+ * \brief Get a pointer to sectors of a memory mapped fixed VHD image
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset Sector offset of the first sector
+ * \param [in] num_sectors The desired number of sectors
+ * \param [out] len The number of bytes available at the returned pointer
+ * 
+ * \return A pointer into the mapping, or NULL if the image is not mapped
+ */
+const void* mvhd_fixed_map(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, size_t* len);
+
+/**
+ * \brief Get a pointer to sectors of a memory mapped sparse VHD image
+ * 
+ * Only a run of sectors that are stored in a single block can be returned. The 
+ * run ends at the first sector that has not been written, or at the end of the block.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset Sector offset of the first sector
+ * \param [in] num_sectors The desired number of sectors
+ * \param [out] len The number of bytes available at the returned pointer
+ * 
+ * \return A pointer into the mapping, or NULL if the first sector is not stored in the 
+ *         mapped part of the file
+ */
+const void* mvhd_sparse_map(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, size_t* len);
 
 /**
  * \brief Write to a fixed VHD image
@@ -342,13 +736,13 @@ int mvhd_diff_read(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, void
  * \param [in] vhdm MiniVHD data structure
  * \param [in] offset Sector offset to write to
  * \param [in] num_sectors The desired number of sectors to write
- * \param [in] in_buff A source buffer to write sectors from. Must be 
- * large enough to hold num_sectors worth of sectors.
+ * \param [in] in_iov The buffers to write sectors from, advanced past the 
+ * sectors that were written. Must be large enough to hold num_sectors worth of sectors.
  * 
  * \retval 0 num_sectors were written to file
  * \retval >0 < num_sectors were written to file
  */
-int mvhd_fixed_write(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff);
+int mvhd_fixed_write(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOVCursor* in_iov);
 
 /**
  * \brief Write to a sparse or differencing VHD image
@@ -367,13 +761,174 @@ int mvhd_fixed_write(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, vo
  * \param [in] vhdm MiniVHD data structure
  * \param [in] offset Sector offset to write to
  * \param [in] num_sectors The desired number of sectors to write
- * \param [in] in_buff A source buffer to write sectors from. Must be 
- * large enough to hold num_sectors worth of sectors.
+ * \param [in] in_iov The buffers to write sectors from, advanced past the 
+ * sectors that were written. Must be large enough to hold num_sectors worth of sectors.
  * 
  * \retval 0 num_sectors were written to file
  * \retval >0 < num_sectors were written to file
  */
-int mvhd_sparse_diff_write(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff);
+int mvhd_sparse_diff_write(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOVCursor* in_iov);
+
+/**
+ * \brief Create a block in a sparse or differencing image from its complete contents
+ * 
+ * The sector bitmap and the data are written with a single write, in the same way as 
+ * a write covering a whole block. The block must not be allocated yet.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] blk The block number to create
+ * \param [in] bitmap The sector bitmap of the block, bitmap.sector_count sectors long. Sectors 
+ *             that are not marked must be zero in data
+ * \param [in] data The data of the whole block, sect_per_block sectors long
+ * 
+ * \retval 0 if the block was written
+ * \retval -1 if it could not be, and was left unallocated
+ */
+int mvhd_sparse_write_block(struct MVHDMeta* vhdm, int blk, const uint8_t* bitmap, void* data);
+
+/**
+ * \brief Find the unused gaps in a sparse VHD image that can hold a block
+ * 
+ * The BAT is scanned for space between the metadata, the blocks and the footer that is 
+ * large enough for a block. New blocks are placed in these slots before the file is 
+ * extended. Slots freed by discards are added as they appear.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * 
+ * \retval 0 on success
+ * \retval -1 if memory could not be allocated
+ */
+int mvhd_init_free_slots(struct MVHDMeta* vhdm);
+
+/**
+ * \brief Find the end of everything stored in a sparse image, apart from the footer
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * 
+ * \return The file offset just past the last block, or past the metadata if no block 
+ *         is allocated
+ */
+int64_t mvhd_used_end(struct MVHDMeta* vhdm);
+
+/**
+ * \brief Give back space preallocated past the end of the data
+ * 
+ * The footer is written at the end of the data, and the file is truncated after it.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * 
+ * \retval 0 on success, or if nothing was preallocated
+ * \retval -1 if the file could not be written
+ */
+int mvhd_trim_tail(struct MVHDMeta* vhdm);
+
+/**
+ * \brief Placement policies for new blocks in sparse VHD images
+ * 
+ * A policy picks the space a new block is stored in. It either takes a slot from the 
+ * free slot list, making sure the slot is inside the file, or asks for the block to be 
+ * appended where the footer is.
+ * 
+ * mvhd_place_append() takes the lowest free slot. mvhd_place_locality() takes the free 
+ * slot closest to where the previous or next block is stored. mvhd_place_chunked() 
+ * extends the file for a whole chunk of consecutive blocks when the first of them is 
+ * created, and stores the others of the chunk in the space reserved for them.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] blk The block number that is being created
+ * 
+ * \return The absolute file offset of the slot to use, or -1 to append the block
+ */
+int64_t mvhd_place_append(struct MVHDMeta* vhdm, int blk);
+int64_t mvhd_place_locality(struct MVHDMeta* vhdm, int blk);
+int64_t mvhd_place_chunked(struct MVHDMeta* vhdm, int blk);
+
+/**
+ * \brief Discard sectors of a fixed VHD image
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset Sector offset of the first sector
+ * \param [in] num_sectors The number of sectors to discard
+ * 
+ * \retval 0 num_sectors were discarded
+ * \retval >0 < num_sectors were discarded
+ */
+int mvhd_fixed_discard(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors);
+
+/**
+ * \brief Preallocate sectors of a fixed VHD image
+ * 
+ * Any holes the host left in the range are allocated.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset Sector offset of the first sector
+ * \param [in] num_sectors The number of sectors to preallocate
+ * 
+ * \retval 0 num_sectors were preallocated
+ * \retval >0 < num_sectors were preallocated
+ */
+int mvhd_fixed_preallocate(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors);
+
+/**
+ * \brief Preallocate sectors of a sparse or differencing VHD image
+ * 
+ * Every unallocated block in the range is allocated. Free slots are used as the 
+ * placement policy decides, and the other blocks are appended together. Their sector 
+ * bitmaps are left clear, and their BAT entries are written with a single write once 
+ * the space is in place.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset Sector offset of the first sector
+ * \param [in] num_sectors The number of sectors to preallocate
+ * 
+ * \retval 0 num_sectors were preallocated
+ * \retval >0 < num_sectors were preallocated
+ */
+int mvhd_sparse_preallocate(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors);
+
+/**
+ * \brief Discard sectors of a sparse or differencing VHD image
+ * 
+ * The sectors are cleared in the sector bitmaps, and their data is zeroed. Blocks left 
+ * without any sectors in use are released. A released block at the end of the data is 
+ * truncated off the file, otherwise its storage is returned to the host with a hole.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset Sector offset of the first sector
+ * \param [in] num_sectors The number of sectors to discard
+ * 
+ * \retval 0 num_sectors were discarded
+ * \retval >0 < num_sectors were discarded
+ */
+int mvhd_sparse_discard(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors);
+
+/**
+ * \brief Zero sectors of a differencing VHD image
+ * 
+ * Where the parent chain reads as zero, the sectors are discarded from the child. 
+ * Zeros are only written to the child where they have to hide the parent's data.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset Sector offset of the first sector
+ * \param [in] num_sectors The number of sectors to zero
+ * 
+ * \retval 0 num_sectors were zeroed
+ * \retval >0 < num_sectors were zeroed
+ */
+int mvhd_diff_format(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors);
+
+/**
+ * \brief Mark sectors of a sparse or differencing VHD image as written
+ * 
+ * Used to complete batched and asynchronous writes, once their data is on disk. Only 
+ * the sectors that were actually written are marked, so sectors skipped by zero 
+ * detection stay clear. Blocks that have been discarded since are left alone.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] marks The runs of sectors queued by the writes
+ * \param [in] num_marks The number of runs
+ */
+void mvhd_mark_written(struct MVHDMeta* vhdm, const MVHDMark* marks, int num_marks);
 
 /**
  * \brief A no-op function to "write" to read-only VHD images
@@ -381,13 +936,42 @@ int mvhd_sparse_diff_write(struct MVHDMeta* vhdm, uint32_t offset, int num_secto
  * \param [in] vhdm MiniVHD data structure
  * \param [in] offset Sector offset to write to
  * \param [in] num_sectors The desired number of sectors to write
- * \param [in] in_buff A source buffer to write sectors from. Must be 
- * large enough to hold num_sectors worth of sectors.
+ * \param [in] in_iov The buffers to write sectors from, advanced past the 
+ * sectors that were written. Must be large enough to hold num_sectors worth of sectors.
  * 
  * \retval 0 num_sectors were written to file
  * \retval >0 < num_sectors were written to file
  */
-int mvhd_noop_write(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff);
+int mvhd_noop_write(struct MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOVCursor* in_iov);
+
+/**
+ * \brief Wait for all asynchronous requests of an image, and free the async state
+ * 
+ * Completions that have not been reaped are discarded. Writes that succeeded are 
+ * still marked in the sector bitmaps.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ */
+void mvhd_async_close(struct MVHDMeta* vhdm);
+
+/**
+ * Portable threads, mutexes and condition variables
+ * 
+ * mvhd_mutex_global() returns a mutex for process-wide state. It exists for the life 
+ * of the process, and must not be destroyed.
+ */
+MVHDMutex* mvhd_mutex_global(void);
+MVHDMutex* mvhd_mutex_create(void);
+void mvhd_mutex_destroy(MVHDMutex* m);
+void mvhd_mutex_lock(MVHDMutex* m);
+void mvhd_mutex_unlock(MVHDMutex* m);
+MVHDCond* mvhd_cond_create(void);
+void mvhd_cond_destroy(MVHDCond* c);
+void mvhd_cond_wait(MVHDCond* c, MVHDMutex* m);
+void mvhd_cond_signal(MVHDCond* c);
+void mvhd_cond_broadcast(MVHDCond* c);
+MVHDThread* mvhd_thread_create(void (*func)(void*), void* arg);
+void mvhd_thread_join(MVHDThread* t);
 
 /**
  * \brief Save the contents of a VHD footer from a buffer to a struct
@@ -47,218 +47,1949 @@
 #include "internal.h"
 
 
-/*
- * The following bit array macros adapted from:
- *
- * http://www.mathcs.emory.edu/~cheung/Courses/255/Syllabus/1-C-intro/bit-array.html
-*/
-#define VHD_SETBIT(A,k)     ( A[(k>>3)] |= (0x80 >> (k&7)) )
-#define VHD_CLEARBIT(A,k)   ( A[(k>>3)] &= ~(0x80 >> (k&7)) )
-#define VHD_TESTBIT(A,k)    ( A[(k>>3)] & (0x80 >> (k&7)) )
+/**
+ * \brief Check that we will not be overflowing buffers
+ * 
+ * \param [in] offset The offset from which we are beginning from
+ * \param [in] num_sectors The number of sectors which we desire to read/write
+ * \param [in] total_sectors The total number of sectors available
+ * \param [out] transfer_sect The number of sectors to actually write. 
+ * This may be lower than num_sectors if offset + num_sectors >= total_sectors
+ * \param [out] trunc_sectors The number of sectors truncated if transfer_sectors < num_sectors
+ */
+static inline void
+check_sectors(uint32_t offset, int num_sectors, uint32_t total_sectors, int* transfer_sect, int* trunc_sect)
+{
+    *transfer_sect = num_sectors;
+    *trunc_sect = 0;
+
+    if ((total_sectors - offset) < (uint32_t)*transfer_sect) {
+        *transfer_sect = total_sectors - offset;
+        *trunc_sect = num_sectors - *transfer_sect;
+    }
+}
+
+
+/**
+ * \brief Find the length of a run of identical bits in a sector bitmap
+ * 
+ * Whole bytes of set or clear bits are skipped at once, so scanning a mostly
+ * uniform bitmap is cheap.
+ * 
+ * \param [in] bitmap The sector bitmap to scan
+ * \param [in] start The first sector in the block to examine
+ * \param [in] end One past the last sector in the block to examine
+ * \param [out] set Whether the run consists of set (true) or clear (false) bits
+ * 
+ * \return The number of sectors in the run, at least 1 if start < end
+ */
+static int
+bitmap_run_length(const uint8_t* bitmap, int start, int end, bool* set)
+{
+    bool val = VHD_TESTBIT(bitmap, start) != 0;
+    uint8_t fill = val ? 0xff : 0x00;
+    int sib = start + 1;
+
+    while (sib < end) {
+        if ((sib & 7) == 0 && (end - sib) >= 8 && bitmap[sib >> 3] == fill) {
+            sib += 8;
+        } else if ((VHD_TESTBIT(bitmap, sib) != 0) == val) {
+            sib++;
+        } else {
+            break;
+        }
+    }
+    *set = val;
+
+    return sib - start;
+}
+
+
+static uint8_t zero_sectors[MVHD_ZERO_CHUNK_SECTORS * MVHD_SECTOR_SIZE];
+
+
+void
+mvhd_write_empty_sectors(FILE* f, int sector_count)
+{
+    int chunk;
+
+    while (sector_count > 0) {
+        chunk = sector_count < MVHD_ZERO_CHUNK_SECTORS ? sector_count : MVHD_ZERO_CHUNK_SECTORS;
+        fwrite(zero_sectors, MVHD_SECTOR_SIZE, chunk, f);
+        sector_count -= chunk;
+    }
+}
+
+
+void
+mvhd_pwrite_empty_sectors(int fd, int64_t offset, int sector_count)
+{
+    int chunk;
+
+    while (sector_count > 0) {
+        chunk = sector_count < MVHD_ZERO_CHUNK_SECTORS ? sector_count : MVHD_ZERO_CHUNK_SECTORS;
+        mvhd_pwrite(fd, zero_sectors, (size_t)chunk * MVHD_SECTOR_SIZE, offset);
+        offset += (int64_t)chunk * MVHD_SECTOR_SIZE;
+        sector_count -= chunk;
+    }
+}
+
+
+/**
+ * \brief Write a sector bitmap in memory to file
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] blk The block the sector bitmap belongs to
+ * \param [in] bitmap The sector bitmap to write
+ * 
+ * \retval 0 if the bitmap was written
+ * \retval -1 if an error occurred. mvhd_errno will be set
+ */
+static int
+write_sect_bitmap(MVHDMeta* vhdm, int blk, const uint8_t* bitmap)
+{
+    int64_t abs_offset = (int64_t)vhdm->block_offset[blk] * MVHD_SECTOR_SIZE;
+    size_t bytes = (size_t)vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE;
+
+    return mvhd_pwrite(vhdm->fd, bitmap, bytes, abs_offset) == (int64_t)bytes ? 0 : -1;
+}
+
+
+/**
+ * \brief Find a block's sector bitmap in the bitmap cache
+ * 
+ * \param [in] bm The sector bitmap cache to search
+ * \param [in] blk The block to look for
+ * 
+ * \return The index of the cache entry holding the block, or -1 if not cached
+ */
+static int
+bitmap_cache_find(MVHDSectorBitmap* bm, int blk)
+{
+    int i;
+
+    for (i = bm->hash[blk & bm->hash_mask]; i >= 0; i = bm->entries[i].next) {
+        if (bm->entries[i].block == blk) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+
+/**
+ * \brief Choose a bitmap cache entry to replace
+ * 
+ * Entries are replaced using the CLOCK algorithm. Each lookup marks an entry as 
+ * referenced, and the clock hand gives referenced entries a second chance before 
+ * choosing one that has not been used since the hand last passed it. A dirty 
+ * entry is written back to the file before it is reused.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * 
+ * \return The index of the now unused entry
+ */
+static int
+bitmap_cache_evict(MVHDMeta* vhdm)
+{
+    MVHDSectorBitmap* bm = &vhdm->bitmap;
+    MVHDBitmapEntry* ent;
+    int *link;
+    int i;
+
+    for (;;) {
+        i = bm->clock_hand;
+        bm->clock_hand = (bm->clock_hand + 1) % bm->num_entries;
+        ent = &bm->entries[i];
+        if (!ent->referenced) {
+            break;
+        }
+        ent->referenced = false;
+    }
+
+    if (ent->block >= 0) {
+        if (ent->dirty) {
+            write_sect_bitmap(vhdm, ent->block, ent->bitmap);
+            ent->dirty = false;
+        }
+        for (link = &bm->hash[ent->block & bm->hash_mask]; *link != i; link = &bm->entries[*link].next)
+            ;
+        *link = ent->next;
+        ent->block = -1;
+    }
+
+    return i;
+}
+
+
+/**
+ * \brief Get the sector bitmap for a block.
+ * 
+ * The bitmap is taken from the bitmap cache if possible. Otherwise an entry is 
+ * replaced, and if the block is sparse, the sector bitmap in memory will be 
+ * zeroed. Otherwise, the sector bitmap is read from the VHD file.
+ * 
+ * The returned entry remains valid until the next call for a different block.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] blk The block for which to get the sector bitmap
+ * 
+ * \return The cache entry holding the sector bitmap of the block
+ */
+static MVHDBitmapEntry*
+get_sect_bitmap(MVHDMeta* vhdm, int blk)
+{
+    MVHDSectorBitmap* bm = &vhdm->bitmap;
+    MVHDBitmapEntry* ent;
+    int i;
+
+    if (bm->curr_block == blk) {
+        return bm->curr_entry;
+    }
+
+    i = bitmap_cache_find(bm, blk);
+    if (i < 0) {
+        i = bitmap_cache_evict(vhdm);
+        ent = &bm->entries[i];
+        if (vhdm->block_offset[blk] != MVHD_SPARSE_BLK) {
+            mvhd_pread(vhdm->fd, ent->bitmap, (size_t)bm->sector_count * MVHD_SECTOR_SIZE, (int64_t)vhdm->block_offset[blk] * MVHD_SECTOR_SIZE);
+        } else {
+            memset(ent->bitmap, 0, bm->sector_count * MVHD_SECTOR_SIZE);
+        }
+        ent->block = blk;
+        ent->next = bm->hash[blk & bm->hash_mask];
+        bm->hash[blk & bm->hash_mask] = i;
+    }
+    ent = &bm->entries[i];
+    ent->referenced = true;
+
+    bm->curr_block = blk;
+    bm->curr_entry = ent;
+
+    return ent;
+}
+
+
+/**
+ * \brief Set a range of bits in a sector bitmap
+ * 
+ * \param [in] bitmap The sector bitmap to modify
+ * \param [in] start The first sector in the block to mark
+ * \param [in] end One past the last sector in the block to mark
+ */
+static void
+bitmap_set_range(uint8_t* bitmap, int start, int end)
+{
+    int sib = start;
+
+    for (; sib < end && (sib & 7) != 0; sib++) {
+        VHD_SETBIT(bitmap, sib);
+    }
+    if (end - sib >= 8) {
+        memset(&bitmap[sib >> 3], 0xff, (end - sib) >> 3);
+        sib += (end - sib) & ~7;
+    }
+    for (; sib < end; sib++) {
+        VHD_SETBIT(bitmap, sib);
+    }
+}
+
+
+/**
+ * \brief Clear a range of bits in a sector bitmap
+ * 
+ * \param [in] bitmap The sector bitmap to modify
+ * \param [in] start The first sector in the block to clear
+ * \param [in] end One past the last sector in the block to clear
+ */
+static void
+bitmap_clear_range(uint8_t* bitmap, int start, int end)
+{
+    int sib = start;
+
+    for (; sib < end && (sib & 7) != 0; sib++) {
+        VHD_CLEARBIT(bitmap, sib);
+    }
+    if (end - sib >= 8) {
+        memset(&bitmap[sib >> 3], 0x00, (end - sib) >> 3);
+        sib += (end - sib) & ~7;
+    }
+    for (; sib < end; sib++) {
+        VHD_CLEARBIT(bitmap, sib);
+    }
+}
+
+
+int
+mvhd_flush_sect_bitmaps(MVHDMeta* vhdm)
+{
+    MVHDSectorBitmap* bm = &vhdm->bitmap;
+    int i, ret = 0;
+
+    for (i = 0; i < bm->num_entries; i++) {
+        if (bm->entries[i].dirty) {
+            if (write_sect_bitmap(vhdm, bm->entries[i].block, bm->entries[i].bitmap) != 0) {
+                ret = -1;
+                continue;
+            }
+            bm->entries[i].dirty = false;
+        }
+    }
+
+    return ret;
+}
+
+
+/**
+ * \brief Write block offset from memory into file
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] blk The block for which to write the offset for
+ */
+static void
+write_bat_entry(MVHDMeta* vhdm, int blk)
+{
+    uint64_t table_offset = vhdm->sparse.bat_offset + ((uint64_t)blk * sizeof *vhdm->block_offset);
+    uint32_t offset = mvhd_to_be32(vhdm->block_offset[blk]);
+
+    mvhd_pwrite(vhdm->fd, &offset, sizeof offset, (int64_t)table_offset);
+}
+
+
+/**
+ * \brief Write a range of block offsets from memory into file, with a single write
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] first The first block for which to write the offset for
+ * \param [in] last The last block for which to write the offset for
+ * 
+ * \retval 0 on success
+ * \retval -1 if the entries could not be written
+ */
+static int
+write_bat_range(MVHDMeta* vhdm, int first, int last)
+{
+    uint64_t table_offset = vhdm->sparse.bat_offset + ((uint64_t)first * sizeof *vhdm->block_offset);
+    size_t len = (size_t)(last - first + 1) * sizeof *vhdm->block_offset;
+    uint32_t* entries;
+    int blk, ret = 0;
+
+    entries = malloc(len);
+    if (entries == NULL) {
+        for (blk = first; blk <= last; blk++) {
+            write_bat_entry(vhdm, blk);
+        }
+        return 0;
+    }
+    for (blk = first; blk <= last; blk++) {
+        entries[blk - first] = mvhd_to_be32(vhdm->block_offset[blk]);
+    }
+    if (mvhd_pwrite(vhdm->fd, entries, len, (int64_t)table_offset) != (int64_t)len) {
+        ret = -1;
+    }
+    free(entries);
+
+    return ret;
+}
+
+
+int
+mvhd_flush_bat(MVHDMeta* vhdm)
+{
+    int per_sect = MVHD_SECTOR_SIZE / sizeof *vhdm->block_offset;
+    int sects = (int)((vhdm->sparse.max_bat_ent + per_sect - 1) / per_sect);
+    int s, e, last, ret = 0;
+
+    if (vhdm->bat_dirty_count == 0) {
+        return 0;
+    }
+
+    /* The BAT must not point at a block before its sector bitmap is in the file */
+    if (mvhd_flush_sect_bitmaps(vhdm) != 0) {
+        return -1;
+    }
+    for (s = 0; s < sects; s = e) {
+        if (!VHD_TESTBIT(vhdm->bat_dirty, s)) {
+            e = s + 1;
+            continue;
+        }
+        for (e = s; e < sects && VHD_TESTBIT(vhdm->bat_dirty, e); e++) {
+            VHD_CLEARBIT(vhdm->bat_dirty, e);
+        }
+        last = e * per_sect - 1;
+        if ((uint32_t)last >= vhdm->sparse.max_bat_ent) {
+            last = (int)vhdm->sparse.max_bat_ent - 1;
+        }
+        if (write_bat_range(vhdm, s * per_sect, last) != 0) {
+            ret = -1;
+        }
+    }
+    vhdm->bat_dirty_count = 0;
+
+    return ret;
+}
+
+
+/**
+ * \brief Record that a range of block offsets has changed in memory
+ * 
+ * In strict mode the entries are written right away. Otherwise the BAT sectors they 
+ * are in are marked dirty, and written back together by mvhd_flush_bat(), once enough 
+ * of them have collected or when the image is flushed.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] first The first block whose offset changed
+ * \param [in] last The last block whose offset changed
+ */
+static void
+update_bat(MVHDMeta* vhdm, int first, int last)
+{
+    int per_sect = MVHD_SECTOR_SIZE / sizeof *vhdm->block_offset;
+    int s;
+
+    if (vhdm->strict) {
+        write_bat_range(vhdm, first, last);
+        return;
+    }
+    for (s = first / per_sect; s <= last / per_sect; s++) {
+        if (!VHD_TESTBIT(vhdm->bat_dirty, s)) {
+            VHD_SETBIT(vhdm->bat_dirty, s);
+            vhdm->bat_dirty_count++;
+        }
+    }
+    if (vhdm->bat_dirty_count >= MVHD_BAT_DIRTY_MAX) {
+        mvhd_flush_bat(vhdm);
+    }
+}
+
+
+/**
+ * \brief Find the end of the metadata of a sparse image
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * 
+ * \return The file offset just past the sparse header, BAT and parent locators
+ */
+static int64_t
+metadata_end(MVHDMeta* vhdm)
+{
+    int64_t end, loc_end;
+    int j;
+
+    end = (int64_t)vhdm->footer.data_offset + MVHD_SPARSE_SIZE;
+    loc_end = (int64_t)vhdm->sparse.bat_offset + (int64_t)vhdm->sparse.max_bat_ent * sizeof *vhdm->block_offset;
+    if (loc_end > end) {
+        end = loc_end;
+    }
+    if (vhdm->footer.disk_type == MVHD_TYPE_DIFF) {
+        /* The data space of a parent locator is in bytes or in sectors, depending on who 
+           wrote the image. Assume whichever keeps more of the file */
+        for (j = 0; j < 8; j++) {
+            if (vhdm->sparse.par_loc_entry[j].plat_code != 0) {
+                loc_end = (int64_t)vhdm->sparse.par_loc_entry[j].plat_data_offset + 
+                          (int64_t)vhdm->sparse.par_loc_entry[j].plat_data_space * MVHD_SECTOR_SIZE;
+                if (loc_end > end) {
+                    end = loc_end;
+                }
+            }
+        }
+    }
+
+    return (end + MVHD_SECTOR_SIZE - 1) & ~(int64_t)(MVHD_SECTOR_SIZE - 1);
+}
+
+
+int64_t
+mvhd_used_end(MVHDMeta* vhdm)
+{
+    int64_t end = metadata_end(vhdm), blk_end;
+    uint32_t i, blk_sectors = (uint32_t)(vhdm->bitmap.sector_count + vhdm->sect_per_block);
+
+    for (i = 0; i < vhdm->sparse.max_bat_ent; i++) {
+        if (vhdm->block_offset[i] != MVHD_SPARSE_BLK) {
+            blk_end = ((int64_t)vhdm->block_offset[i] + blk_sectors) * MVHD_SECTOR_SIZE;
+            if (blk_end > end) {
+                end = blk_end;
+            }
+        }
+    }
+
+    return end;
+}
+
+
+/**
+ * \brief Add a slot to the free slot list, keeping it sorted
+ * 
+ * If the list can't grow, the slot is forgotten, and its space is not reused.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset Sector offset of the slot
+ */
+static void
+add_free_slot(MVHDMeta* vhdm, uint32_t offset)
+{
+    uint32_t* slots;
+    int i, cap;
+
+    if (vhdm->free_slots.count == vhdm->free_slots.capacity) {
+        cap = (vhdm->free_slots.capacity == 0) ? 16 : vhdm->free_slots.capacity * 2;
+        slots = realloc(vhdm->free_slots.offsets, (size_t)cap * sizeof *slots);
+        if (slots == NULL) {
+            return;
+        }
+        vhdm->free_slots.offsets = slots;
+        vhdm->free_slots.capacity = cap;
+    }
+    slots = vhdm->free_slots.offsets;
+    for (i = vhdm->free_slots.count; i > 0 && slots[i - 1] < offset; i--) {
+        slots[i] = slots[i - 1];
+    }
+    slots[i] = offset;
+    vhdm->free_slots.count++;
+}
+
+
+/**
+ * \brief Remove a slot from the free slot list
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] i Index of the slot in the list
+ * 
+ * \return The absolute file offset of the slot
+ */
+static int64_t
+take_free_slot(MVHDMeta* vhdm, int i)
+{
+    uint32_t offset = vhdm->free_slots.offsets[i];
+
+    vhdm->free_slots.count--;
+    memmove(vhdm->free_slots.offsets + i, vhdm->free_slots.offsets + i + 1, (size_t)(vhdm->free_slots.count - i) * sizeof *vhdm->free_slots.offsets);
+
+    return (int64_t)offset * MVHD_SECTOR_SIZE;
+}
+
+
+/**
+ * \brief Find the free slot at a sector offset
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset Sector offset of the slot
+ * 
+ * \return The index of the slot in the list, or -1 if it is not free
+ */
+static int
+find_free_slot(MVHDMeta* vhdm, int64_t offset)
+{
+    int lo = 0, hi = vhdm->free_slots.count, mid;
+
+    /* The list is sorted highest first */
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if ((int64_t)vhdm->free_slots.offsets[mid] > offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return (lo < vhdm->free_slots.count && (int64_t)vhdm->free_slots.offsets[lo] == offset) ? lo : -1;
+}
+
+
+/**
+ * \brief Find the free slot closest to a sector offset
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] target Sector offset to get close to
+ * \param [out] dist Distance of the slot from target, in sectors
+ * 
+ * \return The index of the slot in the list, or -1 if there are no free slots
+ */
+static int
+nearest_free_slot(MVHDMeta* vhdm, int64_t target, int64_t* dist)
+{
+    int64_t d;
+    int i, best = -1;
+
+    for (i = 0; i < vhdm->free_slots.count; i++) {
+        d = (int64_t)vhdm->free_slots.offsets[i] - target;
+        if (d < 0) {
+            d = -d;
+        }
+        if (best < 0 || d < *dist) {
+            best = i;
+            *dist = d;
+        }
+    }
+
+    return best;
+}
+
+
+/**
+ * \brief Drop free slots that are no longer inside the file, after it was truncated
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ */
+static void
+trim_free_slots(MVHDMeta* vhdm)
+{
+    int64_t blk_bytes = (int64_t)(vhdm->bitmap.sector_count + vhdm->sect_per_block) * MVHD_SECTOR_SIZE;
+    int i = 0;
+
+    while (i < vhdm->free_slots.count && (int64_t)vhdm->free_slots.offsets[i] * MVHD_SECTOR_SIZE + blk_bytes > vhdm->data_end) {
+        i++;
+    }
+    if (i > 0) {
+        vhdm->free_slots.count -= i;
+        memmove(vhdm->free_slots.offsets, vhdm->free_slots.offsets + i, (size_t)vhdm->free_slots.count * sizeof *vhdm->free_slots.offsets);
+    }
+}
+
+
+static int
+compare_offsets(const void* a, const void* b)
+{
+    uint32_t oa = *(const uint32_t*)a;
+    uint32_t ob = *(const uint32_t*)b;
+
+    return (oa < ob) ? -1 : (oa > ob);
+}
+
+
+int
+mvhd_init_free_slots(MVHDMeta* vhdm)
+{
+    uint32_t blk_sectors = (uint32_t)(vhdm->bitmap.sector_count + vhdm->sect_per_block);
+    uint32_t* used;
+    uint32_t i, count = 0;
+    int64_t pos, next;
+
+    used = malloc(((size_t)vhdm->sparse.max_bat_ent + 1) * sizeof *used);
+    if (used == NULL) {
+        return -1;
+    }
+    for (i = 0; i < vhdm->sparse.max_bat_ent; i++) {
+        if (vhdm->block_offset[i] != MVHD_SPARSE_BLK) {
+            used[count++] = vhdm->block_offset[i];
+        }
+    }
+    qsort(used, count, sizeof *used, compare_offsets);
+
+    /* Walk the gaps in front of each block, and in front of the footer */
+    pos = metadata_end(vhdm) / MVHD_SECTOR_SIZE;
+    for (i = 0; i <= count; i++) {
+        next = (i < count) ? (int64_t)used[i] : vhdm->data_end / MVHD_SECTOR_SIZE;
+        for (; pos + blk_sectors <= next; pos += blk_sectors) {
+            add_free_slot(vhdm, (uint32_t)pos);
+        }
+        if (i < count && (int64_t)used[i] + blk_sectors > pos) {
+            pos = (int64_t)used[i] + blk_sectors;
+        }
+    }
+    free(used);
+
+    return 0;
+}
+
+
+/**
+ * \brief Move the end of the data into preallocated space
+ * 
+ * When preallocation is enabled, the file is extended for several blocks at a time, 
+ * with the footer at the end of the file. The data then grows into that space without 
+ * moving the footer, until it runs out. mvhd_flush() moves the footer back to the end 
+ * of the data.
+ * 
+ * This must be called before anything is written past the current end of the data, 
+ * so nothing is written over the footer.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] new_end The new end of the data
+ * 
+ * \retval true if the space up to new_end is preallocated, and data_end was moved
+ * \retval false if preallocation is disabled or failed. The caller then has to move 
+ *         the footer
+ */
+static bool
+reserve_tail(MVHDMeta* vhdm, int64_t new_end)
+{
+    uint8_t footer[MVHD_FOOTER_SIZE];
+    int64_t size, old_end;
+
+    if (vhdm->prealloc_blocks == 0) {
+        return false;
+    }
+    if (new_end + MVHD_FOOTER_SIZE > vhdm->prealloc_end) {
+        size = new_end + (int64_t)(vhdm->prealloc_blocks - 1) * (vhdm->bitmap.sector_count + vhdm->sect_per_block + 5) * MVHD_SECTOR_SIZE + MVHD_FOOTER_SIZE;
+        old_end = (vhdm->prealloc_end > 0) ? vhdm->prealloc_end : vhdm->data_end + MVHD_FOOTER_SIZE;
+        if (mvhd_fallocate(vhdm->fd, vhdm->data_end, size - vhdm->data_end) != 0 && mvhd_ftruncate64(vhdm->fd, size) != 0) {
+            return false;
+        }
+        /* The new footer is written before the old one is removed, so the file always ends 
+           with one, except while it is being extended */
+        mvhd_footer_to_buffer(&vhdm->footer, footer);
+        if (mvhd_pwrite(vhdm->fd, footer, sizeof footer, size - MVHD_FOOTER_SIZE) != sizeof footer) {
+            mvhd_ftruncate64(vhdm->fd, old_end);
+            return false;
+        }
+        /* The old footer is now inside the space, which has to read as zero */
+        mvhd_pwrite_empty_sectors(vhdm->fd, old_end - MVHD_FOOTER_SIZE, 1);
+        vhdm->prealloc_end = size;
+    }
+    vhdm->data_end = new_end;
+
+    return true;
+}
+
+
+int
+mvhd_trim_tail(MVHDMeta* vhdm)
+{
+    uint8_t footer[MVHD_FOOTER_SIZE];
+
+    if (vhdm->prealloc_end == 0) {
+        return 0;
+    }
+    mvhd_footer_to_buffer(&vhdm->footer, footer);
+    if (mvhd_pwrite(vhdm->fd, footer, sizeof footer, vhdm->data_end) != sizeof footer) {
+        return -1;
+    }
+    if (mvhd_ftruncate64(vhdm->fd, vhdm->data_end + MVHD_FOOTER_SIZE) != 0) {
+        return -1;
+    }
+    vhdm->prealloc_end = 0;
+    trim_free_slots(vhdm);
+
+    return 0;
+}
+
+
+int64_t
+mvhd_place_append(MVHDMeta* vhdm, int blk)
+{
+    (void)blk;
+
+    /* Taking the lowest slot keeps the file compact */
+    if (vhdm->free_slots.count == 0) {
+        return -1;
+    }
+
+    return take_free_slot(vhdm, vhdm->free_slots.count - 1);
+}
+
+
+int64_t
+mvhd_place_locality(MVHDMeta* vhdm, int blk)
+{
+    int64_t blk_sectors = vhdm->bitmap.sector_count + vhdm->sect_per_block;
+    int64_t target, dist = 0, tail_dist;
+    int i;
+
+    if (blk > 0 && vhdm->block_offset[blk - 1] != MVHD_SPARSE_BLK) {
+        target = (int64_t)vhdm->block_offset[blk - 1] + blk_sectors;
+    } else if ((uint32_t)blk + 1 < vhdm->sparse.max_bat_ent && vhdm->block_offset[blk + 1] != MVHD_SPARSE_BLK) {
+        target = (int64_t)vhdm->block_offset[blk + 1] - blk_sectors;
+    } else {
+        return mvhd_place_append(vhdm, blk);
+    }
+
+    /* Appending is just another place the block could go */
+    i = nearest_free_slot(vhdm, target, &dist);
+    tail_dist = vhdm->data_end / MVHD_SECTOR_SIZE - target;
+    if (tail_dist < 0) {
+        tail_dist = -tail_dist;
+    }
+    if (i < 0 || tail_dist < dist) {
+        return -1;
+    }
+
+    return take_free_slot(vhdm, i);
+}
+
+
+int64_t
+mvhd_place_chunked(MVHDMeta* vhdm, int blk)
+{
+    uint8_t footer[MVHD_FOOTER_SIZE];
+    int64_t blk_sectors = vhdm->bitmap.sector_count + vhdm->sect_per_block;
+    int64_t base, new_end;
+    int64_t first = blk - blk % vhdm->place_chunk;
+    int64_t last = first + vhdm->place_chunk;
+    int64_t i;
+
+    if (last > (int64_t)vhdm->sparse.max_bat_ent) {
+        last = vhdm->sparse.max_bat_ent;
+    }
+    for (i = first; i < last; i++) {
+        if (vhdm->block_offset[i] != MVHD_SPARSE_BLK) {
+            break;
+        }
+    }
+    if (i < last) {
+        /* Part of the chunk is stored, so use the space that was reserved next to it */
+        base = (int64_t)vhdm->block_offset[i] - (i - first) * blk_sectors;
+        i = find_free_slot(vhdm, base + (blk - first) * blk_sectors);
+        if (i >= 0) {
+            return take_free_slot(vhdm, (int)i);
+        }
+        return mvhd_place_locality(vhdm, blk);
+    }
+
+    /* The first block of the chunk reserves space for all of it, with the same 
+       padding after it as create_block() leaves after a single block */
+    base = vhdm->data_end;
+    new_end = base + ((last - first) * blk_sectors + 5) * MVHD_SECTOR_SIZE;
+    if (!reserve_tail(vhdm, new_end)) {
+        if (mvhd_ftruncate64(vhdm->fd, new_end) != 0) {
+            return -1;
+        }
+        mvhd_footer_to_buffer(&vhdm->footer, footer);
+        mvhd_pwrite(vhdm->fd, footer, sizeof footer, new_end);
+        vhdm->data_end = new_end;
+    }
+    for (i = first; i < last; i++) {
+        if (i != blk) {
+            add_free_slot(vhdm, (uint32_t)(base / MVHD_SECTOR_SIZE + (i - first) * blk_sectors));
+        }
+    }
+
+    return base + (blk - first) * blk_sectors * MVHD_SECTOR_SIZE;
+}
+
+
+/**
+ * \brief Create an empty block in a sparse or differencing VHD image
+ * 
+ * VHD images store data in blocks, which are typically 4096 sectors in size 
+ * (~2MB). These blocks may be stored on disk in any order. Blocks are created 
+ * on demand when required.
+ * 
+ * This function creates new, empty blocks in the free slot chosen by the placement 
+ * policy, if there is one. Otherwise it creates them at the end of the data, where 
+ * the footer currently is, and then writes the footer at the new end. Only the sector 
+ * bitmap (which replaces the old footer) is written explicitly. The rest of the block is 
+ * created by extending the file, which the host fills with zeros. The BAT table entry 
+ * for the new block is updated with the new offset.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] blk The block number to create
+ */
+static void
+create_block(MVHDMeta* vhdm, int blk)
+{
+    uint8_t footer[MVHD_FOOTER_SIZE];
+    int64_t abs_offset = vhdm->place_block(vhdm, blk);
+    int blk_sectors = vhdm->bitmap.sector_count + vhdm->sect_per_block;
+
+    if (abs_offset >= 0) {
+        /* Reuse a gap in the file. It may hold stale data, so zero it, bitmap included */
+        mvhd_punch_hole(vhdm->fd, abs_offset, blk_sectors);
+        vhdm->block_offset[blk] = (uint32_t)(abs_offset / MVHD_SECTOR_SIZE);
+        update_bat(vhdm, blk, blk);
+        return;
+    }
+    abs_offset = vhdm->data_end;
+
+    /* Add a bit of padding after the block. That's what Windows appears to do, although it's not strictly necessary... */
+    int64_t new_end = abs_offset + ((int64_t)blk_sectors + 5) * MVHD_SECTOR_SIZE;
+
+    bool reserved = reserve_tail(vhdm, new_end);
+
+    mvhd_pwrite_empty_sectors(vhdm->fd, abs_offset, vhdm->bitmap.sector_count);
+    if (!reserved) {
+        if (mvhd_ftruncate64(vhdm->fd, new_end) != 0) {
+            /* The host can't extend the file for us, so write the zeros ourselves */
+            mvhd_pwrite_empty_sectors(vhdm->fd, abs_offset + ((int64_t)vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE), vhdm->sect_per_block + 5);
+        }
+
+        /* And we finish with the footer */
+        mvhd_footer_to_buffer(&vhdm->footer, footer);
+        mvhd_pwrite(vhdm->fd, footer, sizeof footer, new_end);
+        vhdm->data_end = new_end;
+    }
+
+    /* We no longer have a sparse block. Update that BAT! */
+    vhdm->block_offset[blk] = (uint32_t)(abs_offset / MVHD_SECTOR_SIZE);
+    update_bat(vhdm, blk, blk);
+}
+
+
+/**
+ * \brief Take the next segments from a list of buffers
+ * 
+ * \param [in] cur The buffer list cursor, which is advanced past the segments taken
+ * \param [in] bytes The number of bytes wanted
+ * \param [out] segs Array to store the segments in
+ * \param [in] max_segs The size of segs
+ * \param [out] taken The number of bytes covered by the segments
+ * 
+ * \return The number of segments stored in segs
+ */
+static int
+iov_take(MVHDIOVCursor* cur, size_t bytes, MVHDIOVec* segs, int max_segs, size_t* taken)
+{
+    const MVHDIOVec* v;
+    size_t avail;
+    int n = 0;
+
+    *taken = 0;
+    while (bytes > 0 && n < max_segs && cur->idx < cur->iovcnt) {
+        v = &cur->iov[cur->idx];
+        avail = v->len - cur->pos;
+        if (avail > bytes) {
+            avail = bytes;
+        }
+        if (avail > 0) {
+            segs[n].base = (uint8_t*)v->base + cur->pos;
+            segs[n].len = avail;
+            n++;
+            cur->pos += avail;
+            bytes -= avail;
+            *taken += avail;
+        }
+        if (cur->pos == v->len) {
+            cur->idx++;
+            cur->pos = 0;
+        }
+    }
+
+    return n;
+}
+
+
+/**
+ * \brief Advance a list of buffers without transferring anything
+ * 
+ * \param [in] cur The buffer list cursor
+ * \param [in] bytes The number of bytes to skip
+ */
+static void
+skip_data(MVHDIOVCursor* cur, size_t bytes)
+{
+    MVHDIOVec segs[MVHD_IOV_BATCH];
+    size_t taken;
+
+    while (bytes > 0 && iov_take(cur, bytes, segs, MVHD_IOV_BATCH, &taken) > 0) {
+        bytes -= taken;
+    }
+}
+
+
+/**
+ * \brief Transfer a list of segments to or from a contiguous range of the image file
+ * 
+ * \return true if all bytes were transferred
+ */
+static bool
+transfer_segs(MVHDMeta* vhdm, const MVHDIOVec* segs, int n, size_t bytes, int64_t addr, bool write)
+{
+    const uint8_t* src;
+    int i;
+
+    if (write) {
+        return mvhd_pwritev(vhdm->fd, segs, n, addr) == (int64_t)bytes;
+    } else if (vhdm->map.addr != NULL && addr + (int64_t)bytes <= vhdm->map.size) {
+        src = vhdm->map.addr + addr;
+        for (i = 0; i < n; i++) {
+            memcpy(segs[i].base, src, segs[i].len);
+            src += segs[i].len;
+        }
+        return true;
+    }
+
+    return mvhd_preadv(vhdm->fd, segs, n, addr) == (int64_t)bytes;
+}
+
+
+/**
+ * \brief Queue a transfer in a batch
+ * 
+ * \return true if the transfer was queued, false if the batch could not be grown
+ */
+static bool
+queue_segs(MVHDBatch* batch, MVHDMeta* vhdm, const MVHDIOVec* segs, int n, int64_t addr, bool write)
+{
+    MVHDExtent* ext;
+    int i, cap;
+
+    if (batch->count + n > batch->capacity) {
+        cap = (batch->capacity == 0) ? 64 : batch->capacity * 2;
+        while (cap < batch->count + n) {
+            cap *= 2;
+        }
+        ext = realloc(batch->extents, (size_t)cap * sizeof *ext);
+        if (ext == NULL) {
+            return false;
+        }
+        batch->extents = ext;
+        batch->capacity = cap;
+    }
+    for (i = 0; i < n; i++) {
+        ext = &batch->extents[batch->count];
+        ext->owner = vhdm;
+        ext->addr = addr;
+        ext->base = segs[i].base;
+        ext->len = segs[i].len;
+        ext->seq = batch->count++;
+        ext->write = write;
+        addr += (int64_t)segs[i].len;
+    }
+
+    return true;
+}
+
+
+/**
+ * \brief Remember sectors written by a batch, to be marked once the data is on disk
+ * 
+ * Runs that continue the previous one in the same block are merged with it.
+ * 
+ * \return true if the run was queued, false if the batch could not be grown
+ */
+static bool
+queue_mark(MVHDBatch* batch, int blk, int start, int end)
+{
+    MVHDMark* mark;
+    int cap;
+
+    if (batch->mark_count > 0) {
+        mark = &batch->marks[batch->mark_count - 1];
+        if (mark->blk == blk && mark->end == start) {
+            mark->end = end;
+            return true;
+        }
+    }
+    if (batch->mark_count == batch->mark_capacity) {
+        cap = (batch->mark_capacity == 0) ? 16 : batch->mark_capacity * 2;
+        mark = realloc(batch->marks, (size_t)cap * sizeof *mark);
+        if (mark == NULL) {
+            return false;
+        }
+        batch->marks = mark;
+        batch->mark_capacity = cap;
+    }
+    mark = &batch->marks[batch->mark_count++];
+    mark->blk = blk;
+    mark->start = start;
+    mark->end = end;
+
+    return true;
+}
+
+
+/**
+ * \brief Find the first sector of a range that a batch has written, but not marked yet
+ * 
+ * \param [in] batch The batch, or NULL
+ * \param [in] blk The block
+ * \param [in] start The first sector in the block to look at
+ * \param [in] end The sector in the block after the last one to look at
+ * \param [out] pend_end If a sector is found, the end of the written run it starts
+ * 
+ * \return The first such sector, or end if there is none
+ */
+static int
+pending_mark(const MVHDBatch* batch, int blk, int start, int end, int* pend_end)
+{
+    const MVHDMark* mark;
+    int i, first = end;
+
+    *pend_end = end;
+    if (batch == NULL) {
+        return end;
+    }
+    for (i = 0; i < batch->mark_count; i++) {
+        mark = &batch->marks[i];
+        if (mark->blk != blk || mark->end <= start || mark->start >= end) {
+            continue;
+        }
+        if (mark->start <= start) {
+            *pend_end = (mark->end < end) ? mark->end : end;
+            return start;
+        }
+        if (mark->start < first) {
+            first = mark->start;
+        }
+    }
+
+    return first;
+}
+
+
+/**
+ * \brief Transfer data between the image file and a list of buffers
+ * 
+ * Contiguous file ranges are transferred with a single vectored system call per batch 
+ * of segments. If the image is memory mapped and the mapping covers the range, reads 
+ * are copied straight from the mapping instead. If the cursor belongs to a batch, the 
+ * transfer is queued in the batch instead of being performed.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] cur The buffer list cursor
+ * \param [in] bytes The number of bytes to transfer
+ * \param [in] addr The absolute file offset to transfer to or from
+ * \param [in] write true to write to the file, false to read from it
+ * 
+ * \return true if all bytes were transferred or queued
+ */
+static bool
+transfer_data(MVHDMeta* vhdm, MVHDIOVCursor* cur, size_t bytes, int64_t addr, bool write)
+{
+    MVHDIOVec segs[MVHD_IOV_BATCH];
+    size_t taken;
+    int n;
+    bool ok = true;
+
+    while (bytes > 0) {
+        n = iov_take(cur, bytes, segs, MVHD_IOV_BATCH, &taken);
+        if (n == 0) {
+            break;
+        }
+        /* If the batch can't grow, the transfer is simply done right away */
+        if (cur->batch == NULL || !queue_segs(cur->batch, vhdm, segs, n, addr, write)) {
+            if (!transfer_segs(vhdm, segs, n, taken, addr, write)) {
+                if (cur->batch != NULL) {
+                    cur->batch->failed = true;
+                }
+                ok = false;
+            }
+        }
+        addr += (int64_t)taken;
+        bytes -= taken;
+    }
+
+    return ok;
+}
+
+
+/* Order extents by file, then by offset, then by the order they were queued in */
+static int
+compare_extents(const void* a, const void* b)
+{
+    const MVHDExtent* ea = (const MVHDExtent*)a;
+    const MVHDExtent* eb = (const MVHDExtent*)b;
+
+    if (ea->owner->fd != eb->owner->fd) {
+        return (ea->owner->fd < eb->owner->fd) ? -1 : 1;
+    }
+    if (ea->addr != eb->addr) {
+        return (ea->addr < eb->addr) ? -1 : 1;
+    }
+
+    return (ea->seq < eb->seq) ? -1 : (ea->seq > eb->seq);
+}
+
+
+void
+mvhd_sort_batch(MVHDBatch* batch)
+{
+    qsort(batch->extents, (size_t)batch->count, sizeof *batch->extents, compare_extents);
+}
+
+
+int
+mvhd_batch_group(const MVHDBatch* batch, int first, int max_extents)
+{
+    const MVHDExtent* start = &batch->extents[first];
+    const MVHDExtent* ext;
+    int64_t end = start->addr;
+    int i;
+
+    for (i = first; i < batch->count && i - first < max_extents; i++) {
+        ext = &batch->extents[i];
+        if (ext->owner != start->owner || ext->write != start->write || ext->addr != end) {
+            break;
+        }
+        end += (int64_t)ext->len;
+    }
+
+    return i;
+}
+
+
+int
+mvhd_run_batch(MVHDBatch* batch)
+{
+    MVHDIOVec segs[MVHD_IOV_BATCH];
+    MVHDExtent* first;
+    size_t bytes;
+    int i, j, n, ret = batch->failed ? -1 : 0;
+
+    mvhd_sort_batch(batch);
+
+    for (i = 0; i < batch->count; i = j) {
+        first = &batch->extents[i];
+        j = mvhd_batch_group(batch, i, MVHD_IOV_BATCH);
+        bytes = 0;
+        for (n = 0; n < j - i; n++) {
+            segs[n].base = first[n].base;
+            segs[n].len = first[n].len;
+            bytes += first[n].len;
+        }
+        if (!transfer_segs(first->owner, segs, n, bytes, first->addr, first->write)) {
+            ret = -1;
+        }
+    }
+    batch->count = 0;
+    batch->failed = false;
+
+    return ret;
+}
+
+
+/**
+ * \brief Fill the next bytes of a list of buffers with zeros
+ * 
+ * \param [in] cur The buffer list cursor
+ * \param [in] bytes The number of bytes to zero
+ */
+static void
+zero_data(MVHDIOVCursor* cur, size_t bytes)
+{
+    MVHDIOVec segs[MVHD_IOV_BATCH];
+    size_t taken;
+    int i, n;
+
+    while (bytes > 0) {
+        n = iov_take(cur, bytes, segs, MVHD_IOV_BATCH, &taken);
+        if (n == 0) {
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            memset(segs[i].base, 0, segs[i].len);
+        }
+        bytes -= taken;
+    }
+}
+
+
+int
+mvhd_fixed_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOVCursor* out_iov) {
+    int64_t addr;
+    int transfer_sectors, truncated_sectors;
+    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+
+    check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
+
+    addr = (int64_t)offset * MVHD_SECTOR_SIZE;
+    transfer_data(vhdm, out_iov, (size_t)transfer_sectors * MVHD_SECTOR_SIZE, addr, false);
+
+    return truncated_sectors;
+}
+
+
+/**
+ * \brief Find a run of identical bits in a block's sector bitmap
+ * 
+ * A parent shared between children may be read from several threads at once, so its 
+ * bitmap cache is only used with its lock held.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] blk The block whose bitmap to scan
+ * \param [in] start The first sector in the block to examine
+ * \param [in] end One past the last sector in the block to examine
+ * \param [out] set Whether the run consists of set (true) or clear (false) bits
+ * 
+ * \return The number of sectors in the run, at least 1 if start < end
+ */
+static int
+sect_bitmap_run(MVHDMeta* vhdm, int blk, int start, int end, bool* set)
+{
+    int run;
+
+    if (vhdm->lock != NULL) {
+        mvhd_mutex_lock(vhdm->lock);
+    }
+    run = bitmap_run_length(get_sect_bitmap(vhdm, blk)->bitmap, start, end, set);
+    if (vhdm->lock != NULL) {
+        mvhd_mutex_unlock(vhdm->lock);
+    }
+
+    return run;
+}
+
+
+int
+mvhd_sparse_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOVCursor* out_iov)
+{
+    int transfer_sectors, truncated_sectors;
+    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+
+    check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
+
+    int64_t addr;
+    uint32_t s, ls;
+    int blk, sib, end_sib, run;
+    bool set;
+    ls = offset + transfer_sectors;
+
+    for (s = offset; s < ls; ) {
+        blk = s / vhdm->sect_per_block;
+        sib = s % vhdm->sect_per_block;
+        end_sib = vhdm->sect_per_block;
+        if ((ls - s) < (uint32_t)(end_sib - sib)) {
+            end_sib = sib + (int)(ls - s);
+        }
+
+        if (vhdm->block_offset[blk] == MVHD_SPARSE_BLK) {
+            /* Nothing has been written to this block, so there is nothing to read */
+            run = end_sib - sib;
+            zero_data(out_iov, (size_t)run * MVHD_SECTOR_SIZE);
+            s += run;
+            continue;
+        }
+
+        /* Serve each run of set sectors with a single read, and each run of clear sectors with a single memset */
+        while (sib < end_sib) {
+            run = sect_bitmap_run(vhdm, blk, sib, end_sib, &set);
+            if (set) {
+                addr = ((int64_t)vhdm->block_offset[blk] + vhdm->bitmap.sector_count + sib) * MVHD_SECTOR_SIZE;
+                transfer_data(vhdm, out_iov, (size_t)run * MVHD_SECTOR_SIZE, addr, false);
+            } else {
+                zero_data(out_iov, (size_t)run * MVHD_SECTOR_SIZE);
+            }
+            sib += run;
+            s += run;
+        }
+    }
+
+    return truncated_sectors;
+}
+
+
+/**
+ * \brief Walk a differencing chain to find which image owns a run of sectors
+ * 
+ * Starting at the child, each layer's sector bitmap is scanned for a run of identical 
+ * bits beginning at offset. A run of set bits belongs to that layer. A run of clear bits 
+ * is passed on to the parent, which may only shorten it further. A dynamic or fixed 
+ * image at the bottom of the chain owns whatever reaches it.
+ * 
+ * \param [in] vhdm MiniVHD data structure of the child image
+ * \param [in] offset Sector offset the run starts at
+ * \param [in] num_sectors The maximum length of the run
+ * \param [out] owner The image that the run should be read from
+ * \param [out] depth The position of owner in the chain, 0 being the child
+ * 
+ * \return The number of sectors in the run, between 1 and num_sectors
+ */
+static int
+walk_chain(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDMeta** owner, int* depth)
+{
+    MVHDMeta* curr_vhdm = vhdm;
+    int run = num_sectors;
+    int blk, sib, end_sib;
+    bool set;
+
+    *depth = 0;
+    while (curr_vhdm->footer.disk_type == MVHD_TYPE_DIFF) {
+        blk = offset / curr_vhdm->sect_per_block;
+        sib = offset % curr_vhdm->sect_per_block;
+        end_sib = curr_vhdm->sect_per_block;
+        if (run < end_sib - sib) {
+            end_sib = sib + run;
+        }
+
+        if (curr_vhdm->block_offset[blk] == MVHD_SPARSE_BLK) {
+            set = false;
+            run = end_sib - sib;
+        } else {
+            run = sect_bitmap_run(curr_vhdm, blk, sib, end_sib, &set);
+        }
+        if (set) {
+            break;
+        }
+        curr_vhdm = curr_vhdm->parent;
+        (*depth)++;
+    }
+    *owner = curr_vhdm;
+
+    return run;
+}
+
+
+/**
+ * \brief Resolve which image in a differencing chain owns a run of sectors
+ * 
+ * Most blocks are owned by a single layer as a whole. The first time a block is read, 
+ * the chain is walked for all of it. If one layer owns the whole block, that layer is 
+ * remembered in the block owner map, and later reads go straight to it. Blocks owned 
+ * by several layers are walked every time. Writes and discards to a block forget its 
+ * owner.
+ * 
+ * \param [in] vhdm MiniVHD data structure of the child image
+ * \param [in] offset Sector offset the run starts at
+ * \param [in] num_sectors The maximum length of the run
+ * \param [out] owner The image that the run should be read from
+ * 
+ * \return The number of sectors in the run, between 1 and num_sectors
+ */
+static int
+diff_resolve_run(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDMeta** owner)
+{
+    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+    uint32_t start, len;
+    int blk, depth, run;
+
+    if (vhdm->block_owner == NULL) {
+        return walk_chain(vhdm, offset, num_sectors, owner, &depth);
+    }
+
+    blk = offset / vhdm->sect_per_block;
+    start = (uint32_t)blk * vhdm->sect_per_block;
+    len = (uint32_t)vhdm->sect_per_block;
+    if (len > total_sectors - start) {
+        len = total_sectors - start;
+    }
+    if (vhdm->block_owner[blk] == MVHD_OWNER_UNKNOWN) {
+        run = walk_chain(vhdm, start, (int)len, owner, &depth);
+        vhdm->block_owner[blk] = ((uint32_t)run == len && depth < MVHD_OWNER_MIXED) ? (uint8_t)depth : MVHD_OWNER_MIXED;
+    }
+    if (vhdm->block_owner[blk] == MVHD_OWNER_MIXED) {
+        return walk_chain(vhdm, offset, num_sectors, owner, &depth);
+    }
+
+    *owner = vhdm;
+    for (depth = vhdm->block_owner[blk]; depth > 0; depth--) {
+        *owner = (*owner)->parent;
+    }
+    run = (int)(start + len - offset);
+
+    return (run < num_sectors) ? run : num_sectors;
+}
+
+
+/**
+ * \brief Forget which layer owns a block, after its sector bitmap changed
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] blk The block
+ */
+static void
+forget_owner(MVHDMeta* vhdm, int blk)
+{
+    if (vhdm->block_owner != NULL) {
+        vhdm->block_owner[blk] = MVHD_OWNER_UNKNOWN;
+    }
+}
 
 
-/**
- * \brief Check that we will not be overflowing buffers
- * 
- * \param [in] offset The offset from which we are beginning from
- * \param [in] num_sectors The number of sectors which we desire to read/write
- * \param [in] total_sectors The total number of sectors available
- * \param [out] transfer_sect The number of sectors to actually write. 
- * This may be lower than num_sectors if offset + num_sectors >= total_sectors
- * \param [out] trunc_sectors The number of sectors truncated if transfer_sectors < num_sectors
- */
-static inline void
-check_sectors(uint32_t offset, int num_sectors, uint32_t total_sectors, int* transfer_sect, int* trunc_sect)
+int
+mvhd_diff_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOVCursor* out_iov)
 {
-    *transfer_sect = num_sectors;
-    *trunc_sect = 0;
+    int transfer_sectors, truncated_sectors;
+    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
 
-    if ((total_sectors - offset) < (uint32_t)*transfer_sect) {
-        *transfer_sect = total_sectors - offset;
-        *trunc_sect = num_sectors - *transfer_sect;
+    check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
+
+    MVHDMeta* owner;
+    uint32_t s, ls;
+    int run;
+    ls = offset + transfer_sectors;
+
+    for (s = offset; s < ls; s += run) {
+        run = diff_resolve_run(vhdm, s, (int)(ls - s), &owner);
+
+        /* We handle actual sector reading using the fixed or sparse functions,
+           as a differencing VHD is also a sparse VHD */
+        if (owner->footer.disk_type == MVHD_TYPE_DIFF || owner->footer.disk_type == MVHD_TYPE_DYNAMIC) {
+            mvhd_sparse_read(owner, s, run, out_iov);
+        } else {
+            mvhd_fixed_read(owner, s, run, out_iov);
+        }
     }
+
+    return truncated_sectors;
 }
 
 
-void
-mvhd_write_empty_sectors(FILE* f, int sector_count)
+int
+mvhd_resolve_run(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDMeta** owner, bool* allocated)
 {
-    uint8_t zero_bytes[MVHD_SECTOR_SIZE] = {0};
-    int i;
+    int run = num_sectors;
+    int blk, sib, end_sib;
+
+    *owner = vhdm;
+    if (vhdm->footer.disk_type == MVHD_TYPE_DIFF) {
+        run = diff_resolve_run(vhdm, offset, num_sectors, owner);
+    }
+    if ((*owner)->footer.disk_type == MVHD_TYPE_FIXED) {
+        *allocated = true;
+        return run;
+    }
 
-    for (i = 0; i < sector_count; i++) {
-        fwrite(zero_bytes, sizeof zero_bytes, 1, f);
+    /* A differencing owner has the run marked, but a dynamic image at the bottom may not */
+    blk = offset / (*owner)->sect_per_block;
+    sib = offset % (*owner)->sect_per_block;
+    end_sib = (*owner)->sect_per_block;
+    if (run < end_sib - sib) {
+        end_sib = sib + run;
+    }
+    if ((*owner)->block_offset[blk] == MVHD_SPARSE_BLK) {
+        *allocated = false;
+        return end_sib - sib;
     }
+
+    return sect_bitmap_run(*owner, blk, sib, end_sib, allocated);
 }
 
 
-/**
- * \brief Read the sector bitmap for a block.
- * 
- * If the block is sparse, the sector bitmap in memory will be 
- * zeroed. Otherwise, the sector bitmap is read from the VHD file.
- * 
- * \param [in] vhdm MiniVHD data structure
- * \param [in] blk The block for which to read the sector bitmap from
- */
-static void
-read_sect_bitmap(MVHDMeta* vhdm, int blk)
+const void*
+mvhd_fixed_map(MVHDMeta* vhdm, uint32_t offset, int num_sectors, size_t* len)
 {
-    if (vhdm->block_offset[blk] != MVHD_SPARSE_BLK) {
-        mvhd_fseeko64(vhdm->f, (uint64_t)vhdm->block_offset[blk] * MVHD_SECTOR_SIZE, SEEK_SET);
-        fread(vhdm->bitmap.curr_bitmap, vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE, 1, vhdm->f);
-    } else {
-        memset(vhdm->bitmap.curr_bitmap, 0, vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE);
+    int transfer_sectors, truncated_sectors;
+    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+    int64_t addr = (int64_t)offset * MVHD_SECTOR_SIZE;
+
+    *len = 0;
+    if (vhdm->map.addr == NULL || offset >= total_sectors || num_sectors <= 0) {
+        return NULL;
+    }
+    check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
+    if (addr + (int64_t)transfer_sectors * MVHD_SECTOR_SIZE > vhdm->map.size) {
+        return NULL;
+    }
+    *len = (size_t)transfer_sectors * MVHD_SECTOR_SIZE;
+
+    return vhdm->map.addr + addr;
+}
+
+
+const void*
+mvhd_sparse_map(MVHDMeta* vhdm, uint32_t offset, int num_sectors, size_t* len)
+{
+    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+    int blk, sib, end_sib, run;
+    int64_t addr;
+    bool set;
+
+    *len = 0;
+    if (vhdm->map.addr == NULL || offset >= total_sectors || num_sectors <= 0) {
+        return NULL;
+    }
+
+    blk = offset / vhdm->sect_per_block;
+    sib = offset % vhdm->sect_per_block;
+    if (vhdm->block_offset[blk] == MVHD_SPARSE_BLK) {
+        return NULL;
+    }
+    end_sib = vhdm->sect_per_block;
+    if ((uint32_t)num_sectors < (uint32_t)(end_sib - sib)) {
+        end_sib = sib + num_sectors;
+    }
+    if (total_sectors - offset < (uint32_t)(end_sib - sib)) {
+        end_sib = sib + (int)(total_sectors - offset);
+    }
+
+    /* Only sectors that are actually stored in the block can be handed out */
+    run = bitmap_run_length(get_sect_bitmap(vhdm, blk)->bitmap, sib, end_sib, &set);
+    if (!set) {
+        return NULL;
+    }
+    addr = ((int64_t)vhdm->block_offset[blk] + vhdm->bitmap.sector_count + sib) * MVHD_SECTOR_SIZE;
+    if (addr + (int64_t)run * MVHD_SECTOR_SIZE > vhdm->map.size) {
+        return NULL;
     }
+    *len = (size_t)run * MVHD_SECTOR_SIZE;
+
+    return vhdm->map.addr + addr;
+}
+
+
+int
+mvhd_fixed_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOVCursor* in_iov)
+{
+    int64_t addr;
+    int transfer_sectors, truncated_sectors;
+    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+
+    check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
+
+    addr = (int64_t)offset * MVHD_SECTOR_SIZE;
+    transfer_data(vhdm, in_iov, (size_t)transfer_sectors * MVHD_SECTOR_SIZE, addr, true);
 
-    vhdm->bitmap.curr_block = blk;
+    return truncated_sectors;
 }
 
 
 /**
- * \brief Write the current sector bitmap in memory to file
+ * \brief Create a block from a write that covers all of it
+ * 
+ * There is no need to zero the new block first, as every sector is written. The 
+ * sector bitmap, as marked by the caller, and the data are written with a single 
+ * vectored write to a free slot, or appended where the footer was. Then the footer is 
+ * written at the new end if the file grew, and finally the BAT entry is updated, so 
+ * the block only becomes part of the image once its contents are complete. With 
+ * preallocation, the space is reserved before anything is written.
  * 
  * \param [in] vhdm MiniVHD data structure
+ * \param [in] blk The block number to create
+ * \param [in] bitmap The cached sector bitmap of the block, already marked
+ * \param [in] cur The buffers holding the data of the whole block
+ * 
+ * \return true if the block was written. If not, the BAT entry is left alone, and the 
+ *         space taken for the block is given back
  */
-static void
-write_curr_sect_bitmap(MVHDMeta* vhdm)
+static bool
+write_full_block(MVHDMeta* vhdm, int blk, MVHDBitmapEntry* bitmap, MVHDIOVCursor* cur)
 {
-    if (vhdm->bitmap.curr_block >= 0) {
-        int64_t abs_offset = (int64_t)vhdm->block_offset[vhdm->bitmap.curr_block] * MVHD_SECTOR_SIZE;
-        mvhd_fseeko64(vhdm->f, abs_offset, SEEK_SET);
-        fwrite(vhdm->bitmap.curr_bitmap, MVHD_SECTOR_SIZE, vhdm->bitmap.sector_count, vhdm->f);
+    MVHDIOVec segs[MVHD_IOV_BATCH];
+    uint8_t footer[MVHD_FOOTER_SIZE];
+    int64_t slot = vhdm->place_block(vhdm, blk);
+    int64_t abs_offset = (slot >= 0) ? slot : vhdm->data_end;
+    size_t bitmap_bytes = (size_t)vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE;
+    size_t data_bytes = (size_t)vhdm->sect_per_block * MVHD_SECTOR_SIZE;
+    size_t taken;
+    int n;
+    bool ok;
+
+    /* Keep the same padding after the block as create_block() */
+    int64_t new_end = abs_offset + (int64_t)bitmap_bytes + (int64_t)data_bytes + 5 * MVHD_SECTOR_SIZE;
+    bool reserved = slot < 0 && reserve_tail(vhdm, new_end);
+
+    forget_owner(vhdm, blk);
+    segs[0].base = bitmap->bitmap;
+    segs[0].len = bitmap_bytes;
+    n = iov_take(cur, data_bytes, segs + 1, MVHD_IOV_BATCH - 1, &taken);
+    ok = mvhd_pwritev(vhdm->fd, segs, n + 1, abs_offset) == (int64_t)(bitmap_bytes + taken);
+    if (taken < data_bytes) {
+        /* The caller's data is in too many pieces for one call */
+        ok = transfer_data(vhdm, cur, data_bytes - taken, abs_offset + (int64_t)(bitmap_bytes + taken), true) && ok;
+    }
+
+    /* Writing the footer past the end of the file extends it, and the padding reads as zeros */
+    if (ok && slot < 0 && !reserved) {
+        mvhd_footer_to_buffer(&vhdm->footer, footer);
+        ok = mvhd_pwrite(vhdm->fd, footer, sizeof footer, new_end) == sizeof footer;
+        if (ok) {
+            vhdm->data_end = new_end;
+        }
     }
+    if (!ok) {
+        /* The block stays unallocated, so none of its sectors may stay marked */
+        memset(bitmap->bitmap, 0, bitmap_bytes);
+        if (slot >= 0) {
+            add_free_slot(vhdm, (uint32_t)(slot / MVHD_SECTOR_SIZE));
+        } else if (reserved) {
+            /* Preallocated space has to read as zero */
+            mvhd_punch_hole(vhdm->fd, abs_offset, (int)((new_end - abs_offset) / MVHD_SECTOR_SIZE));
+            vhdm->data_end = abs_offset;
+        } else {
+            /* The write may have gone over the old footer */
+            mvhd_footer_to_buffer(&vhdm->footer, footer);
+            mvhd_pwrite(vhdm->fd, footer, sizeof footer, abs_offset);
+            mvhd_ftruncate64(vhdm->fd, abs_offset + MVHD_FOOTER_SIZE);
+        }
+        return false;
+    }
+
+    vhdm->block_offset[blk] = (uint32_t)(abs_offset / MVHD_SECTOR_SIZE);
+    update_bat(vhdm, blk, blk);
+
+    return true;
+}
+
+
+int
+mvhd_sparse_write_block(MVHDMeta* vhdm, int blk, const uint8_t* bitmap, void* data)
+{
+    MVHDBitmapEntry* ent = get_sect_bitmap(vhdm, blk);
+    MVHDIOVCursor cur = {0};
+    MVHDIOVec iov;
+
+    memcpy(ent->bitmap, bitmap, (size_t)vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE);
+    iov.base = data;
+    iov.len = (size_t)vhdm->sect_per_block * MVHD_SECTOR_SIZE;
+    cur.iov = &iov;
+    cur.iovcnt = 1;
+
+    return write_full_block(vhdm, blk, ent, &cur) ? 0 : -1;
 }
 
 
 /**
- * \brief Write block offset from memory into file
+ * \brief Find a run of sectors to be written that can, or can't, be skipped
+ * 
+ * In a dynamic VHD, sectors that are not marked in the sector bitmap read as zero. 
+ * Writing zeros to them changes nothing, so such writes can be skipped. That includes 
+ * all sectors of a block that has not been allocated. Sectors written earlier in the 
+ * same batch are not marked yet, but are never skipped.
  * 
  * \param [in] vhdm MiniVHD data structure
- * \param [in] blk The block for which to write the offset for
+ * \param [in] blk The block being written to
+ * \param [in] bitmap The sector bitmap of the block
+ * \param [in] cur The buffers holding the data to write, positioned at sector start. 
+ *             The cursor is not advanced
+ * \param [in] start The first sector in the block to write
+ * \param [in] end The sector in the block after the last one to write
+ * \param [out] skip Set to true if the run can be skipped
+ * 
+ * \return The number of sectors in the run
  */
-static void
-write_bat_entry(MVHDMeta* vhdm, int blk)
+static int
+zero_skip_run(MVHDMeta* vhdm, int blk, uint8_t* bitmap, const MVHDIOVCursor* cur, int start, int end, bool* skip)
 {
-    uint64_t table_offset = vhdm->sparse.bat_offset + ((uint64_t)blk * sizeof *vhdm->block_offset);
-    uint32_t offset = mvhd_to_be32(vhdm->block_offset[blk]);
+    MVHDIOVCursor peek = *cur;
+    MVHDIOVec segs[MVHD_IOV_BATCH];
+    bool sparse = vhdm->block_offset[blk] == MVHD_SPARSE_BLK;
+    bool zero, sector_skip;
+    size_t taken, got;
+    int i, j, n, first, pend_end;
+
+    for (i = start; i < end; i++) {
+        zero = true;
+        for (got = 0; got < MVHD_SECTOR_SIZE; got += taken) {
+            n = iov_take(&peek, MVHD_SECTOR_SIZE - got, segs, MVHD_IOV_BATCH, &taken);
+            if (n == 0) {
+                break;
+            }
+            for (j = 0; j < n && zero; j++) {
+                zero = mvhd_is_zero(segs[j].base, segs[j].len);
+            }
+        }
+        sector_skip = zero && (sparse || !VHD_TESTBIT(bitmap, i));
+        if (i == start) {
+            *skip = sector_skip;
+        } else if (sector_skip != *skip) {
+            break;
+        }
+    }
+
+    if (*skip) {
+        first = pending_mark(cur->batch, blk, start, i, &pend_end);
+        if (first == start) {
+            *skip = false;
+            return pend_end - start;
+        }
+        i = first;
+    }
 
-    mvhd_fseeko64(vhdm->f, table_offset, SEEK_SET);
-    fwrite(&offset, sizeof offset, 1, vhdm->f);
+    return i - start;
 }
 
 
 /**
- * \brief Create an empty block in a sparse or differencing VHD image
- * 
- * VHD images store data in blocks, which are typically 4096 sectors in size 
- * (~2MB). These blocks may be stored on disk in any order. Blocks are created 
- * on demand when required.
- * 
- * This function creates new, empty blocks, by replacing the footer at the end of the file 
- * and then re-inserting the footer at the new file end. The BAT table entry for the
- * new block is updated with the new offset.
+ * \brief Mark a range of sectors in a block as written
  * 
  * \param [in] vhdm MiniVHD data structure
- * \param [in] blk The block number to create
+ * \param [in] blk The block
+ * \param [in] bitmap The cached sector bitmap of the block
+ * \param [in] sib The first sector in the block
+ * \param [in] end_sib The sector in the block after the last one
+ * \param [in] write_now If true, write the sector bitmap to the file immediately
  */
 static void
-create_block(MVHDMeta* vhdm, int blk)
+mark_sectors(MVHDMeta* vhdm, int blk, MVHDBitmapEntry* bitmap, int sib, int end_sib, bool write_now)
 {
-    uint8_t footer[MVHD_FOOTER_SIZE];
+    bitmap_set_range(bitmap->bitmap, sib, end_sib);
+    forget_owner(vhdm, blk);
+    if (write_now) {
+        write_sect_bitmap(vhdm, blk, bitmap->bitmap);
+    } else {
+        bitmap->dirty = true;
+    }
+}
 
-    /* Seek to where the footer SHOULD be */
-    mvhd_fseeko64(vhdm->f, -MVHD_FOOTER_SIZE, SEEK_END);
-    fread(footer, sizeof footer, 1, vhdm->f);
-    mvhd_fseeko64(vhdm->f, -MVHD_FOOTER_SIZE, SEEK_END);
 
-    if (!mvhd_is_conectix_str(footer)) {
-        /* Oh dear. We use the header instead, since something has gone wrong at the footer */
-        mvhd_fseeko64(vhdm->f, 0, SEEK_SET);
-        fread(footer, sizeof footer, 1, vhdm->f);
-        mvhd_fseeko64(vhdm->f, 0, SEEK_END);
-    }
+int
+mvhd_sparse_diff_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOVCursor* in_iov)
+{
+    int transfer_sectors, truncated_sectors;
+    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+
+    check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
 
-    int64_t abs_offset = mvhd_ftello64(vhdm->f);
-    if (abs_offset % MVHD_SECTOR_SIZE != 0) {
-        /* Yikes! We're supposed to be on a sector boundary. Add some padding */
-        int64_t padding_amount = (int64_t)MVHD_SECTOR_SIZE - (abs_offset % MVHD_SECTOR_SIZE);
-        uint8_t zero_byte = 0;
-        int i;
-        for (i = 0; i < padding_amount; i++) {
-            fwrite(&zero_byte, sizeof zero_byte, 1, vhdm->f);
+    MVHDBitmapEntry* bitmap;
+    MVHDBatch* batch;
+    int64_t addr;
+    uint32_t s, ls;
+    int blk, sib, end_sib, run, i, part;
+    bool skip;
+    bool detect = vhdm->zero_detect && vhdm->footer.disk_type == MVHD_TYPE_DYNAMIC;
+    ls = offset + transfer_sectors;
+
+    for (s = offset; s < ls; s += run) {
+        blk = s / vhdm->sect_per_block;
+        sib = s % vhdm->sect_per_block;
+        end_sib = vhdm->sect_per_block;
+        if ((ls - s) < (uint32_t)(end_sib - sib)) {
+            end_sib = sib + (int)(ls - s);
+        }
+        run = end_sib - sib;
+
+        /* Get the sector bitmap first, before creating a new block, as the bitmap will be
+           zero either way */
+        bitmap = get_sect_bitmap(vhdm, blk);
+
+        for (i = sib; i < end_sib; i += part) {
+            part = end_sib - i;
+            if (detect) {
+                part = zero_skip_run(vhdm, blk, bitmap->bitmap, in_iov, i, end_sib, &skip);
+                if (skip) {
+                    skip_data(in_iov, (size_t)part * MVHD_SECTOR_SIZE);
+                    continue;
+                }
+            }
+            if (vhdm->block_offset[blk] == MVHD_SPARSE_BLK) {
+                if (part == vhdm->sect_per_block && in_iov->batch == NULL) {
+                    bitmap_set_range(bitmap->bitmap, 0, vhdm->sect_per_block);
+                    write_full_block(vhdm, blk, bitmap, in_iov);
+                    continue;
+                }
+                create_block(vhdm, blk);
+            }
+
+            /* Batched and asynchronous writes leave the sector bitmap alone until their data 
+               is on disk. If the sectors can't be remembered until then, they are written now */
+            batch = in_iov->batch;
+            if (batch != NULL && !queue_mark(batch, blk, i, i + part)) {
+                in_iov->batch = NULL;
+            }
+
+            addr = ((int64_t)vhdm->block_offset[blk] + vhdm->bitmap.sector_count + i) * MVHD_SECTOR_SIZE;
+            transfer_data(vhdm, in_iov, (size_t)part * MVHD_SECTOR_SIZE, addr, true);
+
+            /* The updated sector bitmap is written to disk now in strict mode, or later when
+               it is evicted from the cache or flushed */
+            if (in_iov->batch == NULL) {
+                mark_sectors(vhdm, blk, bitmap, i, i + part, vhdm->strict);
+            }
+            in_iov->batch = batch;
         }
-        abs_offset += padding_amount;
     }
 
-    uint32_t sect_offset = (uint32_t)(abs_offset / MVHD_SECTOR_SIZE);
-    int blk_size_sectors = vhdm->sparse.block_sz / MVHD_SECTOR_SIZE;
-    mvhd_write_empty_sectors(vhdm->f, vhdm->bitmap.sector_count + blk_size_sectors);
+    return truncated_sectors;
+}
 
-    /* Add a bit of padding. That's what Windows appears to do, although it's not strictly necessary... */
-    mvhd_write_empty_sectors(vhdm->f, 5);
 
-    /* And we finish with the footer */
-    fwrite(footer, sizeof footer, 1, vhdm->f);
+int
+mvhd_fixed_discard(MVHDMeta* vhdm, uint32_t offset, int num_sectors)
+{
+    int transfer_sectors, truncated_sectors;
+    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
 
-    /* We no longer have a sparse block. Update that BAT! */
-    vhdm->block_offset[blk] = sect_offset;
-    write_bat_entry(vhdm, blk);
+    check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
+    mvhd_punch_hole(vhdm->fd, (int64_t)offset * MVHD_SECTOR_SIZE, transfer_sectors);
+
+    return truncated_sectors;
 }
 
 
 int
-mvhd_fixed_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buff) {
-    int64_t addr;
+mvhd_fixed_preallocate(MVHDMeta* vhdm, uint32_t offset, int num_sectors)
+{
     int transfer_sectors, truncated_sectors;
     uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
 
     check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
 
-    addr = (int64_t)offset * MVHD_SECTOR_SIZE;
-    mvhd_fseeko64(vhdm->f, addr, SEEK_SET);
-    fread(out_buff, transfer_sectors*MVHD_SECTOR_SIZE, 1, vhdm->f);
+    /* The data is always in the file, but the host may have left holes in it */
+    mvhd_fallocate(vhdm->fd, (int64_t)offset * MVHD_SECTOR_SIZE, (int64_t)transfer_sectors * MVHD_SECTOR_SIZE);
 
     return truncated_sectors;
 }
 
 
+/**
+ * \brief Release a block that has no sectors in use
+ * 
+ * The BAT entry is reset first, so a crash part way leaves at worst some unused 
+ * space in the file. If the block was at the end of the data, the footer is moved 
+ * down to the end of the blocks still in use, and the file truncated. Otherwise the 
+ * block becomes a hole. Only the last block makes the BAT be searched for the new 
+ * end, so releasing every block of an image takes linear time.
+ * 
+ * A block at the end of a memory mapped image becomes a hole as well, as shrinking 
+ * the file would pull the pages out from under pointers returned by 
+ * mvhd_map_sectors(). Windows doesn't allow a mapped file to shrink either.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] blk The block to release
+ * \param [in] bitmap The cached sector bitmap of the block, which must be all clear
+ */
+static void
+release_block(MVHDMeta* vhdm, int blk, MVHDBitmapEntry* bitmap)
+{
+    uint8_t footer[MVHD_FOOTER_SIZE];
+    int64_t start = (int64_t)vhdm->block_offset[blk] * MVHD_SECTOR_SIZE;
+    int64_t new_end = vhdm->data_end;
+    int blk_sectors = vhdm->bitmap.sector_count + vhdm->sect_per_block;
+    int64_t blk_bytes = (int64_t)blk_sectors * MVHD_SECTOR_SIZE;
+
+    /* The cached bitmap now describes a sparse block, and must never be written back. 
+       The entry is written right away, so the space can't be reused while the BAT in 
+       the file still points at it */
+    bitmap->dirty = false;
+    vhdm->block_offset[blk] = MVHD_SPARSE_BLK;
+    write_bat_entry(vhdm, blk);
+
+    /* Only the last block can be followed by less than a block's worth of space */
+    if (vhdm->map.addr == NULL && vhdm->data_end - (start + blk_bytes) < blk_bytes) {
+        new_end = mvhd_used_end(vhdm);
+    }
+    if (new_end < vhdm->data_end) {
+        mvhd_footer_to_buffer(&vhdm->footer, footer);
+        if (mvhd_pwrite(vhdm->fd, footer, sizeof footer, new_end) == sizeof footer &&
+            mvhd_ftruncate64(vhdm->fd, new_end + MVHD_FOOTER_SIZE) == 0) {
+            vhdm->data_end = new_end;
+            vhdm->prealloc_end = 0;
+            trim_free_slots(vhdm);
+        }
+    }
+    if (start < vhdm->data_end) {
+        mvhd_punch_hole(vhdm->fd, start, blk_sectors);
+        add_free_slot(vhdm, (uint32_t)(start / MVHD_SECTOR_SIZE));
+    }
+}
+
+
 int
-mvhd_sparse_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buff)
+mvhd_sparse_discard(MVHDMeta* vhdm, uint32_t offset, int num_sectors)
 {
     int transfer_sectors, truncated_sectors;
     uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
 
     check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
 
-    uint8_t* buff = (uint8_t*)out_buff;
+    MVHDBitmapEntry* bitmap;
     int64_t addr;
     uint32_t s, ls;
-    int blk, prev_blk, sib;
+    int blk, sib, end_sib, run;
+    bool set;
     ls = offset + transfer_sectors;
-    prev_blk = -1;
 
-    for (s = offset; s < ls; s++) {
+    for (s = offset; s < ls; s += run) {
         blk = s / vhdm->sect_per_block;
         sib = s % vhdm->sect_per_block;
-        if (blk != prev_blk) {
-            prev_blk = blk;
-            if (vhdm->bitmap.curr_block != blk) {
-                read_sect_bitmap(vhdm, blk);
-                mvhd_fseeko64(vhdm->f, (uint64_t)sib * MVHD_SECTOR_SIZE, SEEK_CUR);
-            } else {
-                addr = ((int64_t)vhdm->block_offset[blk] + vhdm->bitmap.sector_count + sib) * MVHD_SECTOR_SIZE;
-                mvhd_fseeko64(vhdm->f, addr, SEEK_SET);
-            }
-        }        
+        end_sib = vhdm->sect_per_block;
+        if ((ls - s) < (uint32_t)(end_sib - sib)) {
+            end_sib = sib + (int)(ls - s);
+        }
+        run = end_sib - sib;
+
+        if (vhdm->block_offset[blk] == MVHD_SPARSE_BLK) {
+            continue;
+        }
+        bitmap = get_sect_bitmap(vhdm, blk);
+        bitmap_clear_range(bitmap->bitmap, sib, end_sib);
+        forget_owner(vhdm, blk);
+        if (bitmap_run_length(bitmap->bitmap, 0, vhdm->sect_per_block, &set) == vhdm->sect_per_block && !set) {
+            release_block(vhdm, blk, bitmap);
+            continue;
+        }
 
-        if (VHD_TESTBIT(vhdm->bitmap.curr_bitmap, sib)) {
-            fread(buff, MVHD_SECTOR_SIZE, 1, vhdm->f);
+        /* Other readers expect sectors that are not in use to hold zeros, so zero the 
+           data before the bitmap says the sectors are free */
+        addr = ((int64_t)vhdm->block_offset[blk] + vhdm->bitmap.sector_count + sib) * MVHD_SECTOR_SIZE;
+        mvhd_punch_hole(vhdm->fd, addr, run);
+        if (vhdm->strict) {
+            write_sect_bitmap(vhdm, blk, bitmap->bitmap);
         } else {
-            memset(buff, 0, MVHD_SECTOR_SIZE);
-            mvhd_fseeko64(vhdm->f, MVHD_SECTOR_SIZE, SEEK_CUR);
+            bitmap->dirty = true;
         }
-        buff += MVHD_SECTOR_SIZE;
     }
 
     return truncated_sectors;
@@ -266,124 +1997,190 @@ mvhd_sparse_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buf
 
 
 int
-mvhd_diff_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buff)
+mvhd_sparse_preallocate(MVHDMeta* vhdm, uint32_t offset, int num_sectors)
 {
     int transfer_sectors, truncated_sectors;
     uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
 
     check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
+    if (transfer_sectors <= 0) {
+        return truncated_sectors;
+    }
 
-    uint8_t* buff = (uint8_t*)out_buff;
-    MVHDMeta* curr_vhdm = vhdm;
-    uint32_t s, ls;
-    int blk, sib;
-    ls = offset + transfer_sectors;
+    uint8_t footer[MVHD_FOOTER_SIZE];
+    int64_t blk_bytes = (int64_t)(vhdm->bitmap.sector_count + vhdm->sect_per_block) * MVHD_SECTOR_SIZE;
+    int64_t stride = blk_bytes + 5 * MVHD_SECTOR_SIZE;
+    int64_t slot, base, new_end;
+    uint32_t ls = offset + (uint32_t)transfer_sectors;
+    uint32_t start, end;
+    int first = (int)(offset / vhdm->sect_per_block);
+    int last = (int)((ls - 1) / vhdm->sect_per_block);
+    int* pending;
+    int blk, count = 0, i, failed = 0;
 
-    for (s = offset; s < ls; s++) {
-        while (curr_vhdm->footer.disk_type == MVHD_TYPE_DIFF) {
-            blk = s / curr_vhdm->sect_per_block;
-            sib = s % curr_vhdm->sect_per_block;
-            if (curr_vhdm->bitmap.curr_block != blk) {
-                read_sect_bitmap(curr_vhdm, blk);
-            }
-            if (!VHD_TESTBIT(curr_vhdm->bitmap.curr_bitmap, sib)) {
-                curr_vhdm = curr_vhdm->parent;
-            } else { break; }
+    pending = malloc((size_t)(last - first + 1) * sizeof *pending);
+    if (pending == NULL) {
+        return num_sectors;
+    }
+
+    /* Let the placement policy use what free slots it wants. The space of a reused slot 
+       may hold stale data, so zero it before allocating it again */
+    for (blk = first; blk <= last; blk++) {
+        if (vhdm->block_offset[blk] != MVHD_SPARSE_BLK) {
+            continue;
         }
+        slot = vhdm->place_block(vhdm, blk);
+        if (slot < 0) {
+            pending[count++] = blk;
+            continue;
+        }
+        mvhd_punch_hole(vhdm->fd, slot, (int)(blk_bytes / MVHD_SECTOR_SIZE));
+        mvhd_fallocate(vhdm->fd, slot, blk_bytes);
+        vhdm->block_offset[blk] = (uint32_t)(slot / MVHD_SECTOR_SIZE);
+    }
 
-        /* We handle actual sector reading using the fixed or sparse functions,
-           as a differencing VHD is also a sparse VHD */
-        if (curr_vhdm->footer.disk_type == MVHD_TYPE_DIFF || curr_vhdm->footer.disk_type == MVHD_TYPE_DYNAMIC) {
-            mvhd_sparse_read(curr_vhdm, s, 1, buff);
+    /* Everything else is appended in one go, and the footer only moves once. The 
+       sector bitmaps start out clear, so the blocks still read as before */
+    if (count > 0) {
+        base = vhdm->data_end;
+        new_end = base + count * stride;
+        if (reserve_tail(vhdm, new_end)) {
+            mvhd_fallocate(vhdm->fd, base, new_end - base);
+        } else if (mvhd_fallocate(vhdm->fd, base, new_end + MVHD_FOOTER_SIZE - base) == 0 || mvhd_ftruncate64(vhdm->fd, new_end) == 0) {
+            /* The old footer is where the first sector bitmap goes */
+            mvhd_pwrite_empty_sectors(vhdm->fd, base, 1);
+            mvhd_footer_to_buffer(&vhdm->footer, footer);
+            mvhd_pwrite(vhdm->fd, footer, sizeof footer, new_end);
+            vhdm->data_end = new_end;
         } else {
-            mvhd_fixed_read(curr_vhdm, s, 1, buff);
+            /* The blocks stay sparse. Count the sectors of the range in them */
+            for (i = 0; i < count; i++) {
+                start = (uint32_t)pending[i] * vhdm->sect_per_block;
+                end = start + vhdm->sect_per_block;
+                failed += (int)(((end < ls) ? end : ls) - ((start > offset) ? start : offset));
+            }
+            count = 0;
+        }
+        for (i = 0; i < count; i++) {
+            vhdm->block_offset[pending[i]] = (uint32_t)((base + i * stride) / MVHD_SECTOR_SIZE);
         }
-
-        curr_vhdm = vhdm;
-        buff += MVHD_SECTOR_SIZE;
     }
+    free(pending);
 
-    return truncated_sectors;
+    /* The space is in place, so the blocks can be made part of the image */
+    update_bat(vhdm, first, last);
+
+    return truncated_sectors + failed;
 }
 
 
-int
-mvhd_fixed_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff)
+/**
+ * \brief Find a run of sectors that a differencing image's parent chain reads as zero, or not
+ * 
+ * Only metadata is examined. Sectors stored in a differencing or fixed image are assumed 
+ * to hold data. Sectors of a dynamic image that are not marked in its sector bitmaps, or 
+ * that are in unallocated blocks, are known to read as zero.
+ * 
+ * \param [in] parent The parent of the image being formatted
+ * \param [in] offset Sector offset the run starts at
+ * \param [in] num_sectors The maximum length of the run
+ * \param [out] zero Set to true if the run reads as zero
+ * 
+ * \return The number of sectors in the run, between 1 and num_sectors
+ */
+static int
+parent_zero_run(MVHDMeta* parent, uint32_t offset, int num_sectors, bool* zero)
 {
-    int64_t addr;
-    int transfer_sectors, truncated_sectors;
-    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+    MVHDMeta* owner;
+    int run = diff_resolve_run(parent, offset, num_sectors, &owner);
+    int blk, sib;
+    bool set;
 
-    check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
+    if (owner->footer.disk_type != MVHD_TYPE_DYNAMIC) {
+        *zero = false;
+        return run;
+    }
 
-    addr = (int64_t)offset * MVHD_SECTOR_SIZE;
-    mvhd_fseeko64(vhdm->f, addr, SEEK_SET);
-    fwrite(in_buff, transfer_sectors*MVHD_SECTOR_SIZE, 1, vhdm->f);
+    blk = offset / owner->sect_per_block;
+    sib = offset % owner->sect_per_block;
+    if (run > owner->sect_per_block - sib) {
+        run = owner->sect_per_block - sib;
+    }
+    if (owner->block_offset[blk] == MVHD_SPARSE_BLK) {
+        *zero = true;
+        return run;
+    }
+    run = sect_bitmap_run(owner, blk, sib, sib + run, &set);
+    *zero = !set;
 
-    return truncated_sectors;
+    return run;
 }
 
 
 int
-mvhd_sparse_diff_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff)
+mvhd_diff_format(MVHDMeta* vhdm, uint32_t offset, int num_sectors)
 {
     int transfer_sectors, truncated_sectors;
     uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
 
     check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
 
-    uint8_t* buff = (uint8_t*)in_buff;
-    int64_t addr;
+    MVHDIOVec zeros[MVHD_IOV_BATCH];
+    MVHDIOVCursor cur;
     uint32_t s, ls;
-    int blk, prev_blk, sib;
+    int i, run, chunk, max_chunk;
+    bool zero;
     ls = offset + transfer_sectors;
-    prev_blk = -1;
 
-    for (s = offset; s < ls; s++) {
-        blk = s / vhdm->sect_per_block;
-        sib = s % vhdm->sect_per_block;
-        if (vhdm->bitmap.curr_block != blk && prev_blk >= 0) {            
-            /* Write the sector bitmap for the previous block, before we replace it. */
-            write_curr_sect_bitmap(vhdm);
-        }
+    /* Repeat the zero buffer, so a long run of zeros can be written in one go */
+    for (i = 0; i < MVHD_IOV_BATCH; i++) {
+        zeros[i].base = vhdm->format_buffer.zero_data;
+        zeros[i].len = (size_t)vhdm->format_buffer.sector_count * MVHD_SECTOR_SIZE;
+    }
+    max_chunk = MVHD_IOV_BATCH * vhdm->format_buffer.sector_count;
 
-        if (vhdm->block_offset[blk] == MVHD_SPARSE_BLK) {
-            /* "read" the sector bitmap first, before creating a new block, as the bitmap will be
-               zero either way */
-            read_sect_bitmap(vhdm, blk);
-            create_block(vhdm, blk);
-        } 
-
-        if (blk != prev_blk) {
-            if (vhdm->bitmap.curr_block != blk) {                
-                read_sect_bitmap(vhdm, blk);
-                mvhd_fseeko64(vhdm->f, (uint64_t)sib * MVHD_SECTOR_SIZE, SEEK_CUR);
-            } else {
-                addr = ((int64_t)vhdm->block_offset[blk] + vhdm->bitmap.sector_count + sib) * MVHD_SECTOR_SIZE;
-                mvhd_fseeko64(vhdm->f, addr, SEEK_SET);
-            }
-            prev_blk = blk;
+    for (s = offset; s < ls; s += run) {
+        run = parent_zero_run(vhdm->parent, s, (int)(ls - s), &zero);
+        if (zero) {
+            /* The parent reads as zero here, so the child only needs to stop hiding it */
+            mvhd_sparse_discard(vhdm, s, run);
+            continue;
+        }
+        for (i = 0; i < run; i += chunk) {
+            chunk = (run - i < max_chunk) ? run - i : max_chunk;
+            cur.iov = zeros;
+            cur.iovcnt = MVHD_IOV_BATCH;
+            cur.idx = 0;
+            cur.pos = 0;
+            cur.batch = NULL;
+            mvhd_sparse_diff_write(vhdm, s + i, chunk, &cur);
         }
-
-        fwrite(buff, MVHD_SECTOR_SIZE, 1, vhdm->f);
-        VHD_SETBIT(vhdm->bitmap.curr_bitmap, sib);
-        buff += MVHD_SECTOR_SIZE;
     }
 
-    /* And write the sector bitmap for the last block we visited to disk */
-    write_curr_sect_bitmap(vhdm);
-
     return truncated_sectors;
 }
 
 
+void
+mvhd_mark_written(MVHDMeta* vhdm, const MVHDMark* marks, int num_marks)
+{
+    int i;
+
+    for (i = 0; i < num_marks; i++) {
+        if (vhdm->block_offset[marks[i].blk] != MVHD_SPARSE_BLK) {
+            mark_sectors(vhdm, marks[i].blk, get_sect_bitmap(vhdm, marks[i].blk), marks[i].start, marks[i].end, vhdm->strict);
+        }
+    }
+}
+
+
 int
-mvhd_noop_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff)
+mvhd_noop_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOVCursor* in_iov)
 {
     (void)vhdm;
     (void)offset;
     (void)num_sectors;
-    (void)in_buff;
+    (void)in_iov;
 
     return 0;
 }
@@ -39,11 +39,13 @@
 #ifndef _FILE_OFFSET_BITS
 # define _FILE_OFFSET_BITS 64
 #endif
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <limits.h>
 #define BUILDING_LIBRARY
 #include "minivhd.h"
 #include "internal.h"
@@ -65,22 +67,85 @@ struct MVHDPaths {
 int mvhd_errno = 0;
 
 
-static char tmp_open_path[MVHD_MAX_PATH_BYTES] = {0};
+/* A parent path found by get_diff_parent_path() */
+struct MVHDPathCacheEntry {
+    uint8_t	uuid[16];
+    uint8_t	name[512];	/* parent name field of the child, as stored */
+    char	dir[MVHD_MAX_PATH_BYTES];	/* directory of the child */
+    bool	used;
+    char	path[MVHD_MAX_PATH_BYTES];
+};
+
+/* Recently found parent paths, keyed by parent UUID. The parent name the child has 
+   stored must match as well, as images created in the same second can share a UUID. 
+   So must the directory of the child, as relative locators lead to a different parent 
+   from each directory. Entries are replaced in turn, and everything is guarded by 
+   mvhd_mutex_global() */
+static struct MVHDPathCacheEntry parent_paths[MVHD_PATH_CACHE_SIZE];
+static int parent_paths_next = 0;
+
+/* Parents of differencing images, shared by all children in the process that use the 
+   same parent. Linked by next_shared, and guarded by mvhd_mutex_global() */
+static MVHDMeta* shared_parents = NULL;
+
+/* Number of threads loading BATs in the background, guarded by mvhd_mutex_global() */
+static int bat_load_threads = 0;
+
+/* A BAT being loaded by another thread, while the rest of the chain is opened */
+struct MVHDBatJob {
+    MVHDMeta*	vhdm;
+    MVHDError	err;
+    int		ret;
+};
 
 
 /**
  * \brief Populate data stuctures with content from a VHD footer
  * 
+ * The position of the footer also marks the end of the data in the file, which 
+ * is where new blocks are created. It is rounded up to a sector boundary.
+ * 
+ * If there is no footer at the end of a sparse image, the copy at the start of the 
+ * file is used instead, and data_end is set to -1. The image was not closed, and 
+ * open_image() decides whether the space past its data can be reclaimed.
+ * 
  * \param [in] vhdm MiniVHD data structure
+ * 
+ * \retval true if a VHD footer was found at the end of the file
+ * \retval false if the file is not a VHD
  */
-static void
+static bool
 read_footer(MVHDMeta* vhdm)
 {
     uint8_t buffer[MVHD_FOOTER_SIZE];
+    int64_t footer_offset = mvhd_file_size(vhdm->fd) - MVHD_FOOTER_SIZE;
+
+    if (footer_offset < 0 || mvhd_pread(vhdm->fd, buffer, sizeof buffer, footer_offset) != sizeof buffer) {
+        return false;
+    }
+    if (! mvhd_is_conectix_str(buffer)) {
+        /* The image may not have been closed while space was preallocated past its data. 
+           Sparse images keep a copy of the footer at the start of the file */
+        if (mvhd_pread(vhdm->fd, buffer, sizeof buffer, 0) != sizeof buffer || ! mvhd_is_conectix_str(buffer)) {
+            return false;
+        }
+        mvhd_buffer_to_footer(&vhdm->footer, buffer);
+        if (vhdm->footer.disk_type != MVHD_TYPE_DYNAMIC && vhdm->footer.disk_type != MVHD_TYPE_DIFF) {
+            return false;
+        }
 
-    mvhd_fseeko64(vhdm->f, -MVHD_FOOTER_SIZE, SEEK_END);
-    fread(buffer, sizeof buffer, 1, vhdm->f);
+        /* The end of the data is found from the BAT, once it is loaded */
+        vhdm->data_end = -1;
+        return true;
+    }
+
+    vhdm->data_end = footer_offset;
+    if (vhdm->data_end % MVHD_SECTOR_SIZE != 0) {
+        vhdm->data_end += MVHD_SECTOR_SIZE - (vhdm->data_end % MVHD_SECTOR_SIZE);
+    }
     mvhd_buffer_to_footer(&vhdm->footer, buffer);
+
+    return true;
 }
 
 
@@ -94,8 +159,7 @@ read_sparse_header(MVHDMeta* vhdm)
 {
     uint8_t buffer[MVHD_SPARSE_SIZE];
 
-    mvhd_fseeko64(vhdm->f, vhdm->footer.data_offset, SEEK_SET);
-    fread(buffer, sizeof buffer, 1, vhdm->f);
+    mvhd_pread(vhdm->fd, buffer, sizeof buffer, (int64_t)vhdm->footer.data_offset);
     mvhd_buffer_to_header(&vhdm->sparse, buffer);
 }
 
@@ -133,7 +197,9 @@ sparse_checksum_valid(MVHDMeta* vhdm)
  * 
  * The Block Allocation Table (BAT) is the structure in a sparse and differencing VHD which stores 
  * the 4-byte sector offsets for each data block. This function allocates enough memory to contain
- * the entire BAT, and then reads the contents of the BAT into the buffer.
+ * the entire BAT, reads the contents of the BAT into the buffer with a single read, and then 
+ * converts all the entries to host byte order in one pass. It also allocates the bitmap that 
+ * tracks which sectors of the BAT have been modified.
  * 
  * \param [in] vhdm MiniVHD data structure
  * \param [out] err this is populated with MVHD_ERR_MEM if the calloc fails
@@ -144,24 +210,82 @@ sparse_checksum_valid(MVHDMeta* vhdm)
 static int
 read_bat(MVHDMeta *vhdm, MVHDError* err)
 {
-    uint32_t i;
-
     vhdm->block_offset = calloc(vhdm->sparse.max_bat_ent, sizeof *vhdm->block_offset);
     if (vhdm->block_offset == NULL) {
         *err = MVHD_ERR_MEM;
         return -1;
     }
 
-    mvhd_fseeko64(vhdm->f, vhdm->sparse.bat_offset, SEEK_SET);
+    mvhd_pread(vhdm->fd, vhdm->block_offset, (size_t)vhdm->sparse.max_bat_ent * sizeof *vhdm->block_offset, (int64_t)vhdm->sparse.bat_offset);
+    mvhd_from_be32_array(vhdm->block_offset, vhdm->sparse.max_bat_ent);
 
-    for (i = 0; i < vhdm->sparse.max_bat_ent; i++) {
-        fread(&vhdm->block_offset[i], sizeof *vhdm->block_offset, 1, vhdm->f);
-        vhdm->block_offset[i] = mvhd_from_be32(vhdm->block_offset[i]);
+    /* One bit for each sector of the BAT, to track which need writing back */
+    vhdm->bat_dirty = calloc(((size_t)vhdm->sparse.max_bat_ent * sizeof *vhdm->block_offset / MVHD_SECTOR_SIZE + 8) / 8, 1);
+    if (vhdm->bat_dirty == NULL) {
+        free(vhdm->block_offset);
+        vhdm->block_offset = NULL;
+        *err = MVHD_ERR_MEM;
+        return -1;
     }
+
     return 0;
 }
 
 
+/**
+ * \brief Check that everything past the data of an image is preallocated space
+ * 
+ * Space preallocated by reserve_tail() reads as zero, apart from copies of the footer 
+ * that were left behind if the image was not closed. Anything else may be data that 
+ * the BAT does not know about, and must not be thrown away.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] start Offset of the end of the data
+ * 
+ * \retval true if only preallocated space follows start
+ * \retval false if anything else does, or the file could not be read
+ */
+static bool
+tail_is_preallocated(MVHDMeta* vhdm, int64_t start)
+{
+    MVHDFooter footer;
+    int64_t size = mvhd_file_size(vhdm->fd);
+    int64_t pos;
+    size_t len, i, sect_len;
+    uint8_t* buff;
+    bool ok = true;
+
+    buff = malloc(MVHD_ZERO_CHUNK_SECTORS * MVHD_SECTOR_SIZE);
+    if (buff == NULL) {
+        return false;
+    }
+    for (pos = start; ok && pos < size; pos += (int64_t)len) {
+        len = MVHD_ZERO_CHUNK_SECTORS * MVHD_SECTOR_SIZE;
+        if (size - pos < (int64_t)len) {
+            len = (size_t)(size - pos);
+        }
+        if (mvhd_pread(vhdm->fd, buff, len, pos) != (int64_t)len) {
+            ok = false;
+            break;
+        }
+        for (i = 0; ok && i < len; i += sect_len) {
+            sect_len = (len - i < MVHD_SECTOR_SIZE) ? len - i : MVHD_SECTOR_SIZE;
+            if (mvhd_is_zero(buff + i, sect_len)) {
+                continue;
+            }
+            ok = sect_len == MVHD_FOOTER_SIZE && mvhd_is_conectix_str(buff + i);
+            if (ok) {
+                mvhd_buffer_to_footer(&footer, buff + i);
+                ok = memcmp(footer.uuid, vhdm->footer.uuid, sizeof footer.uuid) == 0;
+            }
+        }
+    }
+    free(buff);
+
+    return ok;
+}
+
+
 /**
  * \brief Perform a one-time calculation of some sparse VHD values
  * 
@@ -181,28 +305,83 @@ calc_sparse_values(MVHDMeta* vhdm)
 
 
 /**
- * \brief Allocate memory for a sector bitmap.
+ * \brief Free the memory used by the sector bitmap cache
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ */
+static void
+free_sector_bitmap(MVHDMeta* vhdm)
+{
+    free(vhdm->bitmap.data);
+    vhdm->bitmap.data = NULL;
+    free(vhdm->bitmap.entries);
+    vhdm->bitmap.entries = NULL;
+    free(vhdm->bitmap.hash);
+    vhdm->bitmap.hash = NULL;
+    vhdm->bitmap.curr_entry = NULL;
+}
+
+
+/**
+ * \brief Allocate memory for the sector bitmap cache.
  * 
  * Each data block is preceded by a sector bitmap. Each bit indicates whether the corresponding sector
  * is considered 'clean' or 'dirty' (for sparse VHD images), or whether to read from the parent or current 
  * image (for differencing images).
  * 
+ * Bitmaps for as many blocks as fit in cache_size are kept in memory, so that I/O alternating 
+ * between blocks does not need to re-read bitmaps from the file.
+ * 
  * \param [in] vhdm MiniVHD data structure
+ * \param [in] cache_size The memory budget for cached bitmaps in bytes, or 0 for the default
  * \param [out] err this is populated with MVHD_ERR_MEM if the calloc fails
  * 
  * \retval -1 if an error occurrs. Check value of err in this case
  * \retval 0 if the function call succeeds
  */
 static int
-init_sector_bitmap(MVHDMeta* vhdm, MVHDError* err)
+init_sector_bitmap(MVHDMeta* vhdm, uint32_t cache_size, MVHDError* err)
 {
-    vhdm->bitmap.curr_bitmap = calloc(vhdm->bitmap.sector_count, MVHD_SECTOR_SIZE);
-    if (vhdm->bitmap.curr_bitmap == NULL) {
+    MVHDSectorBitmap* bm = &vhdm->bitmap;
+    size_t bm_bytes = (size_t)bm->sector_count * MVHD_SECTOR_SIZE;
+    int hash_size = 1;
+    int i;
+
+    if (cache_size == 0) {
+        cache_size = MVHD_BITMAP_CACHE_DEFAULT;
+    }
+    bm->num_entries = (int)(cache_size / bm_bytes);
+    if (bm->num_entries < 1) {
+        bm->num_entries = 1;
+    }
+    if ((uint32_t)bm->num_entries > vhdm->sparse.max_bat_ent) {
+        bm->num_entries = (int)vhdm->sparse.max_bat_ent;
+    }
+    while (hash_size < bm->num_entries * 2) {
+        hash_size <<= 1;
+    }
+
+    bm->data = calloc(bm->num_entries, bm_bytes);
+    bm->entries = calloc(bm->num_entries, sizeof *bm->entries);
+    bm->hash = malloc(hash_size * sizeof *bm->hash);
+    if (bm->data == NULL || bm->entries == NULL || bm->hash == NULL) {
+        free_sector_bitmap(vhdm);
         *err = MVHD_ERR_MEM;
         return -1;
     }
 
-    vhdm->bitmap.curr_block = -1;
+    for (i = 0; i < bm->num_entries; i++) {
+        bm->entries[i].bitmap = bm->data + (i * bm_bytes);
+        bm->entries[i].block = -1;
+        bm->entries[i].next = -1;
+    }
+    for (i = 0; i < hash_size; i++) {
+        bm->hash[i] = -1;
+    }
+    bm->hash_mask = hash_size - 1;
+    bm->clock_hand = 0;
+    bm->curr_entry = NULL;
+    bm->curr_block = -1;
 
     return 0;
 }
@@ -220,12 +399,14 @@ init_sector_bitmap(MVHDMeta* vhdm, MVHDError* err)
  * \param [in] paths a struct containing all available paths to work with
  * \param [in] the platform code to try and obtain a path for. Setting this to zero 
  * will try using the directory of the child image
+ * \param [out] par_f if not NULL, the file that was found is left open and stored here, 
+ * so it does not have to be opened again
  * 
  * \retval true if a file is found
  * \retval false if a file is not found
  */
 static bool
-mvhd_parent_path_exists(struct MVHDPaths* paths, uint32_t plat_code)
+mvhd_parent_path_exists(struct MVHDPaths* paths, uint32_t plat_code, FILE** par_f)
 {
     FILE* f;
     int ferr;
@@ -233,10 +414,14 @@ mvhd_parent_path_exists(struct MVHDPaths* paths, uint32_t plat_code)
     enum cwk_path_style style;
 
     memset(paths->joined_path, 0, sizeof paths->joined_path);
-    style = cwk_path_guess_style((const char*)paths->dir_path);
-    cwk_path_set_style(style);
     cwk_ret = 1;
 
+    /* The path style is global to cwalk, so it is only changed, and used, under the lock */
+    mvhd_mutex_lock(mvhd_mutex_global());
+    style = cwk_path_guess_style((const char*)paths->dir_path);
+    if (cwk_path_get_style() != style) {
+        cwk_path_set_style(style);
+    }
     if (plat_code == MVHD_DIF_LOC_W2RU && *paths->w2ru_path) {
         cwk_ret = cwk_path_join((const char*)paths->dir_path, (const char*)paths->w2ru_path, paths->joined_path, sizeof paths->joined_path);
     } else if (plat_code == MVHD_DIF_LOC_W2KU && *paths->w2ku_path) {
@@ -245,6 +430,7 @@ mvhd_parent_path_exists(struct MVHDPaths* paths, uint32_t plat_code)
     } else if (plat_code == 0) {
         cwk_ret = cwk_path_join((const char*)paths->dir_path, (const char*)paths->file_name, paths->joined_path, sizeof paths->joined_path);
     }
+    mvhd_mutex_unlock(mvhd_mutex_global());
     if (cwk_ret > MVHD_MAX_PATH_BYTES) {
         return false;
     }
@@ -252,9 +438,11 @@ mvhd_parent_path_exists(struct MVHDPaths* paths, uint32_t plat_code)
     f = mvhd_fopen((const char*)paths->joined_path, "rb", &ferr);
     if (f != NULL) {
         /* We found a file at the requested path! */
-        memcpy(tmp_open_path, paths->joined_path, (sizeof paths->joined_path) - 1);
-        tmp_open_path[sizeof tmp_open_path - 1] = '\0';
-        fclose(f);
+        if (par_f != NULL) {
+            *par_f = f;
+        } else {
+            fclose(f);
+        }
         return true;
     }
 
@@ -262,6 +450,115 @@ mvhd_parent_path_exists(struct MVHDPaths* paths, uint32_t plat_code)
 }
 
 
+/**
+ * \brief Check if a remembered parent path is for the parent of an image
+ * 
+ * The caller must hold mvhd_mutex_global().
+ * 
+ * \param [in] ent The remembered path
+ * \param [in] vhdm MiniVHD data structure of the child
+ * \param [in] dirlen Length of the directory part of the child's file name
+ * 
+ * \retval true if it is
+ * \retval false if not
+ */
+static bool
+parent_path_matches(const struct MVHDPathCacheEntry* ent, const MVHDMeta* vhdm, size_t dirlen)
+{
+    return ent->used && memcmp(ent->uuid, vhdm->sparse.par_uuid, sizeof ent->uuid) == 0 &&
+           memcmp(ent->name, vhdm->sparse.par_utf16_name, sizeof ent->name) == 0 &&
+           strlen(ent->dir) == dirlen && memcmp(ent->dir, vhdm->filename, dirlen) == 0;
+}
+
+
+/**
+ * \brief Look up the path the parent of an image was last found at
+ * 
+ * \param [in] vhdm MiniVHD data structure of the child
+ * \param [out] par_path Receives the path. Must be MVHD_MAX_PATH_BYTES long
+ * 
+ * \retval true if the path is known
+ * \retval false if not
+ */
+static bool
+lookup_parent_path(const MVHDMeta* vhdm, char* par_path)
+{
+    size_t dirlen;
+    int i;
+    bool found = false;
+
+    mvhd_mutex_lock(mvhd_mutex_global());
+    cwk_path_get_dirname((const char*)vhdm->filename, &dirlen);
+    for (i = 0; i < MVHD_PATH_CACHE_SIZE; i++) {
+        if (parent_path_matches(&parent_paths[i], vhdm, dirlen)) {
+            memcpy(par_path, parent_paths[i].path, MVHD_MAX_PATH_BYTES);
+            found = true;
+            break;
+        }
+    }
+    mvhd_mutex_unlock(mvhd_mutex_global());
+
+    return found;
+}
+
+
+/**
+ * \brief Remember the path the parent of an image was found at
+ * 
+ * \param [in] vhdm MiniVHD data structure of the child
+ * \param [in] par_path Path of the parent
+ */
+static void
+remember_parent_path(const MVHDMeta* vhdm, const char* par_path)
+{
+    struct MVHDPathCacheEntry* ent = NULL;
+    size_t dirlen;
+    int i;
+
+    mvhd_mutex_lock(mvhd_mutex_global());
+    cwk_path_get_dirname((const char*)vhdm->filename, &dirlen);
+    for (i = 0; i < MVHD_PATH_CACHE_SIZE; i++) {
+        if (parent_path_matches(&parent_paths[i], vhdm, dirlen)) {
+            ent = &parent_paths[i];
+            break;
+        }
+    }
+    if (ent == NULL) {
+        ent = &parent_paths[parent_paths_next];
+        parent_paths_next = (parent_paths_next + 1) % MVHD_PATH_CACHE_SIZE;
+    }
+    memcpy(ent->uuid, vhdm->sparse.par_uuid, sizeof ent->uuid);
+    memcpy(ent->name, vhdm->sparse.par_utf16_name, sizeof ent->name);
+    memcpy(ent->dir, vhdm->filename, dirlen);
+    ent->dir[dirlen] = '\0';
+    memcpy(ent->path, par_path, sizeof ent->path);
+    ent->used = true;
+    mvhd_mutex_unlock(mvhd_mutex_global());
+}
+
+
+/**
+ * \brief Forget the path of a parent, such as when it no longer leads to that parent
+ * 
+ * \param [in] vhdm MiniVHD data structure of the child
+ */
+static void
+forget_parent_path(const MVHDMeta* vhdm)
+{
+    size_t dirlen;
+    int i;
+
+    mvhd_mutex_lock(mvhd_mutex_global());
+    cwk_path_get_dirname((const char*)vhdm->filename, &dirlen);
+    for (i = 0; i < MVHD_PATH_CACHE_SIZE; i++) {
+        if (parent_path_matches(&parent_paths[i], vhdm, dirlen)) {
+            parent_paths[i].used = false;
+        }
+    }
+    mvhd_mutex_unlock(mvhd_mutex_global());
+}
+
+
 /**
  * \brief attempt to obtain a file path to a file that may be a valid VHD image
  * 
@@ -271,23 +568,47 @@ mvhd_parent_path_exists(struct MVHDPaths* paths, uint32_t plat_code)
  * 
  * This function does not verify if the path returned is a valid parent image.
  * 
+ * Paths that were found before are looked up by parent UUID and name, and the 
+ * directory of the child, first. Only if the file can no longer be opened are the 
+ * locators probed again.
+ * 
  * \param [in] vhdm current MiniVHD data structure
+ * \param [out] par_path buffer of MVHD_MAX_PATH_BYTES that receives the path
+ * \param [out] par_f if not NULL, the parent file is left open (read only) and stored here
  * \param [out] err any errors that may occurr. Check this if NULL is returned
  * 
- * \return a pointer to the global string `tmp_open_path`, or NULL if a path could 
- * not be found, or some error occurred
+ * \return par_path, or NULL if a path could not be found, or some error occurred
  */
 static char *
-get_diff_parent_path(MVHDMeta* vhdm, int* err)
+get_diff_parent_path(MVHDMeta* vhdm, char* par_path, FILE** par_f, int* err)
 {
     int utf_outlen, utf_inlen, utf_ret;
     char *par_fp = NULL;
     struct MVHDPaths *paths;
     size_t dirlen;
+    bool is_abs;
+    FILE* f;
+    int ferr;
+
+    if (lookup_parent_path(vhdm, par_path)) {
+        f = mvhd_fopen((const char*)par_path, "rb", &ferr);
+        if (f != NULL) {
+            if (par_f != NULL) {
+                *par_f = f;
+            } else {
+                fclose(f);
+            }
+            return par_path;
+        }
+        forget_parent_path(vhdm);
+    }
 
     /* We can't resolve relative paths if we don't have an absolute 
        path to work with */
-    if (! cwk_path_is_absolute((const char*)vhdm->filename)) {
+    mvhd_mutex_lock(mvhd_mutex_global());
+    is_abs = cwk_path_is_absolute((const char*)vhdm->filename);
+    mvhd_mutex_unlock(mvhd_mutex_global());
+    if (! is_abs) {
         *err = MVHD_ERR_PATH_REL;
         goto end;
     }
@@ -297,7 +618,9 @@ get_diff_parent_path(MVHDMeta* vhdm, int* err)
         *err = MVHD_ERR_MEM;
         goto end;
     }
+    mvhd_mutex_lock(mvhd_mutex_global());
     cwk_path_get_dirname((const char*)vhdm->filename, &dirlen);
+    mvhd_mutex_unlock(mvhd_mutex_global());
     if (dirlen >= sizeof paths->dir_path) {
         *err = MVHD_ERR_PATH_LEN;
         goto paths_cleanup;
@@ -332,8 +655,7 @@ get_diff_parent_path(MVHDMeta* vhdm, int* err)
             *err = MVHD_ERR_PATH_LEN;
             goto paths_cleanup;
         }
-        mvhd_fseeko64(vhdm->f, vhdm->sparse.par_loc_entry[i].plat_data_offset, SEEK_SET);
-        fread(paths->tmp_src_path, sizeof (uint8_t), utf_inlen, vhdm->f);
+        mvhd_pread(vhdm->fd, paths->tmp_src_path, utf_inlen, (int64_t)vhdm->sparse.par_loc_entry[i].plat_data_offset);
 
         /* Note, the W2*u parent locators are UTF-16LE, unlike the filename field previously obtained, 
            which is UTF-16BE */
@@ -346,26 +668,30 @@ get_diff_parent_path(MVHDMeta* vhdm, int* err)
 
     /* We have paths in UTF-8. We should have enough info to try and find the parent VHD */
     /* Does the relative path exist? */
-    if (mvhd_parent_path_exists(paths, MVHD_DIF_LOC_W2RU)) {
-        par_fp = tmp_open_path;
-        goto paths_cleanup;
+    if (mvhd_parent_path_exists(paths, MVHD_DIF_LOC_W2RU, par_f)) {
+        goto path_found;
     }
 
     /* What about trying the child directory? */
-    if (mvhd_parent_path_exists(paths, 0)) {
-        par_fp = tmp_open_path;
-        goto paths_cleanup;
+    if (mvhd_parent_path_exists(paths, 0, par_f)) {
+        goto path_found;
     }
 
     /* Well, all else fails, try the stored absolute path, if it exists */
-    if (mvhd_parent_path_exists(paths, MVHD_DIF_LOC_W2KU)) {
-        par_fp = tmp_open_path;
-        goto paths_cleanup;
+    if (mvhd_parent_path_exists(paths, MVHD_DIF_LOC_W2KU, par_f)) {
+        goto path_found;
     }
 
     /* If we reach this point, we could not find a path with a valid file */
     par_fp = NULL;
     *err = MVHD_ERR_PAR_NOT_FOUND;
+    goto paths_cleanup;
+
+path_found:
+    memcpy(par_path, paths->joined_path, MVHD_MAX_PATH_BYTES);
+    par_path[MVHD_MAX_PATH_BYTES - 1] = '\0';
+    remember_parent_path(vhdm, par_path);
+    par_fp = par_path;
     
 paths_cleanup:
     free(paths);
@@ -376,6 +702,276 @@ end:
 }
 
 
+static MVHDMeta* open_image(const char* path, FILE* f, MVHDOpenOptions options, int* err);
+
+
+/**
+ * \brief Find a shared parent by UUID, path and open options
+ * 
+ * Only the options that still matter for a read only image have to match. A child 
+ * that asks for a different cache size, memory mapping or queue depth gets a parent 
+ * of its own.
+ * 
+ * The caller must hold mvhd_mutex_global().
+ * 
+ * \param [in] path Path of the parent
+ * \param [in] uuid UUID the child expects the parent to have
+ * \param [in] options Open options of the child
+ * 
+ * \return The parent, or NULL if it is not open
+ */
+static MVHDMeta*
+find_shared_parent(const char* path, const uint8_t* uuid, const MVHDOpenOptions* options)
+{
+    MVHDMeta* par;
+
+    for (par = shared_parents; par != NULL; par = par->next_shared) {
+        if (memcmp(par->footer.uuid, uuid, sizeof par->footer.uuid) == 0 && strcmp(par->filename, path) == 0 &&
+            par->share_options.bitmap_cache_size == options->bitmap_cache_size &&
+            par->share_options.use_mmap == options->use_mmap &&
+            par->share_options.async_queue_depth == options->async_queue_depth) {
+            return par;
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * \brief Get the parent of a differencing image
+ * 
+ * If another child already has the parent open with the same options, that handle is 
+ * shared, including its BAT and bitmap cache. Otherwise the parent is opened read only 
+ * with the child's other options, and registered for the children that follow.
+ * 
+ * \param [in] path Path of the parent
+ * \param [in] f The parent file, as left open by get_diff_parent_path(). It is always 
+ *              either used or closed
+ * \param [in] uuid UUID the child expects the parent to have
+ * \param [in] options Open options of the child
+ * \param [out] err MVHD_ERR_INVALID_PAR_UUID if the parent is not the one the child 
+ *              expects, or any error from opening the parent
+ * 
+ * \return The parent, or NULL on error
+ */
+static MVHDMeta*
+acquire_parent(const char* path, FILE* f, const uint8_t* uuid, MVHDOpenOptions options, int* err)
+{
+    MVHDMutex* reg = mvhd_mutex_global();
+    MVHDMeta* par;
+    MVHDMeta* shared;
+
+    mvhd_mutex_lock(reg);
+    par = find_shared_parent(path, uuid, &options);
+    if (par != NULL) {
+        par->refcount++;
+    }
+    mvhd_mutex_unlock(reg);
+    if (par != NULL) {
+        fclose(f);
+        return par;
+    }
+
+    /* The registry is not locked while opening, as the parent may have a parent of its own */
+    options.readonly = true;
+    par = open_image(path, f, options, err);
+    if (par == NULL) {
+        return NULL;
+    }
+    if (memcmp(uuid, par->footer.uuid, sizeof par->footer.uuid) != 0) {
+        *err = MVHD_ERR_INVALID_PAR_UUID;
+        mvhd_close(par);
+        return NULL;
+    }
+    /* Reads through a shared parent are resolved by its children */
+    free(par->block_owner);
+    par->block_owner = NULL;
+    par->lock = mvhd_mutex_create();
+    if (par->lock == NULL) {
+        *err = MVHD_ERR_MEM;
+        mvhd_close(par);
+        return NULL;
+    }
+    par->refcount = 1;
+    par->share_options = options;
+
+    /* Another child may have opened the same parent in the meantime */
+    mvhd_mutex_lock(reg);
+    shared = find_shared_parent(path, uuid, &options);
+    if (shared != NULL) {
+        shared->refcount++;
+    } else {
+        par->next_shared = shared_parents;
+        shared_parents = par;
+    }
+    mvhd_mutex_unlock(reg);
+    if (shared != NULL) {
+        mvhd_close(par);
+        return shared;
+    }
+
+    return par;
+}
+
+
+/**
+ * \brief Stop using a shared parent, and close it once no child uses it
+ * 
+ * \param [in] par The parent, as returned by acquire_parent()
+ */
+static void
+release_parent(MVHDMeta* par)
+{
+    MVHDMutex* reg = mvhd_mutex_global();
+    MVHDMeta** link;
+
+    mvhd_mutex_lock(reg);
+    if (--par->refcount > 0) {
+        mvhd_mutex_unlock(reg);
+        return;
+    }
+    for (link = &shared_parents; *link != NULL; link = &(*link)->next_shared) {
+        if (*link == par) {
+            *link = par->next_shared;
+            break;
+        }
+    }
+    mvhd_mutex_unlock(reg);
+
+    mvhd_close(par);
+}
+
+
+/**
+ * \brief Find, check and open the parent of a differencing image
+ * 
+ * \param [in] vhdm MiniVHD data structure of the child
+ * \param [in] options Open options of the child
+ * \param [out] err Any error from finding or opening the parent. MVHD_ERR_TIMESTAMP 
+ *              is set if the parent was opened but has been modified since the child 
+ *              was linked to it
+ * 
+ * \retval -1 if an error occurrs. Check value of err in this case
+ * \retval 0 if the function call succeeds
+ */
+static int
+open_parent(MVHDMeta* vhdm, MVHDOpenOptions options, int* err)
+{
+    char par_path[MVHD_MAX_PATH_BYTES];
+    FILE* par_f = NULL;
+    uint32_t par_mod_ts;
+    int tries;
+
+    for (tries = 0; tries < 2; tries++) {
+        /* The file found while probing for the parent is the one it is opened with */
+        if (get_diff_parent_path(vhdm, par_path, &par_f, err) == NULL) {
+            return -1;
+        }
+
+        par_mod_ts = mvhd_file_mod_timestamp_f(par_f, err);
+        if (*err != 0) {
+            fclose(par_f);
+            return -1;
+        }
+
+        /* Parents are always opened read-only, and shared with other children */
+        vhdm->parent = acquire_parent(par_path, par_f, vhdm->sparse.par_uuid, options, err);
+        if (vhdm->parent != NULL) {
+            break;
+        }
+        if (*err != MVHD_ERR_INVALID_PAR_UUID) {
+            return -1;
+        }
+        /* A remembered path may now hold another image, so search again */
+        forget_parent_path(vhdm);
+    }
+    if (vhdm->parent == NULL) {
+        return -1;
+    }
+
+    if (vhdm->sparse.par_timestamp != par_mod_ts) {
+        /* The last-modified timestamp is to fragile to make this a fatal error.
+           Instead, we inform the caller of the potential problem. */
+        *err = MVHD_ERR_TIMESTAMP;
+    }
+
+    return 0;
+}
+
+
+/**
+ * \brief Thread function that loads the BAT of a differencing image
+ * 
+ * \param [in] arg The struct MVHDBatJob to run
+ */
+static void
+load_bat(void* arg)
+{
+    struct MVHDBatJob* job = arg;
+
+    job->ret = read_bat(job->vhdm, &job->err);
+}
+
+
+/**
+ * \brief Start loading a BAT in the background
+ * 
+ * Every layer of a differencing chain does this before opening its parent, so the 
+ * BATs of the whole chain are read at once. The number of threads is limited, past 
+ * that BATs are loaded by the opening thread.
+ * 
+ * \param [in] job The load to run. It is run before returning if no thread is started
+ * 
+ * \return The thread to join, or NULL if the BAT has already been loaded
+ */
+static MVHDThread*
+start_bat_load(struct MVHDBatJob* job)
+{
+    MVHDMutex* reg = mvhd_mutex_global();
+    MVHDThread* t = NULL;
+    bool use_thread;
+
+    mvhd_mutex_lock(reg);
+    use_thread = (bat_load_threads < MVHD_OPEN_MAX_THREADS);
+    if (use_thread) {
+        bat_load_threads++;
+    }
+    mvhd_mutex_unlock(reg);
+
+    if (use_thread) {
+        t = mvhd_thread_create(load_bat, job);
+        if (t == NULL) {
+            mvhd_mutex_lock(reg);
+            bat_load_threads--;
+            mvhd_mutex_unlock(reg);
+        }
+    }
+    if (t == NULL) {
+        load_bat(job);
+    }
+
+    return t;
+}
+
+
+/**
+ * \brief Wait for a BAT started by start_bat_load() to finish loading
+ * 
+ * \param [in] t The thread returned by start_bat_load()
+ */
+static void
+finish_bat_load(MVHDThread* t)
+{
+    MVHDMutex* reg = mvhd_mutex_global();
+
+    mvhd_thread_join(t);
+    mvhd_mutex_lock(reg);
+    bat_load_threads--;
+    mvhd_mutex_unlock(reg);
+}
+
+
 /**
  * \brief Attach the read/write function pointers to read/write functions
  * 
@@ -502,40 +1098,73 @@ mvhd_calculate_geometry(uint64_t size)
 
 MVHDAPI MVHDMeta *
 mvhd_open(const char* path, int readonly, int* err)
+{
+    MVHDOpenOptions options = {0};
+
+    options.readonly = readonly;
+
+    return mvhd_open_ex(path, options, err);
+}
+
+
+/**
+ * \brief Open a VHD image, possibly from an already open file
+ * 
+ * \param [in] path Path of the image
+ * \param [in] f If not NULL, the image opened in a mode matching options.readonly. It 
+ *              is always either used or closed
+ * \param [in] options Open options
+ * \param [out] err Any error that occurrs
+ * 
+ * \return The image, or NULL on error
+ */
+static MVHDMeta*
+open_image(const char* path, FILE* f, MVHDOpenOptions options, int* err)
 {
     MVHDError open_err;
+    int readonly = options.readonly;
+    struct MVHDBatJob bat_job;
+    MVHDThread* bat_thread;
+    int par_ret;
 
     MVHDMeta *vhdm = calloc(sizeof *vhdm, 1);
     if (vhdm == NULL) {
+        if (f != NULL) {
+            fclose(f);
+        }
         *err = MVHD_ERR_MEM;
         goto end;
     }
+    vhdm->f = f;
 
     if (strlen(path) >= sizeof vhdm->filename) {
         *err = MVHD_ERR_PATH_LEN;
-        goto cleanup_vhdm;
+        goto cleanup_file;
     }
 
     //This is safe, as we've just checked for potential overflow above
     strcpy(vhdm->filename, path);
 
-    if (readonly) {
-	vhdm->f = mvhd_fopen((const char*)vhdm->filename, "rb", err);
-    } else {
-	vhdm->f = mvhd_fopen((const char*)vhdm->filename, "rb+", err);
+    if (vhdm->f == NULL) {
+	vhdm->f = mvhd_fopen((const char*)vhdm->filename, readonly ? "rb" : "rb+", err);
     }
     if (vhdm->f == NULL) {
         /* note, mvhd_fopen sets err for us */
         goto cleanup_vhdm;
     }
+#ifdef _WIN32
+    vhdm->fd = _fileno(vhdm->f);
+#else
+    vhdm->fd = fileno(vhdm->f);
+#endif
     vhdm->readonly = readonly;
+    vhdm->strict = options.strict;
+    vhdm->zero_detect = options.zero_detect;
 
-    if (! mvhd_file_is_vhd(vhdm->f)) {
+    if (! read_footer(vhdm)) {
         *err = MVHD_ERR_NOT_VHD;
         goto cleanup_file;
     }
-
-    read_footer(vhdm);
     if (! footer_checksum_valid(vhdm)) {
         *err = MVHD_ERR_FOOTER_CHECKSUM;
         goto cleanup_file;
@@ -546,20 +1175,93 @@ mvhd_open(const char* path, int readonly, int* err)
             *err = MVHD_ERR_SPARSE_CHECKSUM;
             goto cleanup_file;
         }
-        if (read_bat(vhdm, &open_err) == -1) {
+        if (vhdm->footer.disk_type == MVHD_TYPE_DIFF) {
+            /* The BAT is loaded while the parent, and so the rest of the chain, is 
+               opened. Each layer does the same, so all of the chain's BATs load at once */
+            bat_job.vhdm = vhdm;
+            bat_thread = start_bat_load(&bat_job);
+            par_ret = open_parent(vhdm, options, err);
+            if (bat_thread != NULL) {
+                finish_bat_load(bat_thread);
+            }
+            if (bat_job.ret == -1) {
+                *err = bat_job.err;
+                goto cleanup_parent;
+            }
+            if (par_ret == -1) {
+                goto cleanup_bat;
+            }
+        } else if (read_bat(vhdm, &open_err) == -1) {
             *err = open_err;
             goto cleanup_file;
         }
         calc_sparse_values(vhdm);
-        if (init_sector_bitmap(vhdm, &open_err) == -1) {
+        if (vhdm->data_end < 0) {
+            vhdm->data_end = mvhd_used_end(vhdm);
+            if (!readonly) {
+                /* The file is only cut back if what follows the data is known to be space we 
+                   preallocated. Anything else is left alone, for a read only open to recover */
+                if (! tail_is_preallocated(vhdm, vhdm->data_end)) {
+                    *err = MVHD_ERR_FOOTER_MISSING;
+                    goto cleanup_parent;
+                }
+                /* Put the footer back, dropping the preallocated space */
+                uint8_t footer_buff[MVHD_FOOTER_SIZE];
+                mvhd_footer_to_buffer(&vhdm->footer, footer_buff);
+                if (mvhd_pwrite(vhdm->fd, footer_buff, sizeof footer_buff, vhdm->data_end) != sizeof footer_buff ||
+                    mvhd_ftruncate64(vhdm->fd, vhdm->data_end + MVHD_FOOTER_SIZE) != 0) {
+                    *err = MVHD_ERR_FILE;
+                    goto cleanup_parent;
+                }
+            }
+        }
+        if (init_sector_bitmap(vhdm, options.bitmap_cache_size, &open_err) == -1) {
             *err = open_err;
-            goto cleanup_bat;
+            goto cleanup_parent;
+        }
+        if (!readonly && mvhd_init_free_slots(vhdm) == -1) {
+            *err = MVHD_ERR_MEM;
+            goto cleanup_bitmap;
         }
     } else if (vhdm->footer.disk_type != MVHD_TYPE_FIXED) {
         *err = MVHD_ERR_TYPE;
         goto cleanup_bitmap;
     }
     assign_io_funcs(vhdm);
+    vhdm->async_depth = MVHD_ASYNC_DEPTH_DEFAULT;
+    if (options.async_queue_depth > 0) {
+        vhdm->async_depth = (options.async_queue_depth < MVHD_ASYNC_DEPTH_MAX) ? (int)options.async_queue_depth : MVHD_ASYNC_DEPTH_MAX;
+    }
+    switch (options.placement) {
+	case MVHD_PLACE_LOCALITY:
+		vhdm->place_block = mvhd_place_locality;
+		break;
+
+	case MVHD_PLACE_CHUNKED:
+		vhdm->place_block = mvhd_place_chunked;
+		break;
+
+	default:
+		vhdm->place_block = mvhd_place_append;
+		break;
+    }
+    vhdm->place_chunk = MVHD_PLACE_CHUNK_DEFAULT;
+    if (options.placement_chunk > 0) {
+        vhdm->place_chunk = (options.placement_chunk < INT_MAX) ? (int)options.placement_chunk : INT_MAX;
+    }
+    if (!readonly && vhdm->footer.disk_type != MVHD_TYPE_FIXED && options.prealloc_blocks > 0) {
+        /* There is never a need for more space than the BAT can use */
+        vhdm->prealloc_blocks = (options.prealloc_blocks < vhdm->sparse.max_bat_ent) ? (int)options.prealloc_blocks : (int)vhdm->sparse.max_bat_ent;
+    }
+
+    if (options.use_mmap) {
+        /* Fixed images only need the data, dynamic images map everything up to the footer */
+        int64_t map_size = (vhdm->footer.disk_type == MVHD_TYPE_FIXED) ? (int64_t)vhdm->footer.curr_sz : vhdm->data_end;
+        vhdm->map.addr = mvhd_map_file(vhdm->fd, map_size, &vhdm->map.handle);
+        if (vhdm->map.addr != NULL) {
+            vhdm->map.size = map_size;
+        }
+    }
 
     vhdm->format_buffer.zero_data = calloc(64, MVHD_SECTOR_SIZE);
     if (vhdm->format_buffer.zero_data == NULL) {
@@ -569,29 +1271,11 @@ mvhd_open(const char* path, int readonly, int* err)
 
     vhdm->format_buffer.sector_count = 64;
     if (vhdm->footer.disk_type == MVHD_TYPE_DIFF) {
-        char* par_path = get_diff_parent_path(vhdm, err);
-        if (par_path == NULL) {
-            goto cleanup_format_buff;
-        }
-
-        uint32_t par_mod_ts = mvhd_file_mod_timestamp(par_path, err);
-        if (*err != 0) {
-            goto cleanup_format_buff;
-        }
-
-        if (vhdm->sparse.par_timestamp != par_mod_ts) {
-            /* The last-modified timestamp is to fragile to make this a fatal error.
-               Instead, we inform the caller of the potential problem. */
-            *err = MVHD_ERR_TIMESTAMP;
-        }
-        vhdm->parent = mvhd_open(par_path, true, err);
-        if (vhdm->parent == NULL) {
-            goto cleanup_format_buff;
-        }
-
-        if (memcmp(vhdm->sparse.par_uuid, vhdm->parent->footer.uuid, sizeof vhdm->sparse.par_uuid) != 0) {
-            *err = MVHD_ERR_INVALID_PAR_UUID;
-            goto cleanup_format_buff;
+        /* Which layer owns each block is found as blocks are first read. Reads work 
+           without it, just more slowly, so running out of memory here is not an error */
+        vhdm->block_owner = malloc(vhdm->sparse.max_bat_ent);
+        if (vhdm->block_owner != NULL) {
+            memset(vhdm->block_owner, MVHD_OWNER_UNKNOWN, vhdm->sparse.max_bat_ent);
         }
     }
 
@@ -601,21 +1285,28 @@ mvhd_open(const char* path, int readonly, int* err)
      */
     goto end;
 
-cleanup_format_buff:
-    free(vhdm->format_buffer.zero_data);
-    vhdm->format_buffer.zero_data = NULL;
-
 cleanup_bitmap:
-    free(vhdm->bitmap.curr_bitmap);
-    vhdm->bitmap.curr_bitmap = NULL;
+    free_sector_bitmap(vhdm);
+    free(vhdm->free_slots.offsets);
+    vhdm->free_slots.offsets = NULL;
+
+cleanup_parent:
+    if (vhdm->parent != NULL) {
+        release_parent(vhdm->parent);
+        vhdm->parent = NULL;
+    }
 
 cleanup_bat:
     free(vhdm->block_offset);
     vhdm->block_offset = NULL;
+    free(vhdm->bat_dirty);
+    vhdm->bat_dirty = NULL;
 
 cleanup_file:
-    fclose(vhdm->f);
-    vhdm->f = NULL;
+    if (vhdm->f != NULL) {
+        fclose(vhdm->f);
+        vhdm->f = NULL;
+    }
 
 cleanup_vhdm:
     free(vhdm);
@@ -626,14 +1317,42 @@ end:
 }
 
 
+MVHDAPI MVHDMeta *
+mvhd_open_ex(const char* path, MVHDOpenOptions options, int* err)
+{
+    return open_image(path, NULL, options, err);
+}
+
+
+MVHDAPI int
+mvhd_flush(MVHDMeta* vhdm)
+{
+    if (vhdm->footer.disk_type == MVHD_TYPE_DYNAMIC || vhdm->footer.disk_type == MVHD_TYPE_DIFF) {
+        if (mvhd_flush_sect_bitmaps(vhdm) != 0 || mvhd_flush_bat(vhdm) != 0 || mvhd_trim_tail(vhdm) != 0) {
+            return MVHD_ERR_FILE;
+        }
+    }
+    if (!vhdm->readonly && (fflush(vhdm->f) != 0 || mvhd_fsync(vhdm->fd) != 0)) {
+        mvhd_errno = errno;
+        return MVHD_ERR_FILE;
+    }
+
+    return 0;
+}
+
+
 MVHDAPI void
 mvhd_close(MVHDMeta* vhdm)
 {
     if (vhdm == NULL)
 	return;
 
+    mvhd_async_close(vhdm);
+    mvhd_flush(vhdm);
+    mvhd_unmap_file(vhdm->map.addr, vhdm->map.size, vhdm->map.handle);
+
     if (vhdm->parent != NULL) {
-        mvhd_close(vhdm->parent);
+        release_parent(vhdm->parent);
     }
 
     fclose(vhdm->f);
@@ -642,10 +1361,11 @@ mvhd_close(MVHDMeta* vhdm)
         free(vhdm->block_offset);
         vhdm->block_offset = NULL;
     }
-    if (vhdm->bitmap.curr_bitmap != NULL) {
-        free(vhdm->bitmap.curr_bitmap);
-        vhdm->bitmap.curr_bitmap = NULL;
-    }
+    free(vhdm->bat_dirty);
+    free(vhdm->block_owner);
+    mvhd_mutex_destroy(vhdm->lock);
+    free_sector_bitmap(vhdm);
+    free(vhdm->free_slots.offsets);
     if (vhdm->format_buffer.zero_data != NULL) {
         free(vhdm->format_buffer.zero_data);
         vhdm->format_buffer.zero_data = NULL;
@@ -668,11 +1388,13 @@ mvhd_diff_update_par_timestamp(MVHDMeta* vhdm, int* err)
         *err = MVHD_ERR_TYPE;
         return -1;
     }
-    char* par_path = get_diff_parent_path(vhdm, err);
-    if (par_path == NULL) {
+    char par_path[MVHD_MAX_PATH_BYTES];
+    FILE* par_f = NULL;
+    if (get_diff_parent_path(vhdm, par_path, &par_f, err) == NULL) {
         return -1;
     }
-    uint32_t par_mod_ts = mvhd_file_mod_timestamp(par_path, err);
+    uint32_t par_mod_ts = mvhd_file_mod_timestamp_f(par_f, err);
+    fclose(par_f);
     if (*err != 0) {
         return -1;
     }
@@ -683,40 +1405,210 @@ mvhd_diff_update_par_timestamp(MVHDMeta* vhdm, int* err)
 
     /* Generate and write the updated sparse header */
     mvhd_header_to_buffer(&vhdm->sparse, sparse_buff);
-    mvhd_fseeko64(vhdm->f, (int64_t)vhdm->footer.data_offset, SEEK_SET);
-    fwrite(sparse_buff, sizeof sparse_buff, 1, vhdm->f);
+    mvhd_pwrite(vhdm->fd, sparse_buff, sizeof sparse_buff, (int64_t)vhdm->footer.data_offset);
 
     return 0;
 }
 
 
+/**
+ * \brief Count the whole sectors held by a list of buffers
+ * 
+ * \param [in] iov The buffers
+ * \param [in] iovcnt The number of buffers in iov
+ * 
+ * \return The number of sectors, limited to INT_MAX
+ */
+static int
+iov_sector_count(const MVHDIOVec* iov, int iovcnt)
+{
+    uint64_t total = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        total += iov[i].len;
+    }
+    total /= MVHD_SECTOR_SIZE;
+
+    return (total > INT_MAX) ? INT_MAX : (int)total;
+}
+
+
 MVHDAPI int
 mvhd_read_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buff)
 {
-    return vhdm->read_sectors(vhdm, offset, num_sectors, out_buff);
+    MVHDIOVec iov = { out_buff, (num_sectors > 0) ? (size_t)num_sectors * MVHD_SECTOR_SIZE : 0 };
+    MVHDIOVCursor cur = { &iov, 1, 0, 0, NULL };
+
+    return vhdm->read_sectors(vhdm, offset, num_sectors, &cur);
 }
 
 
 MVHDAPI int
 mvhd_write_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff)
 {
-    return vhdm->write_sectors(vhdm, offset, num_sectors, in_buff);
+    MVHDIOVec iov = { in_buff, (num_sectors > 0) ? (size_t)num_sectors * MVHD_SECTOR_SIZE : 0 };
+    MVHDIOVCursor cur = { &iov, 1, 0, 0, NULL };
+
+    return vhdm->write_sectors(vhdm, offset, num_sectors, &cur);
+}
+
+
+MVHDAPI int
+mvhd_readv(MVHDMeta* vhdm, uint32_t offset, const MVHDIOVec* iov, int iovcnt)
+{
+    MVHDIOVCursor cur = { iov, iovcnt, 0, 0, NULL };
+
+    return vhdm->read_sectors(vhdm, offset, iov_sector_count(iov, iovcnt), &cur);
+}
+
+
+MVHDAPI int
+mvhd_writev(MVHDMeta* vhdm, uint32_t offset, const MVHDIOVec* iov, int iovcnt)
+{
+    MVHDIOVCursor cur = { iov, iovcnt, 0, 0, NULL };
+
+    return vhdm->write_sectors(vhdm, offset, iov_sector_count(iov, iovcnt), &cur);
+}
+
+
+MVHDAPI int
+mvhd_submit_batch(MVHDMeta* vhdm, MVHDRequest* reqs, int num_reqs)
+{
+    MVHDBatch batch = { NULL, 0, 0, NULL, 0, 0, false };
+    MVHDIOVec iov;
+    MVHDIOVCursor cur;
+    int i, pass, failed = 0;
+    bool run_failed = false;
+
+    /* All reads are resolved before any write can change where sectors are stored, so 
+       that each read sees either the old or the new data of an overlapping write */
+    for (pass = MVHD_REQ_READ; pass <= MVHD_REQ_WRITE; pass++) {
+        for (i = 0; i < num_reqs; i++) {
+            if (reqs[i].type != pass) {
+                continue;
+            }
+            iov.base = reqs[i].buff;
+            iov.len = (reqs[i].num_sectors > 0) ? (size_t)reqs[i].num_sectors * MVHD_SECTOR_SIZE : 0;
+            cur.iov = &iov;
+            cur.iovcnt = 1;
+            cur.idx = 0;
+            cur.pos = 0;
+            cur.batch = &batch;
+            if (pass == MVHD_REQ_READ) {
+                reqs[i].result = vhdm->read_sectors(vhdm, reqs[i].offset, reqs[i].num_sectors, &cur);
+            } else {
+                reqs[i].result = vhdm->write_sectors(vhdm, reqs[i].offset, reqs[i].num_sectors, &cur);
+            }
+        }
+    }
+    /* Sectors written by the batch are only marked once all of its data is on disk. In 
+       strict mode, their sector bitmaps are written right after */
+    if (mvhd_run_batch(&batch) == 0) {
+        mvhd_mark_written(vhdm, batch.marks, batch.mark_count);
+    } else {
+        run_failed = true;
+    }
+    free(batch.extents);
+    free(batch.marks);
+
+    for (i = 0; i < num_reqs; i++) {
+        if ((reqs[i].type != MVHD_REQ_READ && reqs[i].type != MVHD_REQ_WRITE) || run_failed) {
+            reqs[i].result = reqs[i].num_sectors;
+        }
+        if (reqs[i].result != 0) {
+            failed++;
+        }
+    }
+
+    return failed;
+}
+
+
+MVHDAPI const void*
+mvhd_map_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors, size_t* len)
+{
+    switch (vhdm->footer.disk_type) {
+	case MVHD_TYPE_FIXED:
+		return mvhd_fixed_map(vhdm, offset, num_sectors, len);
+
+	case MVHD_TYPE_DYNAMIC:
+		return mvhd_sparse_map(vhdm, offset, num_sectors, len);
+    }
+
+    *len = 0;
+
+    return NULL;
+}
+
+
+MVHDAPI int
+mvhd_discard_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors)
+{
+    if (vhdm->readonly) {
+        return 0;
+    }
+
+    switch (vhdm->footer.disk_type) {
+	case MVHD_TYPE_FIXED:
+		return mvhd_fixed_discard(vhdm, offset, num_sectors);
+
+	case MVHD_TYPE_DYNAMIC:
+	case MVHD_TYPE_DIFF:
+		return mvhd_sparse_discard(vhdm, offset, num_sectors);
+    }
+
+    return 0;
+}
+
+
+MVHDAPI int
+mvhd_preallocate(MVHDMeta* vhdm, uint32_t offset, int num_sectors)
+{
+    if (vhdm->readonly) {
+        return num_sectors;
+    }
+
+    switch (vhdm->footer.disk_type) {
+	case MVHD_TYPE_FIXED:
+		return mvhd_fixed_preallocate(vhdm, offset, num_sectors);
+
+	case MVHD_TYPE_DYNAMIC:
+	case MVHD_TYPE_DIFF:
+		return mvhd_sparse_preallocate(vhdm, offset, num_sectors);
+    }
+
+    return num_sectors;
 }
 
 
 MVHDAPI int
 mvhd_format_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors)
 {
-    int num_full = num_sectors / vhdm->format_buffer.sector_count;
-    int remain = num_sectors % vhdm->format_buffer.sector_count;
-    int i;
+    int num_full, remain, i;
+
+    if (vhdm->readonly) {
+        return 0;
+    }
+
+    /* Sparse images zero sectors by changing metadata, instead of storing zeros */
+    switch (vhdm->footer.disk_type) {
+	case MVHD_TYPE_DYNAMIC:
+		return mvhd_sparse_discard(vhdm, offset, num_sectors);
+
+	case MVHD_TYPE_DIFF:
+		return mvhd_diff_format(vhdm, offset, num_sectors);
+    }
+
+    num_full = num_sectors / vhdm->format_buffer.sector_count;
+    remain = num_sectors % vhdm->format_buffer.sector_count;
 
     for (i = 0; i < num_full; i++) {
-        vhdm->write_sectors(vhdm, offset, vhdm->format_buffer.sector_count, vhdm->format_buffer.zero_data);
+        mvhd_write_sectors(vhdm, offset, vhdm->format_buffer.sector_count, vhdm->format_buffer.zero_data);
         offset += vhdm->format_buffer.sector_count;
     }
 
-    vhdm->write_sectors(vhdm, offset, remain, vhdm->format_buffer.zero_data);
+    mvhd_write_sectors(vhdm, offset, remain, vhdm->format_buffer.zero_data);
 
     return 0;
 }
@@ -63,7 +63,8 @@ typedef enum MVHDError {
     MVHD_ERR_INVALID_BLOCK_SIZE,
     MVHD_ERR_INVALID_PARAMS,    
     MVHD_ERR_CONV_SIZE,
-    MVHD_ERR_TIMESTAMP
+    MVHD_ERR_TIMESTAMP,
+    MVHD_ERR_FOOTER_MISSING
 } MVHDError;
 
 typedef enum MVHDType {
@@ -78,6 +79,12 @@ typedef enum MVHDBlockSize {
     MVHD_BLOCK_LARGE = 4096  /**< 2 MB blocks */
 } MVHDBlockSize;
 
+typedef enum MVHDPlacement {
+    MVHD_PLACE_APPEND = 0,   /**< Reuse the lowest free slot, otherwise append */
+    MVHD_PLACE_LOCALITY = 1, /**< Place each new block as close as possible to its neighbouring blocks */
+    MVHD_PLACE_CHUNKED = 2   /**< Reserve space for runs of consecutive blocks together */
+} MVHDPlacement;
+
 typedef struct MVHDGeom {
     uint16_t cyl;
     uint8_t heads;
@@ -101,6 +108,41 @@ typedef struct MVHDCreationOptions {
     mvhd_progress_callback progress_callback; /** Optional; if not NULL, gets called to indicate progress on the creation operation. Only applies to MVHD_TYPE_FIXED. */
 } MVHDCreationOptions;
 
+typedef struct MVHDOpenOptions {
+    int readonly; /** Set this to 1 to open the VHD in a read only manner. Parents of differencing VHDs are always opened read only. */
+    uint32_t bitmap_cache_size; /** Memory budget in bytes for caching sector bitmaps, applied to each image in a differencing chain. If 0, a default of 64 KB is used. Ignored for MVHD_TYPE_FIXED. */
+    int strict; /** If 1, sector bitmaps and BAT entries are written to the file by every write that changes them. Otherwise they are kept in memory, and written back when evicted from the cache, once enough have collected, by mvhd_flush(), or by mvhd_close(). */
+    uint32_t async_queue_depth; /** The number of data transfers the asynchronous API keeps in flight. If 0, a default of 64 is used. The maximum is 4096. */
+    int zero_detect; /** If 1, writes to dynamic VHDs check for sectors that only contain zeros. Such sectors are not stored if they would read as zero anyway, so writing zeros to unallocated blocks does not allocate them. */
+    int use_mmap; /** If 1, map the image into memory. Reads of stored sectors are then copied from the mapping, and mvhd_map_sectors() can be used. If the image can't be mapped, regular file I/O is used. */
+    int placement; /** Where new blocks of dynamic and differencing VHDs are stored in the file. One of MVHDPlacement. */
+    uint32_t placement_chunk; /** For MVHD_PLACE_CHUNKED, the number of consecutive blocks that space is reserved for at once. If 0, a default of 16 is used. */
+    uint32_t prealloc_blocks; /** For dynamic and differencing VHDs, extend the file by space for this many blocks at once, and only move the footer when that space runs out. mvhd_flush() and mvhd_close() give back what is left. If 0, the file is extended one block at a time. */
+} MVHDOpenOptions;
+
+typedef struct MVHDIOVec {
+    void* base; /** Start of the buffer */
+    size_t len; /** Length of the buffer in bytes. Need not be a multiple of the sector size. */
+} MVHDIOVec;
+
+typedef enum MVHDRequestType {
+    MVHD_REQ_READ = 0,
+    MVHD_REQ_WRITE = 1
+} MVHDRequestType;
+
+typedef struct MVHDRequest {
+    int type; /** MVHD_REQ_READ or MVHD_REQ_WRITE */
+    uint32_t offset; /** The sector offset from which to start reading or writing */
+    int num_sectors; /** The number of sectors to transfer */
+    void* buff; /** The buffer to read sector data to, or write sector data from */
+    int result; /** Set by mvhd_submit_batch(). The number of sectors that were not transferred, or zero. */
+} MVHDRequest;
+
+typedef struct MVHDCompletion {
+    void* cookie; /** The cookie passed to mvhd_async_submit() */
+    int result; /** The number of sectors that were not transferred, or zero */
+} MVHDCompletion;
+
 typedef struct MVHDMeta MVHDMeta;
 
 
@@ -173,21 +215,44 @@ MVHDAPI MVHDType mvhd_get_type(MVHDMeta* vhdm);
  * The returned pointer contains all required values and structures (and files) to 
  * read and write to a VHD file.
  * 
- * Remember to call mvhd_close() when you are finished.
+ * Remember to call mvhd_close() when you are finished. Modified sector bitmaps and BAT 
+ * entries are written back lazily, see mvhd_flush().
  * 
  * \param [in] Absolute path to VHD file. Relative path will cause issues when opening
  * a differencing VHD file
  * \param [in] readonly set this to 1 to open the VHD in a read only manner
  * \param [out] err will be set if the VHD fails to open. Value could be one of 
  * MVHD_ERR_MEM, MVHD_ERR_FILE, MVHD_ERR_NOT_VHD, MVHD_ERR_FOOTER_CHECKSUM, MVHD_ERR_SPARSE_CHECKSUM, 
- * MVHD_ERR_TYPE, MVHD_ERR_TIMESTAMP
+ * MVHD_ERR_TYPE, MVHD_ERR_TIMESTAMP, MVHD_ERR_FOOTER_MISSING
  * If MVHD_ERR_FILE is set, mvhd_errno will be set to the appropriate system errno value
+ * MVHD_ERR_FOOTER_MISSING is set if a sparse image has no footer at the end of the file, and 
+ * something other than space preallocated by MiniVHD follows its data. It can still be 
+ * opened read only
  * 
  * \return MVHDMeta pointer. If NULL, check err. err may also be set to MVHD_ERR_TIMESTAMP if
  *         opening a differencing VHD.
  */
 MVHDAPI MVHDMeta* mvhd_open(const char* path, int readonly, int* err);
 
+/**
+ * \brief Open a VHD image using the provided options
+ * 
+ * Use mvhd_open_ex if you want more control over how the VHD is accessed. mvhd_open 
+ * is equivalent to calling this function with all other options set to 0.
+ * 
+ * Differencing VHDs that have the same parent share one read only handle to it, if they 
+ * were opened with the same bitmap_cache_size, use_mmap and async_queue_depth. Children 
+ * opened with other values of these get a separate handle.
+ * 
+ * \param [in] path Absolute path to VHD file
+ * \param [in] options the VHD open options
+ * \param [out] err will be set if the VHD fails to open. See mvhd_open for possible values
+ * 
+ * \return MVHDMeta pointer. If NULL, check err. err may also be set to MVHD_ERR_TIMESTAMP if
+ *         opening a differencing VHD.
+ */
+MVHDAPI MVHDMeta* mvhd_open_ex(const char* path, MVHDOpenOptions options, int* err);
+
 /**
  * \brief Update the parent modified timestamp in the VHD file
  * 
@@ -259,6 +324,23 @@ MVHDAPI MVHDMeta* mvhd_create_ex(MVHDCreationOptions options, int* err);
  */
 MVHDAPI void mvhd_close(MVHDMeta* vhdm);
 
+/**
+ * \brief Write any cached changes to the VHD file
+ * 
+ * Unless the image was opened with strict set, modified sector bitmaps and BAT entries 
+ * are kept in memory until they are evicted from the cache. Call this function to make 
+ * sure every write so far is reflected in the file. Space preallocated past the data is 
+ * given back, and the footer is moved to the end of the data. Then the file is synced 
+ * to the disk, so the writes survive a crash of the host. mvhd_close() does this 
+ * automatically.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * 
+ * \return 0 on success, MVHD_ERR_FILE on error. If so, mvhd_errno will be set to the 
+ *         appropriate system errno value
+ */
+MVHDAPI int mvhd_flush(MVHDMeta* vhdm);
+
 /**
  * \brief Calculate hard disk geometry from a provided size
  * 
@@ -352,6 +434,24 @@ MVHDAPI MVHDMeta* mvhd_convert_to_vhd_sparse(const char* utf8_raw_path, const ch
  */
 MVHDAPI FILE* mvhd_convert_to_raw(const char* utf8_vhd_path, const char* utf8_raw_path, int *err);
 
+/**
+ * \brief Flatten a differencing chain into a standalone dynamic VHD image
+ * 
+ * The new image holds what reading the whole chain returns, with the block size of 
+ * the top image. Each block is built from the layers that hold data for it and written 
+ * at once. Blocks that no layer holds data for are left unallocated. Any VHD type may 
+ * be flattened. The new image is flushed before it is returned. If anything can't be 
+ * read or written, the partly written image is deleted.
+ * 
+ * \param [in] utf8_vhd_path is the path of the top image of the chain
+ * \param [in] utf8_out_path is the path of the dynamic VHD to create
+ * \param [out] err indicates what error occurred, if any. MVHD_ERR_FILE if the chain could 
+ * not be read, or the new image could not be written
+ * 
+ * \return NULL if an error occurrs. Check value of *err for actual error. Otherwise returns pointer to a MVHDMeta struct
+ */
+MVHDAPI MVHDMeta* mvhd_flatten(const char* utf8_vhd_path, const char* utf8_out_path, int* err);
+
 /**
  * \brief Read sectors from VHD file
  * 
@@ -380,12 +480,190 @@ MVHDAPI int mvhd_read_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors,
  */
 MVHDAPI int mvhd_write_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff);
 
+/**
+ * \brief Read sectors from VHD file into a list of buffers
+ * 
+ * Like mvhd_read_sectors(), but the sector data is scattered across the buffers in iov, 
+ * in order. The number of sectors read is the total length of the buffers divided by 
+ * the sector size. Any remainder of the last buffer is left untouched. Where sectors are 
+ * stored contiguously in the file, they are read with a single system call.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset the sector offset from which to start reading from
+ * \param [in] iov the buffers to write sector data to
+ * \param [in] iovcnt the number of buffers in iov
+ * 
+ * \return the number of sectors that were not read, or zero
+ */
+MVHDAPI int mvhd_readv(MVHDMeta* vhdm, uint32_t offset, const MVHDIOVec* iov, int iovcnt);
+
+/**
+ * \brief Write sectors to VHD file from a list of buffers
+ * 
+ * Like mvhd_write_sectors(), but the sector data is gathered from the buffers in iov, 
+ * in order. The number of sectors written is the total length of the buffers divided by 
+ * the sector size. Where sectors are stored contiguously in the file, they are written 
+ * with a single system call.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset the sector offset from which to start writing to
+ * \param [in] iov the buffers to read sector data from
+ * \param [in] iovcnt the number of buffers in iov
+ * 
+ * \return the number of sectors that were not written, or zero
+ */
+MVHDAPI int mvhd_writev(MVHDMeta* vhdm, uint32_t offset, const MVHDIOVec* iov, int iovcnt);
+
+/**
+ * \brief Read and write a batch of independent requests
+ * 
+ * The requests are resolved to ranges of the image file, which are then sorted by file 
+ * offset. Ranges that are adjacent in the file are transferred with a single system call, 
+ * even when they belong to different requests. This is faster than submitting the requests 
+ * one by one when many arrive at once, for example from a guest's I/O queue.
+ * 
+ * The order in which requests are performed is unspecified. If a read overlaps a write in 
+ * the same batch, the read returns either the old or the new data for each sector. If 
+ * writes overlap each other, either may win.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in,out] reqs the requests. The result field of each request is set
+ * \param [in] num_reqs the number of requests in reqs
+ * 
+ * \return the number of requests that were not completely transferred, or zero
+ */
+MVHDAPI int mvhd_submit_batch(MVHDMeta* vhdm, MVHDRequest* reqs, int num_reqs);
+
+/**
+ * \brief Submit a read or write request for asynchronous completion
+ * 
+ * The request is resolved through the block allocation table and sector bitmaps, and 
+ * new blocks are allocated for writes, before this function returns. The data transfers 
+ * then run in the background: with io_uring on Linux, or on a pool of threads elsewhere. 
+ * The buffer must remain valid until the request's completion has been reaped with 
+ * mvhd_async_poll() or mvhd_async_wait().
+ * 
+ * Written sectors are only marked as such in the sector bitmaps when the completion is 
+ * reaped. Overlapping requests are therefore unordered until the earlier one has been 
+ * reaped: a read of sectors that a write in flight covers returns the old data, which is 
+ * zeros for sectors that were never written before, and of two overlapping writes either 
+ * may win. Reap a write before submitting requests that depend on it.
+ * 
+ * The functions of this library are not thread safe, and the asynchronous API is no 
+ * exception. Submit and reap requests from one thread at a time.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] req the request. Its result field is ignored
+ * \param [in] cookie a value that identifies the request in its completion
+ * 
+ * \retval 0 if the request was submitted
+ * \retval MVHD_ERR_INVALID_PARAMS if the request type is invalid
+ * \retval MVHD_ERR_MEM if memory could not be allocated. The request may have been 
+ *          performed, but no completion will be delivered for it
+ */
+MVHDAPI int mvhd_async_submit(MVHDMeta* vhdm, const MVHDRequest* req, void* cookie);
+
+/**
+ * \brief Reap completed asynchronous requests, without blocking
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [out] completions array to store the completions in
+ * \param [in] max the size of the completions array
+ * 
+ * \return the number of completions stored in completions
+ */
+MVHDAPI int mvhd_async_poll(MVHDMeta* vhdm, MVHDCompletion* completions, int max);
+
+/**
+ * \brief Reap completed asynchronous requests, blocking until at least one is available
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [out] completions array to store the completions in
+ * \param [in] max the size of the completions array
+ * 
+ * \return the number of completions stored in completions. Zero if no requests are in flight
+ */
+MVHDAPI int mvhd_async_wait(MVHDMeta* vhdm, MVHDCompletion* completions, int max);
+
+/**
+ * \brief Get a read-only pointer to sectors in a memory mapped VHD image
+ * 
+ * For images opened with the use_mmap option, this provides zero-copy access to sector 
+ * data in the host's page cache. Any number of processes mapping the same image share 
+ * the same memory.
+ * 
+ * For fixed VHDs, the pointer covers the requested sectors. For sparse VHDs, it covers 
+ * the run of stored sectors that starts at offset, which ends at the first sector that 
+ * was never written, or at the end of the block. Call this function again for the 
+ * remaining sectors. Differencing VHDs are not supported.
+ * 
+ * The pointer remains valid until the next write to, discard of, or mvhd_close() of, the image. 
+ * mvhd_format_sectors() discards sectors of dynamic VHDs, so it ends the validity as well. 
+ * The file never shrinks into the mapped range: the preallocated space mvhd_flush() gives 
+ * back lies past it, and blocks discarded at the end of the file are left as holes while the 
+ * image is mapped, to be reused by later writes.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset the sector offset of the first sector
+ * \param [in] num_sectors the number of sectors wanted
+ * \param [out] len the number of bytes that can be read at the returned pointer
+ * 
+ * \return A pointer to the sector data, or NULL if the image is not mapped, or the 
+ *         sector at offset is not stored in the mapping. Use mvhd_read_sectors() in that case
+ */
+MVHDAPI const void* mvhd_map_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors, size_t* len);
+
+/**
+ * \brief Discard sectors that are no longer in use
+ * 
+ * This is the equivalent of TRIM. The storage used by the sectors is returned to the 
+ * host where possible. Afterwards, discarded sectors of fixed and dynamic VHDs read as 
+ * zeros. Discarded sectors of differencing VHDs read as the parent's data again.
+ * 
+ * Dynamic and differencing VHDs release blocks that no longer have any sectors in use. 
+ * A released block at the end of the file is truncated off. Others become holes in the 
+ * file, where the host filesystem supports them.
+ * 
+ * Don't discard sectors that have asynchronous writes in flight.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset the sector offset from which to start discarding
+ * \param [in] num_sectors the number of sectors to discard
+ * 
+ * \return the number of sectors that were not discarded, or zero
+ */
+MVHDAPI int mvhd_discard_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors);
+
+/**
+ * \brief Allocate storage for sectors ahead of time
+ * 
+ * Dynamic and differencing VHDs allocate every block in the range that is not allocated 
+ * yet, so later writes to them don't have to. The new blocks have no sectors in use, 
+ * so the sectors still read as before: zeros for dynamic VHDs, and the parent's data 
+ * for differencing VHDs. Fixed VHDs have holes the host left in the range filled in.
+ * 
+ * Preallocated blocks that still have no sectors in use are released again by 
+ * mvhd_discard_sectors() and mvhd_format_sectors().
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset the sector offset from which to start preallocating
+ * \param [in] num_sectors the number of sectors to preallocate
+ * 
+ * \return the number of sectors that were not preallocated, or zero
+ */
+MVHDAPI int mvhd_preallocate(MVHDMeta* vhdm, uint32_t offset, int num_sectors);
+
 /**
  * \brief Write zeroed sectors to VHD file
  * 
  * Write num_sectors, beginning at offset, of zero data into the VHD file. 
- * We reuse the existing write functions, with a preallocated zero buffer as 
- * our source buffer.
+ * For fixed VHDs, we reuse the existing write functions, with a preallocated 
+ * zero buffer as our source buffer.
+ * 
+ * Dynamic VHDs only update metadata: the sectors are discarded, as with 
+ * mvhd_discard_sectors(), so unallocated blocks stay unallocated. Differencing 
+ * VHDs discard the sectors where the parent reads as zero, and only store zeros 
+ * where they are needed to hide data in the parent.
  * 
  * \param [in] vhdm MiniVHD data structure
  * \param [in] offset the sector offset from which to start writing to
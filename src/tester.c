@@ -43,15 +43,1805 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 #include <time.h>
 #include <minivhd.h>
 
 
+/* Behavioural tests. Each one writes through the API, closes and reopens the image, 
+ * and compares what is read back with what was written */
+#define TEST_SIZE (64ULL * 1024 * 1024)
+#define TEST_BLOCK 4096 /* sectors per block of the test images */
+#define TEST_FAIL(...) do { printf("  " __VA_ARGS__); printf("\n"); goto cleanup; } while (0)
+
+
+/* Fill sectors with data that depends on their offset and a seed, so that sectors 
+ * which end up in the wrong place are noticed. No sector is all zeros */
+static void fill_sectors(uint8_t* buff, uint32_t offset, int num_sectors, int seed) {
+    int i, j;
+
+    for (i = 0; i < num_sectors; i++) {
+        for (j = 0; j < 512; j++) {
+            buff[(size_t)i * 512 + j] = (uint8_t)((offset + i) * 31 + j + seed * 7 + 1);
+        }
+    }
+}
+
+
+/* Read sectors, and compare them with the expected data. If expected is NULL, the 
+ * sectors have to be zero */
+static int expect_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors, const uint8_t* expected) {
+    uint8_t* buff = malloc((size_t)num_sectors * 512);
+    uint8_t* zeros = calloc((size_t)num_sectors, 512);
+    int ret = -1;
+
+    if (buff != NULL && zeros != NULL && mvhd_read_sectors(vhdm, offset, num_sectors, buff) == 0 &&
+        memcmp(buff, (expected != NULL) ? expected : zeros, (size_t)num_sectors * 512) == 0) {
+        ret = 0;
+    }
+    free(buff);
+    free(zeros);
+
+    return ret;
+}
+
+
+static long file_size(const char* path) {
+    FILE* f = fopen(path, "rb");
+    long size = -1;
+
+    if (f != NULL) {
+        if (fseek(f, 0, SEEK_END) == 0) {
+            size = ftell(f);
+        }
+        fclose(f);
+    }
+
+    return size;
+}
+
+
+/* Differencing images find their parent through absolute paths */
+static bool is_absolute(const char* path) {
+    return path[0] == '/' || path[0] == '\\' || (path[0] != '\0' && path[1] == ':');
+}
+
+
+/* Create a differencing image, and close it again */
+static int create_child(const char* path, const char* par_path) {
+    MVHDMeta* vhdm;
+    int err;
+
+    remove(path);
+    vhdm = mvhd_create_diff(path, par_path, &err);
+    if (vhdm == NULL) {
+        printf("  creating %s: %s\n", path, mvhd_strerr(err));
+        return -1;
+    }
+    mvhd_close(vhdm);
+
+    return 0;
+}
+
+
+/* Copy a file, and append extra bytes of fill to the copy */
+static int copy_file(const char* src_path, const char* dest_path, size_t extra, int fill) {
+    uint8_t buff[4096];
+    FILE* src = fopen(src_path, "rb");
+    FILE* dest = fopen(dest_path, "wb");
+    size_t n;
+    int ret = -1;
+
+    if (src != NULL && dest != NULL) {
+        while ((n = fread(buff, 1, sizeof buff, src)) > 0 && fwrite(buff, 1, n, dest) == n) {
+        }
+        memset(buff, fill, sizeof buff);
+        for (; extra > 0; extra -= n) {
+            n = (extra < sizeof buff) ? extra : sizeof buff;
+            if (fwrite(buff, 1, n, dest) != n) {
+                break;
+            }
+        }
+        ret = (ferror(src) || extra > 0) ? -1 : 0;
+    }
+    if (src != NULL) {
+        fclose(src);
+    }
+    if (dest != NULL && fclose(dest) != 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+
+static MVHDMeta* create_dynamic(const char* path, int* err) {
+    MVHDCreationOptions opts;
+
+    remove(path);
+    memset(&opts, 0, sizeof opts);
+    opts.type = MVHD_TYPE_DYNAMIC;
+    opts.path = (char*)path;
+    opts.size_in_bytes = TEST_SIZE;
+
+    return mvhd_create_ex(opts, err);
+}
+
+
+/* Write sectors to an image, then close it */
+static int write_and_close(MVHDMeta* vhdm, uint32_t offset, int num_sectors, uint8_t* data) {
+    int ret = mvhd_write_sectors(vhdm, offset, num_sectors, data);
+
+    mvhd_close(vhdm);
+
+    return ret;
+}
+
+
+#define CACHE_BLOCKS 12 /* blocks written by the bitmap cache tests, more than it holds */
+#define CACHE_SIZE (4 * 512) /* room for the sector bitmaps of four blocks */
+
+
+static MVHDMeta* open_small_cache(const char* path, bool readonly, int* err) {
+    MVHDOpenOptions opts;
+
+    memset(&opts, 0, sizeof opts);
+    opts.readonly = readonly;
+    opts.bitmap_cache_size = CACHE_SIZE;
+
+    return mvhd_open_ex(path, opts, err);
+}
+
+
+/* Write the same runs of sectors into each of the first CACHE_BLOCKS blocks, shifted by 
+ * the block number, and keep what the image should now hold in image. A run may cross 
+ * into the next block */
+static int write_runs(MVHDMeta* vhdm, uint8_t* image, const uint32_t runs[][2], int num_runs, int seed) {
+    uint32_t start, end;
+    int blk, i;
+
+    for (blk = 0; blk < CACHE_BLOCKS; blk++) {
+        for (i = 0; i < num_runs; i++) {
+            start = (uint32_t)(TEST_BLOCK * blk) + runs[i][0] + (uint32_t)blk;
+            end = start + runs[i][1];
+            if (end > TEST_BLOCK * CACHE_BLOCKS) {
+                end = TEST_BLOCK * CACHE_BLOCKS;
+            }
+            fill_sectors(image + (size_t)start * 512, start, (int)(end - start), seed);
+            if (mvhd_write_sectors(vhdm, start, (int)(end - start), image + (size_t)start * 512) != 0) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+/* Read the blocks written by write_runs() with one read, and with reads that start and 
+ * end in the middle of runs */
+static int expect_runs(MVHDMeta* vhdm, const uint8_t* image) {
+    uint32_t offset, n, total = TEST_BLOCK * CACHE_BLOCKS;
+
+    if (expect_sectors(vhdm, 0, (int)total, image) != 0) {
+        return -1;
+    }
+    for (offset = 3; offset < total; offset += n) {
+        n = (total - offset < 3001) ? total - offset : 3001;
+        if (expect_sectors(vhdm, offset, (int)n, image + (size_t)offset * 512) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Runs of written and unwritten sectors read back through a bitmap cache that is too 
+ * small for all the blocks, before and after reopening */
+static int test_sparse_runs(const char* path) {
+    static const uint32_t runs[][2] = { { 0, 8 }, { 16, 24 }, { 4080, 12 } };
+    MVHDMeta* vhdm = NULL;
+    int err, ret = -1;
+    uint8_t* image = calloc((size_t)TEST_BLOCK * CACHE_BLOCKS, 512);
+
+    if (image == NULL) {
+        TEST_FAIL("out of memory");
+    }
+    vhdm = create_dynamic(path, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    mvhd_close(vhdm);
+    vhdm = open_small_cache(path, false, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    if (write_runs(vhdm, image, runs, 3, 2) != 0) {
+        TEST_FAIL("mvhd_write_sectors failed");
+    }
+    if (expect_runs(vhdm, image) != 0) {
+        TEST_FAIL("runs read back differently");
+    }
+    mvhd_close(vhdm);
+
+    vhdm = open_small_cache(path, true, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    if (expect_runs(vhdm, image) != 0) {
+        TEST_FAIL("runs read back differently after reopening");
+    }
+    ret = 0;
+
+cleanup:
+    mvhd_close(vhdm);
+    free(image);
+    printf("  sparse runs: %s\n", (ret == 0) ? "ok" : "FAILED");
+
+    return ret;
+}
+
+
+/* Runs of a child interleaved with runs of its parent, read through bitmap caches that 
+ * are too small for all the blocks of either image */
+static int test_chain_runs(const char* base_path, const char* kid_path) {
+    static const uint32_t base_runs[][2] = { { 0, 8 }, { 16, 24 }, { 4080, 12 } };
+    static const uint32_t kid_runs[][2] = { { 4, 8 }, { 30, 40 }, { 2000, 50 } };
+    MVHDMeta* vhdm = NULL;
+    int err, ret = -1;
+    uint8_t* image = calloc((size_t)TEST_BLOCK * CACHE_BLOCKS, 512);
+
+    if (image == NULL) {
+        TEST_FAIL("out of memory");
+    }
+    vhdm = create_dynamic(base_path, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    err = write_runs(vhdm, image, base_runs, 3, 3);
+    mvhd_close(vhdm);
+    vhdm = NULL;
+    if (err != 0 || create_child(kid_path, base_path) != 0) {
+        TEST_FAIL("creating the chain failed");
+    }
+    vhdm = open_small_cache(kid_path, false, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    if (write_runs(vhdm, image, kid_runs, 3, 4) != 0) {
+        TEST_FAIL("mvhd_write_sectors failed");
+    }
+    if (expect_runs(vhdm, image) != 0) {
+        TEST_FAIL("the layers were not combined correctly");
+    }
+    mvhd_close(vhdm);
+
+    vhdm = open_small_cache(kid_path, true, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    if (expect_runs(vhdm, image) != 0) {
+        TEST_FAIL("the layers were not combined correctly after reopening");
+    }
+    ret = 0;
+
+cleanup:
+    mvhd_close(vhdm);
+    free(image);
+    printf("  chain runs: %s\n", (ret == 0) ? "ok" : "FAILED");
+
+    return ret;
+}
+
+
+/* Check sectors 8-15 of the first num_blocks blocks of a copy of an image */
+static int expect_copy(const char* path, const char* copy_path, int num_blocks, int seed, uint8_t* data) {
+    MVHDMeta* vhdm;
+    int blk, err, ret;
+
+    if (copy_file(path, copy_path, 0, 0) != 0) {
+        return -1;
+    }
+    vhdm = mvhd_open(copy_path, true, &err);
+    if (vhdm == NULL) {
+        return -1;
+    }
+    for (blk = 0, ret = 0; blk < num_blocks && ret == 0; blk++) {
+        fill_sectors(data, (uint32_t)(TEST_BLOCK * blk + 8), 8, seed);
+        ret = expect_sectors(vhdm, (uint32_t)(TEST_BLOCK * blk + 8), 8, data);
+    }
+    mvhd_close(vhdm);
+
+    return ret;
+}
+
+
+/* Dirty sector bitmaps reach the file when they are evicted from the cache, flushed, 
+ * or when the image is closed */
+static int test_bitmap_write_back(const char* path, const char* copy_path) {
+    MVHDMeta* vhdm = NULL;
+    int blk, err, ret = -1;
+    uint8_t* data = malloc(8 * 512);
+
+    if (data == NULL) {
+        TEST_FAIL("out of memory");
+    }
+    /* The blocks are allocated first, so only their sector bitmaps change below */
+    vhdm = create_dynamic(path, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    memset(data, 0xa5, 512);
+    for (blk = 0; blk < CACHE_BLOCKS; blk++) {
+        if (mvhd_write_sectors(vhdm, (uint32_t)(TEST_BLOCK * blk), 1, data) != 0) {
+            TEST_FAIL("mvhd_write_sectors failed");
+        }
+    }
+    mvhd_close(vhdm);
+
+    vhdm = open_small_cache(path, false, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    for (blk = 0; blk < CACHE_BLOCKS; blk++) {
+        fill_sectors(data, (uint32_t)(TEST_BLOCK * blk + 8), 8, 5);
+        if (mvhd_write_sectors(vhdm, (uint32_t)(TEST_BLOCK * blk + 8), 8, data) != 0) {
+            TEST_FAIL("mvhd_write_sectors failed");
+        }
+    }
+    /* The cache holds four blocks, so the bitmaps of all the others have been evicted */
+    if (expect_copy(path, copy_path, CACHE_BLOCKS - 4, 5, data) != 0) {
+        TEST_FAIL("evicted sector bitmaps are not in the file");
+    }
+    if (mvhd_flush(vhdm) != 0 || expect_copy(path, copy_path, CACHE_BLOCKS, 5, data) != 0) {
+        TEST_FAIL("flushed sector bitmaps are not in the file");
+    }
+
+    /* The last blocks are still cached, and only written back by closing */
+    for (blk = CACHE_BLOCKS - 2; blk < CACHE_BLOCKS; blk++) {
+        fill_sectors(data, (uint32_t)(TEST_BLOCK * blk + 16), 8, 6);
+        if (mvhd_write_sectors(vhdm, (uint32_t)(TEST_BLOCK * blk + 16), 8, data) != 0) {
+            TEST_FAIL("mvhd_write_sectors failed");
+        }
+    }
+    mvhd_close(vhdm);
+    vhdm = mvhd_open(path, true, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    for (blk = CACHE_BLOCKS - 2; blk < CACHE_BLOCKS; blk++) {
+        fill_sectors(data, (uint32_t)(TEST_BLOCK * blk + 16), 8, 6);
+        if (expect_sectors(vhdm, (uint32_t)(TEST_BLOCK * blk + 16), 8, data) != 0) {
+            TEST_FAIL("sector bitmaps written back by closing are not in the file");
+        }
+    }
+    ret = 0;
+
+cleanup:
+    mvhd_close(vhdm);
+    free(data);
+    printf("  sector bitmap write back: %s\n", (ret == 0) ? "ok" : "FAILED");
+
+    return ret;
+}
+
+
+/* Check that sectors mapped from an image match what is read from it */
+static int expect_mapped(MVHDMeta* vhdm, uint32_t offset, int num_sectors, size_t expected_len) {
+    const void* p;
+    size_t len;
+
+    p = mvhd_map_sectors(vhdm, offset, num_sectors, &len);
+    if (p == NULL || len != expected_len) {
+        return -1;
+    }
+
+    return expect_sectors(vhdm, offset, (int)(len / 512), (const uint8_t*)p);
+}
+
+
+/* Sectors mapped from fixed and dynamic images are the ones that are read. Sectors that 
+ * are not stored, and differencing images, can't be mapped */
+static int test_map_sectors(const char* path, const char* kid_path) {
+    MVHDCreationOptions create_opts;
+    MVHDOpenOptions opts;
+    MVHDMeta* vhdm = NULL;
+    size_t len;
+    int err, ret = -1;
+    uint8_t* data = malloc(16 * 512);
+
+    if (data == NULL) {
+        TEST_FAIL("out of memory");
+    }
+    memset(&opts, 0, sizeof opts);
+    opts.readonly = 1;
+    opts.use_mmap = 1;
+
+    remove(path);
+    memset(&create_opts, 0, sizeof create_opts);
+    create_opts.type = MVHD_TYPE_FIXED;
+    create_opts.path = (char*)path;
+    create_opts.size_in_bytes = 4 * 1024 * 1024;
+    vhdm = mvhd_create_ex(create_opts, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    fill_sectors(data, 100, 16, 7);
+    err = write_and_close(vhdm, 100, 16, data);
+    vhdm = NULL;
+    if (err != 0) {
+        TEST_FAIL("writing the fixed image failed");
+    }
+    vhdm = mvhd_open_ex(path, opts, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    if (expect_mapped(vhdm, 100, 16, 16 * 512) != 0 || expect_mapped(vhdm, 90, 40, 40 * 512) != 0) {
+        TEST_FAIL("mapped sectors of a fixed image differ from the ones read");
+    }
+    mvhd_close(vhdm);
+
+    vhdm = create_dynamic(path, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    fill_sectors(data, TEST_BLOCK + 8, 16, 7);
+    err = write_and_close(vhdm, TEST_BLOCK + 8, 16, data);
+    vhdm = NULL;
+    if (err != 0) {
+        TEST_FAIL("writing the dynamic image failed");
+    }
+    vhdm = mvhd_open_ex(path, opts, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    if (expect_mapped(vhdm, TEST_BLOCK + 8, 32, 16 * 512) != 0 || expect_mapped(vhdm, TEST_BLOCK + 12, 4, 4 * 512) != 0) {
+        TEST_FAIL("mapped sectors of a dynamic image differ from the ones read");
+    }
+    if (mvhd_map_sectors(vhdm, TEST_BLOCK, 8, &len) != NULL || mvhd_map_sectors(vhdm, 0, 8, &len) != NULL) {
+        TEST_FAIL("sectors that are not stored were mapped");
+    }
+    mvhd_close(vhdm);
+    vhdm = NULL;
+
+    if (kid_path != NULL) {
+        if (create_child(kid_path, path) != 0) {
+            goto cleanup;
+        }
+        vhdm = mvhd_open_ex(kid_path, opts, &err);
+        if (vhdm == NULL) {
+            TEST_FAIL("%s", mvhd_strerr(err));
+        }
+        if (mvhd_map_sectors(vhdm, TEST_BLOCK + 8, 16, &len) != NULL) {
+            TEST_FAIL("sectors of a differencing image were mapped");
+        }
+    }
+    ret = 0;
+
+cleanup:
+    mvhd_close(vhdm);
+    free(data);
+    printf("  map sectors: %s\n", (ret == 0) ? "ok" : "FAILED");
+
+    return ret;
+}
+
+
+/* Scatter-gather I/O with buffers that split sectors, across a block boundary */
+static int test_readv_writev(const char* path) {
+    MVHDIOVec iov[3];
+    MVHDMeta* vhdm = NULL;
+    uint32_t offset = TEST_BLOCK - 5;
+    int err, ret = -1, n = 10;
+    uint8_t* data = malloc((size_t)n * 512);
+    uint8_t* back = calloc((size_t)n, 512);
+
+    if (data == NULL || back == NULL) {
+        TEST_FAIL("out of memory");
+    }
+    fill_sectors(data, offset, n, 1);
+    vhdm = create_dynamic(path, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    iov[0].base = data;
+    iov[0].len = 700;
+    iov[1].base = data + 700;
+    iov[1].len = 1000;
+    iov[2].base = data + 1700;
+    iov[2].len = (size_t)n * 512 - 1700;
+    if (mvhd_writev(vhdm, offset, iov, 3) != 0) {
+        TEST_FAIL("mvhd_writev failed");
+    }
+    mvhd_close(vhdm);
+
+    vhdm = mvhd_open(path, true, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    iov[0].base = back;
+    iov[0].len = 1;
+    iov[1].base = back + 1;
+    iov[1].len = 2047;
+    iov[2].base = back + 2048;
+    iov[2].len = (size_t)n * 512 - 2048;
+    if (mvhd_readv(vhdm, offset, iov, 3) != 0 || memcmp(back, data, (size_t)n * 512) != 0) {
+        TEST_FAIL("mvhd_readv returned other data than was written");
+    }
+    if (expect_sectors(vhdm, offset - 1, 1, NULL) != 0 || expect_sectors(vhdm, offset + n, 1, NULL) != 0) {
+        TEST_FAIL("sectors next to the written ones are not zero");
+    }
+    ret = 0;
+
+cleanup:
+    mvhd_close(vhdm);
+    free(data);
+    free(back);
+    printf("  readv/writev: %s\n", (ret == 0) ? "ok" : "FAILED");
+
+    return ret;
+}
+
+
+/* A batch whose writes are adjacent in the file, but queued in reverse order, with a 
+ * read of other data and a write that straddles two blocks */
+static int test_batch(const char* path) {
+    MVHDRequest reqs[5];
+    MVHDMeta* vhdm = NULL;
+    uint32_t read_off = TEST_BLOCK * 2, straddle_off = TEST_BLOCK * 3 - 4;
+    int i, err, ret = -1;
+    uint8_t* data = malloc(24 * 512);
+    uint8_t* old = malloc(8 * 512);
+    uint8_t* straddle = malloc(8 * 512);
+    uint8_t* back = malloc(8 * 512);
+
+    if (data == NULL || old == NULL || straddle == NULL || back == NULL) {
+        TEST_FAIL("out of memory");
+    }
+    fill_sectors(data, 0, 24, 2);
+    fill_sectors(old, read_off, 8, 3);
+    fill_sectors(straddle, straddle_off, 8, 4);
+    vhdm = create_dynamic(path, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    if (mvhd_write_sectors(vhdm, read_off, 8, old) != 0) {
+        TEST_FAIL("mvhd_write_sectors failed");
+    }
+
+    memset(reqs, 0, sizeof reqs);
+    for (i = 0; i < 3; i++) {
+        reqs[i].type = MVHD_REQ_WRITE;
+        reqs[i].offset = (uint32_t)(16 - i * 8);
+        reqs[i].num_sectors = 8;
+        reqs[i].buff = data + (size_t)(16 - i * 8) * 512;
+    }
+    reqs[3].type = MVHD_REQ_READ;
+    reqs[3].offset = read_off;
+    reqs[3].num_sectors = 8;
+    reqs[3].buff = back;
+    reqs[4].type = MVHD_REQ_WRITE;
+    reqs[4].offset = straddle_off;
+    reqs[4].num_sectors = 8;
+    reqs[4].buff = straddle;
+    if (mvhd_submit_batch(vhdm, reqs, 5) != 0) {
+        TEST_FAIL("mvhd_submit_batch failed");
+    }
+    for (i = 0; i < 5; i++) {
+        if (reqs[i].result != 0) {
+            TEST_FAIL("request %d was not completely transferred", i);
+        }
+    }
+    if (memcmp(back, old, 8 * 512) != 0) {
+        TEST_FAIL("batched read returned other data than was written");
+    }
+    mvhd_close(vhdm);
+
+    vhdm = mvhd_open(path, true, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    if (expect_sectors(vhdm, 0, 24, data) != 0 || expect_sectors(vhdm, straddle_off, 8, straddle) != 0 ||
+        expect_sectors(vhdm, read_off, 8, old) != 0) {
+        TEST_FAIL("batched writes did not reach the image");
+    }
+    ret = 0;
+
+cleanup:
+    mvhd_close(vhdm);
+    free(data);
+    free(old);
+    free(straddle);
+    free(back);
+    printf("  batch: %s\n", (ret == 0) ? "ok" : "FAILED");
+
+    return ret;
+}
+
+
+/* Wait for all asynchronous requests, checking that each completes once, completely */
+static int reap_all(MVHDMeta* vhdm, int* seen, int num_reqs) {
+    MVHDCompletion done[8];
+    int i, n, id, reaped = 0;
+
+    memset(seen, 0, (size_t)num_reqs * sizeof *seen);
+    while ((n = mvhd_async_wait(vhdm, done, 8)) > 0) {
+        for (i = 0; i < n; i++) {
+            id = (int)((int*)done[i].cookie - seen);
+            if (id < 0 || id >= num_reqs || seen[id]++ != 0 || done[i].result != 0) {
+                return -1;
+            }
+            reaped++;
+        }
+    }
+
+    return (reaped == num_reqs) ? 0 : -1;
+}
+
+
+/* Asynchronous writes spread over several blocks, then asynchronous reads of them */
+static int test_async(const char* path) {
+    MVHDRequest req;
+    MVHDMeta* vhdm = NULL;
+    int seen[16];
+    int i, err, ret = -1, num_reqs = 16;
+    uint8_t* data = malloc((size_t)num_reqs * 8 * 512);
+    uint8_t* back = calloc((size_t)num_reqs * 8, 512);
+
+    if (data == NULL || back == NULL) {
+        TEST_FAIL("out of memory");
+    }
+    vhdm = create_dynamic(path, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    memset(&req, 0, sizeof req);
+    req.num_sectors = 8;
+    for (i = 0; i < num_reqs; i++) {
+        req.type = MVHD_REQ_WRITE;
+        req.offset = (uint32_t)((i % 4) * TEST_BLOCK + i * 8);
+        req.buff = data + (size_t)i * 8 * 512;
+        fill_sectors(req.buff, req.offset, 8, 5);
+        if (mvhd_async_submit(vhdm, &req, &seen[i]) != 0) {
+            TEST_FAIL("mvhd_async_submit failed");
+        }
+    }
+    if (reap_all(vhdm, seen, num_reqs) != 0) {
+        TEST_FAIL("writes did not each complete once");
+    }
+    for (i = 0; i < num_reqs; i++) {
+        req.type = MVHD_REQ_READ;
+        req.offset = (uint32_t)((i % 4) * TEST_BLOCK + i * 8);
+        req.buff = back + (size_t)i * 8 * 512;
+        if (mvhd_async_submit(vhdm, &req, &seen[i]) != 0) {
+            TEST_FAIL("mvhd_async_submit failed");
+        }
+    }
+    if (reap_all(vhdm, seen, num_reqs) != 0) {
+        TEST_FAIL("reads did not each complete once");
+    }
+    if (memcmp(back, data, (size_t)num_reqs * 8 * 512) != 0) {
+        TEST_FAIL("asynchronous reads returned other data than was written");
+    }
+    mvhd_close(vhdm);
+
+    vhdm = mvhd_open(path, true, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    for (i = 0; i < num_reqs; i++) {
+        if (expect_sectors(vhdm, (uint32_t)((i % 4) * TEST_BLOCK + i * 8), 8, data + (size_t)i * 8 * 512) != 0) {
+            TEST_FAIL("asynchronous write %d did not reach the image", i);
+        }
+    }
+    ret = 0;
+
+cleanup:
+    mvhd_close(vhdm);
+    free(data);
+    free(back);
+    printf("  async: %s\n", (ret == 0) ? "ok" : "FAILED");
+
+    return ret;
+}
+
+
+/* Zero detection: zeros written to an unallocated block don't allocate it, zeros over 
+ * data replace it, and only the sectors that were really written are marked. The last 
+ * part is checked through a memory mapping, which ends at the first unwritten sector */
+static int test_zero_detect(const char* path) {
+    MVHDOpenOptions opts;
+    MVHDRequest req;
+    MVHDCompletion done;
+    MVHDMeta* vhdm = NULL;
+    const void* map;
+    size_t len;
+    long size;
+    uint32_t async_off = TEST_BLOCK * 6;
+    int err, ret = -1;
+    uint8_t* data = malloc(24 * 512);
+    uint8_t* zeros = calloc(TEST_BLOCK, 512);
+
+    if (data == NULL || zeros == NULL) {
+        TEST_FAIL("out of memory");
+    }
+    vhdm = create_dynamic(path, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    mvhd_close(vhdm);
+    memset(&opts, 0, sizeof opts);
+    opts.zero_detect = 1;
+    opts.use_mmap = 1;
+    vhdm = mvhd_open_ex(path, opts, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+
+    size = file_size(path);
+    if (mvhd_write_sectors(vhdm, TEST_BLOCK * 5, TEST_BLOCK, zeros) != 0 || mvhd_flush(vhdm) != 0) {
+        TEST_FAIL("writing zeros failed");
+    }
+    if (file_size(path) != size) {
+        TEST_FAIL("writing zeros to an unallocated block allocated it");
+    }
+
+    fill_sectors(data, 0, 16, 6);
+    if (mvhd_write_sectors(vhdm, 0, 16, data) != 0 || mvhd_write_sectors(vhdm, 4, 4, zeros) != 0) {
+        TEST_FAIL("mvhd_write_sectors failed");
+    }
+    memset(data + 4 * 512, 0, 4 * 512);
+
+    /* Data, zeros, data, into a new block */
+    fill_sectors(zeros + 8 * 512, async_off, 24, 7);
+    memset(zeros + 16 * 512, 0, 8 * 512);
+    memset(&req, 0, sizeof req);
+    req.type = MVHD_REQ_WRITE;
+    req.offset = async_off;
+    req.num_sectors = 24;
+    req.buff = zeros + 8 * 512;
+    if (mvhd_async_submit(vhdm, &req, NULL) != 0 || mvhd_async_wait(vhdm, &done, 1) != 1 || done.result != 0) {
+        TEST_FAIL("asynchronous write failed");
+    }
+    mvhd_close(vhdm);
+
+    vhdm = mvhd_open_ex(path, opts, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    if (expect_sectors(vhdm, 0, 16, data) != 0) {
+        TEST_FAIL("zeros written over data were not stored");
+    }
+    if (expect_sectors(vhdm, async_off, 24, zeros + 8 * 512) != 0) {
+        TEST_FAIL("asynchronous write did not reach the image");
+    }
+    map = mvhd_map_sectors(vhdm, async_off, 24, &len);
+    if (map != NULL && len != 8 * 512) {
+        TEST_FAIL("zero sectors that were skipped are marked as written");
+    }
+    ret = 0;
+
+cleanup:
+    mvhd_close(vhdm);
+    free(data);
+    free(zeros);
+    printf("  zero detection: %s\n", (ret == 0) ? "ok" : "FAILED");
+
+    return ret;
+}
+
+
+/* Discarding part of a block, a whole block, and the last block of the file */
+static int test_discard(const char* path) {
+    MVHDMeta* vhdm = NULL;
+    long size;
+    int err, ret = -1, n = TEST_BLOCK * 2 + 16;
+    uint8_t* data = malloc((size_t)n * 512);
+
+    if (data == NULL) {
+        TEST_FAIL("out of memory");
+    }
+    fill_sectors(data, 0, n, 8);
+    vhdm = create_dynamic(path, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    if (mvhd_write_sectors(vhdm, 0, n, data) != 0 || mvhd_flush(vhdm) != 0) {
+        TEST_FAIL("mvhd_write_sectors failed");
+    }
+    size = file_size(path);
+    if (mvhd_discard_sectors(vhdm, 8, 16) != 0 || mvhd_discard_sectors(vhdm, TEST_BLOCK, TEST_BLOCK) != 0 ||
+        mvhd_discard_sectors(vhdm, TEST_BLOCK * 2, 16) != 0 || mvhd_flush(vhdm) != 0) {
+        TEST_FAIL("mvhd_discard_sectors failed");
+    }
+    if (file_size(path) >= size) {
+        TEST_FAIL("discarding the last block did not shrink the file");
+    }
+    mvhd_close(vhdm);
+
+    vhdm = mvhd_open(path, false, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    if (expect_sectors(vhdm, 0, 8, data) != 0 || expect_sectors(vhdm, 24, TEST_BLOCK - 24, data + 24 * 512) != 0) {
+        TEST_FAIL("sectors next to discarded ones changed");
+    }
+    if (expect_sectors(vhdm, 8, 16, NULL) != 0 || expect_sectors(vhdm, TEST_BLOCK, TEST_BLOCK + 16, NULL) != 0) {
+        TEST_FAIL("discarded sectors are not zero");
+    }
+
+    /* Discarded sectors can be written again */
+    if (mvhd_write_sectors(vhdm, TEST_BLOCK, 16, data + (size_t)TEST_BLOCK * 512) != 0 ||
+        expect_sectors(vhdm, TEST_BLOCK, 16, data + (size_t)TEST_BLOCK * 512) != 0 ||
+        expect_sectors(vhdm, TEST_BLOCK + 16, 16, NULL) != 0) {
+        TEST_FAIL("writing discarded sectors again failed");
+    }
+    ret = 0;
+
+cleanup:
+    mvhd_close(vhdm);
+    free(data);
+    printf("  discard: %s\n", (ret == 0) ? "ok" : "FAILED");
+
+    return ret;
+}
+
+
+/* Formatting sectors of a dynamic image only updates metadata, so formatting an 
+ * unallocated block must not allocate it */
+static int test_format(const char* path) {
+    MVHDMeta* vhdm = NULL;
+    long size;
+    int err, ret = -1, n = 32;
+    uint8_t* data = malloc((size_t)n * 512);
+
+    if (data == NULL) {
+        TEST_FAIL("out of memory");
+    }
+    fill_sectors(data, 0, n, 9);
+    vhdm = create_dynamic(path, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    if (mvhd_write_sectors(vhdm, 0, n, data) != 0 || mvhd_flush(vhdm) != 0) {
+        TEST_FAIL("mvhd_write_sectors failed");
+    }
+    size = file_size(path);
+    if (mvhd_format_sectors(vhdm, 4, 8) != 0 || mvhd_format_sectors(vhdm, TEST_BLOCK * 7, TEST_BLOCK) != 0 ||
+        mvhd_flush(vhdm) != 0) {
+        TEST_FAIL("mvhd_format_sectors failed");
+    }
+    if (file_size(path) != size) {
+        TEST_FAIL("formatting changed the size of the file");
+    }
+    mvhd_close(vhdm);
+
+    vhdm = mvhd_open(path, true, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    if (expect_sectors(vhdm, 0, 4, data) != 0 || expect_sectors(vhdm, 12, n - 12, data + 12 * 512) != 0) {
+        TEST_FAIL("sectors next to formatted ones changed");
+    }
+    if (expect_sectors(vhdm, 4, 8, NULL) != 0 || expect_sectors(vhdm, TEST_BLOCK * 7, TEST_BLOCK, NULL) != 0) {
+        TEST_FAIL("formatted sectors are not zero");
+    }
+    ret = 0;
+
+cleanup:
+    mvhd_close(vhdm);
+    free(data);
+    printf("  format: %s\n", (ret == 0) ? "ok" : "FAILED");
+
+    return ret;
+}
+
+
+/* Writes that cover whole new blocks, from one buffer and from one buffer per sector */
+static int test_full_block(const char* path) {
+    MVHDIOVec* iov = malloc(TEST_BLOCK * sizeof *iov);
+    MVHDMeta* vhdm = NULL;
+    int i, err, ret = -1;
+    uint8_t* data = malloc((size_t)TEST_BLOCK * 2 * 512);
+
+    if (iov == NULL || data == NULL) {
+        TEST_FAIL("out of memory");
+    }
+    fill_sectors(data, TEST_BLOCK, TEST_BLOCK * 2, 10);
+    for (i = 0; i < TEST_BLOCK; i++) {
+        iov[i].base = data + ((size_t)TEST_BLOCK + i) * 512;
+        iov[i].len = 512;
+    }
+    vhdm = create_dynamic(path, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    if (mvhd_write_sectors(vhdm, TEST_BLOCK, TEST_BLOCK, data) != 0 ||
+        mvhd_writev(vhdm, TEST_BLOCK * 2, iov, TEST_BLOCK) != 0) {
+        TEST_FAIL("writing whole blocks failed");
+    }
+    mvhd_close(vhdm);
+
+    vhdm = mvhd_open(path, true, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    if (expect_sectors(vhdm, TEST_BLOCK, TEST_BLOCK * 2, data) != 0) {
+        TEST_FAIL("whole blocks read back differently");
+    }
+    if (expect_sectors(vhdm, TEST_BLOCK - 1, 1, NULL) != 0 || expect_sectors(vhdm, TEST_BLOCK * 3, 1, NULL) != 0) {
+        TEST_FAIL("sectors next to the blocks are not zero");
+    }
+    ret = 0;
+
+cleanup:
+    mvhd_close(vhdm);
+    free(iov);
+    free(data);
+    printf("  whole block writes: %s\n", (ret == 0) ? "ok" : "FAILED");
+
+    return ret;
+}
+
+
+/* The slot of a released block is reused by the next new block, both in the same 
+ * session and after the image has been reopened */
+static int test_free_slots(const char* path) {
+    MVHDMeta* vhdm = NULL;
+    long size;
+    int i, err, ret = -1;
+    uint8_t* data = malloc(16 * 512);
+
+    if (data == NULL) {
+        TEST_FAIL("out of memory");
+    }
+    vhdm = create_dynamic(path, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    for (i = 0; i < 3; i++) {
+        fill_sectors(data, (uint32_t)(TEST_BLOCK * i), 16, 11);
+        if (mvhd_write_sectors(vhdm, (uint32_t)(TEST_BLOCK * i), 16, data) != 0) {
+            TEST_FAIL("mvhd_write_sectors failed");
+        }
+    }
+    if (mvhd_discard_sectors(vhdm, TEST_BLOCK, 16) != 0 || mvhd_flush(vhdm) != 0) {
+        TEST_FAIL("mvhd_discard_sectors failed");
+    }
+    size = file_size(path);
+    fill_sectors(data, TEST_BLOCK * 9, 16, 11);
+    if (mvhd_write_sectors(vhdm, TEST_BLOCK * 9, 16, data) != 0 || mvhd_flush(vhdm) != 0) {
+        TEST_FAIL("mvhd_write_sectors failed");
+    }
+    if (file_size(path) != size) {
+        TEST_FAIL("a new block did not reuse a free slot");
+    }
+    if (mvhd_discard_sectors(vhdm, TEST_BLOCK * 9, 16) != 0) {
+        TEST_FAIL("mvhd_discard_sectors failed");
+    }
+    mvhd_close(vhdm);
+
+    vhdm = mvhd_open(path, false, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    fill_sectors(data, TEST_BLOCK * 12, 16, 11);
+    if (mvhd_write_sectors(vhdm, TEST_BLOCK * 12, 16, data) != 0 || mvhd_flush(vhdm) != 0) {
+        TEST_FAIL("mvhd_write_sectors failed");
+    }
+    if (file_size(path) != size) {
+        TEST_FAIL("a free slot was not found after reopening");
+    }
+    mvhd_close(vhdm);
+
+    vhdm = mvhd_open(path, true, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    for (i = 0; i < 13; i++) {
+        fill_sectors(data, (uint32_t)(TEST_BLOCK * i), 16, 11);
+        if (expect_sectors(vhdm, (uint32_t)(TEST_BLOCK * i), 16, (i == 0 || i == 2 || i == 12) ? data : NULL) != 0) {
+            TEST_FAIL("block %d read back differently", i);
+        }
+    }
+    ret = 0;
+
+cleanup:
+    mvhd_close(vhdm);
+    free(data);
+    printf("  free slot reuse: %s\n", (ret == 0) ? "ok" : "FAILED");
+
+    return ret;
+}
+
+
+/* Every placement policy has to keep blocks apart and find them again, whatever 
+ * order they are created in */
+static int test_placement(const char* path) {
+    static const int order[] = { 5, 1, 3, 0, 7, 2, 12, 6 };
+    static const char* names[] = { "append", "locality", "chunked" };
+    MVHDOpenOptions opts;
+    MVHDMeta* vhdm = NULL;
+    int i, policy, err, ret = -1, n = 8;
+    uint8_t* data = malloc(TEST_BLOCK * 512);
+
+    if (data == NULL) {
+        TEST_FAIL("out of memory");
+    }
+    for (policy = MVHD_PLACE_APPEND; policy <= MVHD_PLACE_CHUNKED; policy++) {
+        vhdm = create_dynamic(path, &err);
+        if (vhdm == NULL) {
+            TEST_FAIL("%s", mvhd_strerr(err));
+        }
+        mvhd_close(vhdm);
+        memset(&opts, 0, sizeof opts);
+        opts.placement = policy;
+        opts.placement_chunk = 4;
+        vhdm = mvhd_open_ex(path, opts, &err);
+        if (vhdm == NULL) {
+            TEST_FAIL("%s", mvhd_strerr(err));
+        }
+        for (i = 0; i < n; i++) {
+            /* Every other block is written whole */
+            fill_sectors(data, (uint32_t)(TEST_BLOCK * order[i]), TEST_BLOCK, 12);
+            if (mvhd_write_sectors(vhdm, (uint32_t)(TEST_BLOCK * order[i]), (i % 2) ? TEST_BLOCK : 16, data) != 0) {
+                TEST_FAIL("%s: mvhd_write_sectors failed", names[policy]);
+            }
+        }
+        if (mvhd_discard_sectors(vhdm, TEST_BLOCK * 3, TEST_BLOCK) != 0) {
+            TEST_FAIL("%s: mvhd_discard_sectors failed", names[policy]);
+        }
+        fill_sectors(data, TEST_BLOCK * 4, 16, 12);
+        if (mvhd_write_sectors(vhdm, TEST_BLOCK * 4, 16, data) != 0) {
+            TEST_FAIL("%s: mvhd_write_sectors failed", names[policy]);
+        }
+        mvhd_close(vhdm);
+
+        vhdm = mvhd_open(path, true, &err);
+        if (vhdm == NULL) {
+            TEST_FAIL("%s: %s", names[policy], mvhd_strerr(err));
+        }
+        for (i = 0; i < n; i++) {
+            fill_sectors(data, (uint32_t)(TEST_BLOCK * order[i]), TEST_BLOCK, 12);
+            if (order[i] == 3) {
+                if (expect_sectors(vhdm, TEST_BLOCK * 3, TEST_BLOCK, NULL) != 0) {
+                    TEST_FAIL("%s: discarded block is not zero", names[policy]);
+                }
+            } else if (expect_sectors(vhdm, (uint32_t)(TEST_BLOCK * order[i]), (i % 2) ? TEST_BLOCK : 16, data) != 0) {
+                TEST_FAIL("%s: block %d read back differently", names[policy], order[i]);
+            }
+        }
+        fill_sectors(data, TEST_BLOCK * 4, 16, 12);
+        if (expect_sectors(vhdm, TEST_BLOCK * 4, 16, data) != 0) {
+            TEST_FAIL("%s: block 4 read back differently", names[policy]);
+        }
+        mvhd_close(vhdm);
+        vhdm = NULL;
+    }
+    ret = 0;
+
+cleanup:
+    mvhd_close(vhdm);
+    free(data);
+    printf("  placement policies: %s\n", (ret == 0) ? "ok" : "FAILED");
+
+    return ret;
+}
+
+
+/* Tail preallocation: the space is given back by a flush. An image that was not closed 
+ * is recovered if only preallocated space follows its data, and left alone otherwise */
+static int test_prealloc_tail(const char* path, const char* copy_path) {
+    MVHDOpenOptions opts;
+    MVHDMeta* vhdm = NULL;
+    FILE* f;
+    uint8_t footer[512];
+    long size;
+    int i, err, ret = -1;
+    uint8_t* data = malloc(3 * 16 * 512);
+
+    if (data == NULL) {
+        TEST_FAIL("out of memory");
+    }
+    vhdm = create_dynamic(path, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    mvhd_close(vhdm);
+    memset(&opts, 0, sizeof opts);
+    opts.prealloc_blocks = 8;
+    opts.strict = 1;
+    vhdm = mvhd_open_ex(path, opts, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    for (i = 0; i < 3; i++) {
+        fill_sectors(data + (size_t)i * 16 * 512, (uint32_t)(TEST_BLOCK * i), 16, 13);
+        if (mvhd_write_sectors(vhdm, (uint32_t)(TEST_BLOCK * i), 16, data + (size_t)i * 16 * 512) != 0) {
+            TEST_FAIL("mvhd_write_sectors failed");
+        }
+    }
+    size = file_size(path);
+
+    /* What a crash in strict mode would leave behind: the data, then preallocated space. 
+       The footer at its end is replaced by zeros here, as if the file had been extended 
+       further */
+    if (copy_file(path, copy_path, 0, 0) != 0) {
+        TEST_FAIL("copying the image failed");
+    }
+    if (mvhd_flush(vhdm) != 0 || file_size(path) >= size) {
+        TEST_FAIL("flushing did not give back the preallocated space");
+    }
+    mvhd_close(vhdm);
+    vhdm = NULL;
+
+    memset(footer, 0, sizeof footer);
+    f = fopen(copy_path, "r+b");
+    if (f == NULL) {
+        TEST_FAIL("opening the copy failed");
+    }
+    if (fseek(f, size - 512, SEEK_SET) != 0 || fwrite(footer, 1, sizeof footer, f) != sizeof footer) {
+        fclose(f);
+        TEST_FAIL("removing the footer of the copy failed");
+    }
+    fclose(f);
+    vhdm = mvhd_open(copy_path, false, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("preallocated image without a footer: %s", mvhd_strerr(err));
+    }
+    for (i = 0; i < 3; i++) {
+        if (expect_sectors(vhdm, (uint32_t)(TEST_BLOCK * i), 16, data + (size_t)i * 16 * 512) != 0) {
+            TEST_FAIL("recovered image lost block %d", i);
+        }
+    }
+    mvhd_close(vhdm);
+    vhdm = NULL;
+    if (file_size(copy_path) >= size) {
+        TEST_FAIL("recovering the image did not give back the preallocated space");
+    }
+
+    /* Anything other than preallocated space past the data must not be thrown away */
+    if (copy_file(path, copy_path, 4096, 0x5a) != 0) {
+        TEST_FAIL("copying the image failed");
+    }
+    size = file_size(copy_path);
+    vhdm = mvhd_open(copy_path, false, &err);
+    if (vhdm != NULL || err != MVHD_ERR_FOOTER_MISSING || file_size(copy_path) != size) {
+        TEST_FAIL("image followed by unknown data was opened for writing");
+    }
+    vhdm = mvhd_open(copy_path, true, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("image followed by unknown data can't be opened read only: %s", mvhd_strerr(err));
+    }
+    for (i = 0; i < 3; i++) {
+        if (expect_sectors(vhdm, (uint32_t)(TEST_BLOCK * i), 16, data + (size_t)i * 16 * 512) != 0) {
+            TEST_FAIL("read only image lost block %d", i);
+        }
+    }
+    ret = 0;
+
+cleanup:
+    mvhd_close(vhdm);
+    free(data);
+    printf("  tail preallocation and recovery: %s\n", (ret == 0) ? "ok" : "FAILED");
+
+    return ret;
+}
+
+
+/* Preallocated blocks read as zero, take later writes without growing the file, and 
+ * are released again by a discard while still unused */
+static int test_preallocate(const char* path) {
+    MVHDMeta* vhdm = NULL;
+    long size;
+    int err, ret = -1;
+    uint8_t* data = malloc(16 * 512);
+
+    if (data == NULL) {
+        TEST_FAIL("out of memory");
+    }
+    fill_sectors(data, TEST_BLOCK * 3, 16, 14);
+    vhdm = create_dynamic(path, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    size = file_size(path);
+    if (mvhd_preallocate(vhdm, TEST_BLOCK * 2 + 100, TEST_BLOCK * 2) != 0 || mvhd_flush(vhdm) != 0) {
+        TEST_FAIL("mvhd_preallocate failed");
+    }
+    if (file_size(path) < size + 3L * TEST_BLOCK * 512) {
+        TEST_FAIL("three blocks were not allocated");
+    }
+    size = file_size(path);
+    if (mvhd_write_sectors(vhdm, TEST_BLOCK * 3, 16, data) != 0 || mvhd_flush(vhdm) != 0) {
+        TEST_FAIL("mvhd_write_sectors failed");
+    }
+    if (file_size(path) != size) {
+        TEST_FAIL("writing to a preallocated block grew the file");
+    }
+    mvhd_close(vhdm);
+
+    vhdm = mvhd_open(path, false, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    if (expect_sectors(vhdm, TEST_BLOCK * 2, TEST_BLOCK, NULL) != 0 ||
+        expect_sectors(vhdm, TEST_BLOCK * 3 + 16, TEST_BLOCK * 2 - 16, NULL) != 0) {
+        TEST_FAIL("preallocated sectors are not zero");
+    }
+    if (expect_sectors(vhdm, TEST_BLOCK * 3, 16, data) != 0) {
+        TEST_FAIL("sectors written to a preallocated block read back differently");
+    }
+    if (mvhd_discard_sectors(vhdm, TEST_BLOCK * 4, TEST_BLOCK) != 0 || mvhd_flush(vhdm) != 0) {
+        TEST_FAIL("mvhd_discard_sectors failed");
+    }
+    if (file_size(path) >= size) {
+        TEST_FAIL("discarding an unused preallocated block did not release it");
+    }
+    ret = 0;
+
+cleanup:
+    mvhd_close(vhdm);
+    free(data);
+    printf("  preallocate: %s\n", (ret == 0) ? "ok" : "FAILED");
+
+    return ret;
+}
+
+
+/* Check what another handle sees of blocks written with a stride through the image */
+static int expect_stride(const char* path, int num_blocks, int stride, int seed, uint8_t* data) {
+    MVHDMeta* vhdm;
+    int blk, err, ret = 0;
+
+    vhdm = mvhd_open(path, true, &err);
+    if (vhdm == NULL) {
+        return -1;
+    }
+    for (blk = 0; blk < num_blocks && ret == 0; blk++) {
+        fill_sectors(data, (uint32_t)(TEST_BLOCK * blk), 8, seed);
+        ret = expect_sectors(vhdm, (uint32_t)(TEST_BLOCK * blk), 8, (blk % stride == 0) ? data : NULL);
+    }
+    mvhd_close(vhdm);
+
+    return ret;
+}
+
+
+/* By default, BAT entries spread over several BAT sectors are only written by a flush 
+ * or close. In strict mode, every write reaches the file right away */
+static int test_bat_write_back(const char* path) {
+    MVHDCreationOptions create_opts;
+    MVHDOpenOptions opts;
+    MVHDMeta* vhdm = NULL;
+    int blk, pass, err, ret = -1, num_blocks = 512;
+    uint8_t* data = malloc(8 * 512);
+
+    if (data == NULL) {
+        TEST_FAIL("out of memory");
+    }
+    for (pass = 0; pass < 2; pass++) {
+        remove(path);
+        memset(&create_opts, 0, sizeof create_opts);
+        create_opts.type = MVHD_TYPE_DYNAMIC;
+        create_opts.path = (char*)path;
+        create_opts.size_in_bytes = (uint64_t)num_blocks * TEST_BLOCK * 512;
+        vhdm = mvhd_create_ex(create_opts, &err);
+        if (vhdm == NULL) {
+            TEST_FAIL("%s", mvhd_strerr(err));
+        }
+        mvhd_close(vhdm);
+        memset(&opts, 0, sizeof opts);
+        opts.strict = !pass;
+        vhdm = mvhd_open_ex(path, opts, &err);
+        if (vhdm == NULL) {
+            TEST_FAIL("%s", mvhd_strerr(err));
+        }
+
+        /* From the last block to the first, so neighbouring BAT entries change out of order */
+        for (blk = num_blocks - 1; blk >= 0; blk--) {
+            if (blk % 3 == 0) {
+                fill_sectors(data, (uint32_t)(TEST_BLOCK * blk), 8, 15 + pass);
+                if (mvhd_write_sectors(vhdm, (uint32_t)(TEST_BLOCK * blk), 8, data) != 0) {
+                    TEST_FAIL("mvhd_write_sectors failed");
+                }
+            }
+        }
+        if (pass == 0 && expect_stride(path, num_blocks, 3, 15, data) != 0) {
+            TEST_FAIL("writes were not written through");
+        }
+        if (pass == 1 && (mvhd_flush(vhdm) != 0 || expect_stride(path, num_blocks, 3, 16, data) != 0)) {
+            TEST_FAIL("flushed writes are not in the file");
+        }
+
+        for (blk = 1; blk < num_blocks; blk += 3) {
+            fill_sectors(data, (uint32_t)(TEST_BLOCK * blk), 8, 17);
+            if (mvhd_write_sectors(vhdm, (uint32_t)(TEST_BLOCK * blk), 8, data) != 0) {
+                TEST_FAIL("mvhd_write_sectors failed");
+            }
+        }
+        mvhd_close(vhdm);
+
+        vhdm = mvhd_open(path, true, &err);
+        if (vhdm == NULL) {
+            TEST_FAIL("%s", mvhd_strerr(err));
+        }
+        for (blk = 0; blk < num_blocks; blk++) {
+            fill_sectors(data, (uint32_t)(TEST_BLOCK * blk), 8, (blk % 3 == 0) ? 15 + pass : 17);
+            if (expect_sectors(vhdm, (uint32_t)(TEST_BLOCK * blk), 8, (blk % 3 == 2) ? NULL : data) != 0) {
+                TEST_FAIL("block %d read back differently after closing", blk);
+            }
+        }
+        mvhd_close(vhdm);
+        vhdm = NULL;
+    }
+    ret = 0;
+
+cleanup:
+    mvhd_close(vhdm);
+    free(data);
+    printf("  BAT write back: %s\n", (ret == 0) ? "ok" : "FAILED");
+
+    return ret;
+}
+
+
+/* Two children of one parent, open at the same time. Each sees the parent's data under 
+ * its own, closing one leaves the other working, and a child opened with other options 
+ * works alongside them */
+static int test_shared_parent(const char* base_path, const char* kid1_path, const char* kid2_path) {
+    MVHDOpenOptions opts;
+    MVHDMeta* vhdm;
+    MVHDMeta* kid1 = NULL;
+    MVHDMeta* kid2 = NULL;
+    int err, ret = -1, n = 16;
+    uint8_t* base = malloc((size_t)n * 512);
+    uint8_t* view1 = malloc((size_t)n * 512);
+    uint8_t* view2 = malloc((size_t)n * 512);
+
+    if (base == NULL || view1 == NULL || view2 == NULL) {
+        TEST_FAIL("out of memory");
+    }
+    fill_sectors(base, 0, n, 20);
+    vhdm = create_dynamic(base_path, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    err = mvhd_write_sectors(vhdm, 0, n, base);
+    mvhd_close(vhdm);
+    if (err != 0) {
+        TEST_FAIL("mvhd_write_sectors failed");
+    }
+    if (create_child(kid1_path, base_path) != 0 || create_child(kid2_path, base_path) != 0) {
+        goto cleanup;
+    }
+
+    kid1 = mvhd_open(kid1_path, false, &err);
+    kid2 = mvhd_open(kid2_path, false, &err);
+    if (kid1 == NULL || kid2 == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    memcpy(view1, base, (size_t)n * 512);
+    memcpy(view2, base, (size_t)n * 512);
+    fill_sectors(view1, 0, 8, 21);
+    fill_sectors(view2 + 4 * 512, 4, 8, 22);
+    if (mvhd_write_sectors(kid1, 0, 8, view1) != 0 || mvhd_write_sectors(kid2, 4, 8, view2 + 4 * 512) != 0) {
+        TEST_FAIL("mvhd_write_sectors failed");
+    }
+    if (expect_sectors(kid1, 0, n, view1) != 0 || expect_sectors(kid2, 0, n, view2) != 0) {
+        TEST_FAIL("children of a shared parent read back differently");
+    }
+    mvhd_close(kid1);
+    kid1 = NULL;
+    if (expect_sectors(kid2, 0, n, view2) != 0) {
+        TEST_FAIL("closing one child broke the other");
+    }
+
+    memset(&opts, 0, sizeof opts);
+    opts.use_mmap = 1;
+    opts.bitmap_cache_size = 4096;
+    kid1 = mvhd_open_ex(kid1_path, opts, &err);
+    if (kid1 == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    if (expect_sectors(kid1, 0, n, view1) != 0 || expect_sectors(kid2, 0, n, view2) != 0) {
+        TEST_FAIL("children opened with different options read back differently");
+    }
+    mvhd_close(kid2);
+    kid2 = NULL;
+    if (expect_sectors(kid1, 0, n, view1) != 0) {
+        TEST_FAIL("closing one child broke the other");
+    }
+    ret = 0;
+
+cleanup:
+    mvhd_close(kid1);
+    mvhd_close(kid2);
+    free(base);
+    free(view1);
+    free(view2);
+    printf("  shared parent: %s\n", (ret == 0) ? "ok" : "FAILED");
+
+    return ret;
+}
+
+
+/* Reads of a three image chain, where blocks are owned by different layers, and where 
+ * a write to the top layer and a discard of it change which layer owns a block */
+static int test_chain_owner(const char* base_path, const char* mid_path, const char* top_path) {
+    MVHDMeta* vhdm = NULL;
+    int err, ret = -1, n = 32;
+    uint8_t* view = calloc((size_t)n * 3, 512);
+    uint8_t* blk1 = view + (size_t)n * 512;
+    uint8_t* blk2 = view + (size_t)n * 2 * 512;
+    uint8_t* top = malloc(8 * 512);
+
+    if (view == NULL || top == NULL) {
+        TEST_FAIL("out of memory");
+    }
+    /* Block 0: sectors 0-15 in the base, 8-23 in the middle. Block 1 in the base only, 
+       block 2 in the middle only */
+    fill_sectors(view, 0, 16, 30);
+    fill_sectors(blk1, TEST_BLOCK, 8, 30);
+    vhdm = create_dynamic(base_path, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    err = mvhd_write_sectors(vhdm, 0, 16, view);
+    err |= write_and_close(vhdm, TEST_BLOCK, 8, blk1);
+    vhdm = NULL;
+    if (err != 0) {
+        TEST_FAIL("writing the base failed");
+    }
+    fill_sectors(view + 8 * 512, 8, 16, 31);
+    fill_sectors(blk2, TEST_BLOCK * 2, 8, 31);
+    if (create_child(mid_path, base_path) != 0 || create_child(top_path, mid_path) != 0) {
+        goto cleanup;
+    }
+    vhdm = mvhd_open(mid_path, false, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    err = mvhd_write_sectors(vhdm, 8, 16, view + 8 * 512);
+    err |= write_and_close(vhdm, TEST_BLOCK * 2, 8, blk2);
+    vhdm = NULL;
+    if (err != 0) {
+        TEST_FAIL("writing the middle layer failed");
+    }
+
+    vhdm = mvhd_open(top_path, false, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    if (expect_sectors(vhdm, 0, n, view) != 0 || expect_sectors(vhdm, TEST_BLOCK, n, blk1) != 0 ||
+        expect_sectors(vhdm, TEST_BLOCK * 2, n, blk2) != 0) {
+        TEST_FAIL("layers were not combined correctly");
+    }
+
+    /* Block 1 moves to the top layer, and back to the base */
+    fill_sectors(top, TEST_BLOCK + 4, 8, 32);
+    if (mvhd_write_sectors(vhdm, TEST_BLOCK + 4, 8, top) != 0) {
+        TEST_FAIL("mvhd_write_sectors failed");
+    }
+    if (expect_sectors(vhdm, TEST_BLOCK, 4, blk1) != 0 || expect_sectors(vhdm, TEST_BLOCK + 4, 8, top) != 0 ||
+        expect_sectors(vhdm, TEST_BLOCK + 12, n - 12, blk1 + 12 * 512) != 0) {
+        TEST_FAIL("a write to the top layer was not combined with the base");
+    }
+    if (mvhd_discard_sectors(vhdm, TEST_BLOCK, TEST_BLOCK) != 0) {
+        TEST_FAIL("mvhd_discard_sectors failed");
+    }
+    if (expect_sectors(vhdm, TEST_BLOCK, n, blk1) != 0) {
+        TEST_FAIL("discarded sectors of the top layer don't read as the base again");
+    }
+    if (mvhd_write_sectors(vhdm, TEST_BLOCK + 4, 8, top) != 0) {
+        TEST_FAIL("mvhd_write_sectors failed");
+    }
+    mvhd_close(vhdm);
+
+    vhdm = mvhd_open(top_path, true, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    memcpy(blk1 + 4 * 512, top, 8 * 512);
+    if (expect_sectors(vhdm, 0, n, view) != 0 || expect_sectors(vhdm, TEST_BLOCK, n, blk1) != 0 ||
+        expect_sectors(vhdm, TEST_BLOCK * 2, n, blk2) != 0) {
+        TEST_FAIL("the chain read back differently after reopening");
+    }
+    ret = 0;
+
+cleanup:
+    mvhd_close(vhdm);
+    free(view);
+    free(top);
+    printf("  chain block owners: %s\n", (ret == 0) ? "ok" : "FAILED");
+
+    return ret;
+}
+
+
+/* A chain deeper than the number of BATs loaded in parallel. Each layer owns a block of 
+ * its own, and overwrites the first sector of the layers below */
+static int test_deep_chain(const char* vhd_sparse_path) {
+    char paths[12][1024];
+    MVHDMeta* vhdm = NULL;
+    MVHDMeta* again = NULL;
+    int i, err, ret = -1, depth = 12;
+    uint8_t* data = malloc(8 * 512);
+
+    for (i = 0; i < depth; i++) {
+        snprintf(paths[i], sizeof paths[i], "%s.chain%d.vhd", vhd_sparse_path, i);
+    }
+    if (data == NULL) {
+        TEST_FAIL("out of memory");
+    }
+    for (i = 0; i < depth; i++) {
+        if (i == 0) {
+            vhdm = create_dynamic(paths[i], &err);
+        } else if (create_child(paths[i], paths[i - 1]) == 0) {
+            vhdm = mvhd_open(paths[i], false, &err);
+        }
+        if (vhdm == NULL) {
+            TEST_FAIL("creating layer %d failed", i);
+        }
+        fill_sectors(data, (uint32_t)(TEST_BLOCK * i), 8, 40 + i);
+        err = mvhd_write_sectors(vhdm, (uint32_t)(TEST_BLOCK * i), 8, data);
+        if (i > 0) {
+            err |= mvhd_write_sectors(vhdm, 0, 1, data);
+        }
+        mvhd_close(vhdm);
+        vhdm = NULL;
+        if (err != 0) {
+            TEST_FAIL("writing layer %d failed", i);
+        }
+    }
+
+    vhdm = mvhd_open(paths[depth - 1], false, &err);
+    again = mvhd_open(paths[depth - 1], true, &err);
+    if (vhdm == NULL || again == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    for (i = 0; i < depth; i++) {
+        fill_sectors(data, (uint32_t)(TEST_BLOCK * i), 8, 40 + i);
+        if (expect_sectors(vhdm, (uint32_t)(TEST_BLOCK * i) + 1, 7, data + 512) != 0 ||
+            expect_sectors(again, (uint32_t)(TEST_BLOCK * i) + 1, 7, data + 512) != 0) {
+            TEST_FAIL("the block of layer %d read back differently", i);
+        }
+    }
+    fill_sectors(data, TEST_BLOCK * (depth - 1), 1, 40 + depth - 1);
+    if (expect_sectors(vhdm, 0, 1, data) != 0 || expect_sectors(vhdm, TEST_BLOCK * depth, 8, NULL) != 0) {
+        TEST_FAIL("the top layer does not hide the layers below");
+    }
+    ret = 0;
+
+cleanup:
+    mvhd_close(vhdm);
+    mvhd_close(again);
+    for (i = 0; i < depth; i++) {
+        remove(paths[i]);
+    }
+    free(data);
+    printf("  deep chain: %s\n", (ret == 0) ? "ok" : "FAILED");
+
+    return ret;
+}
+
+
+/* A parent path that was found before is remembered, but only used while it still 
+ * leads to the parent */
+static int test_parent_path_cache(const char* base_path, const char* kid_path, const char* moved_path) {
+    MVHDMeta* vhdm = NULL;
+    int i, err, ret = -1;
+    uint8_t* data = malloc(8 * 512);
+
+    if (data == NULL) {
+        TEST_FAIL("out of memory");
+    }
+    fill_sectors(data, 0, 8, 50);
+    vhdm = create_dynamic(base_path, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    err = write_and_close(vhdm, 0, 8, data);
+    vhdm = NULL;
+    if (err != 0 || create_child(kid_path, base_path) != 0) {
+        TEST_FAIL("creating the chain failed");
+    }
+
+    for (i = 0; i < 2; i++) {
+        vhdm = mvhd_open(kid_path, true, &err);
+        if (vhdm == NULL) {
+            TEST_FAIL("%s", mvhd_strerr(err));
+        }
+        if (expect_sectors(vhdm, 0, 8, data) != 0) {
+            TEST_FAIL("the parent's data read back differently");
+        }
+        mvhd_close(vhdm);
+        vhdm = NULL;
+    }
+
+    remove(moved_path);
+    if (rename(base_path, moved_path) != 0) {
+        TEST_FAIL("moving the parent failed");
+    }
+    vhdm = mvhd_open(kid_path, true, &err);
+    rename(moved_path, base_path);
+    if (vhdm != NULL || err != MVHD_ERR_PAR_NOT_FOUND) {
+        TEST_FAIL("a parent that was moved away was still found");
+    }
+    vhdm = mvhd_open(kid_path, true, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("the parent was not found again after moving it back: %s", mvhd_strerr(err));
+    }
+    if (expect_sectors(vhdm, 0, 8, data) != 0) {
+        TEST_FAIL("the parent's data read back differently");
+    }
+    ret = 0;
+
+cleanup:
+    mvhd_close(vhdm);
+    free(data);
+    printf("  parent path cache: %s\n", (ret == 0) ? "ok" : "FAILED");
+
+    return ret;
+}
+
+
+/* A flattened chain reads the same as the chain, both as returned and after reopening */
+static int test_flatten(const char* base_path, const char* kid_path, const char* out_path) {
+    MVHDMeta* vhdm = NULL;
+    int i, err, ret = -1, n = 32;
+    uint8_t* view = calloc((size_t)n * 3, 512);
+    uint8_t* blk2 = view + (size_t)n * 512;
+    uint8_t* blk3 = view + (size_t)n * 2 * 512;
+
+    if (view == NULL) {
+        TEST_FAIL("out of memory");
+    }
+    /* Block 0: sectors 0-15 in the base, 8-23 in the child. Block 2 in the base only, 
+       block 3 in the child only */
+    fill_sectors(view, 0, 16, 60);
+    fill_sectors(blk2, TEST_BLOCK * 2, 8, 60);
+    vhdm = create_dynamic(base_path, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    err = mvhd_write_sectors(vhdm, 0, 16, view);
+    err |= write_and_close(vhdm, TEST_BLOCK * 2, 8, blk2);
+    vhdm = NULL;
+    if (err != 0 || create_child(kid_path, base_path) != 0) {
+        TEST_FAIL("creating the chain failed");
+    }
+    fill_sectors(view + 8 * 512, 8, 16, 61);
+    fill_sectors(blk3, TEST_BLOCK * 3, 8, 61);
+    vhdm = mvhd_open(kid_path, false, &err);
+    if (vhdm == NULL) {
+        TEST_FAIL("%s", mvhd_strerr(err));
+    }
+    err = mvhd_write_sectors(vhdm, 8, 16, view + 8 * 512);
+    err |= write_and_close(vhdm, TEST_BLOCK * 3, 8, blk3);
+    vhdm = NULL;
+    if (err != 0) {
+        TEST_FAIL("writing the child failed");
+    }
+
+    remove(out_path);
+    vhdm = mvhd_flatten(kid_path, out_path, &err);
+    for (i = 0; i < 2; i++) {
+        if (vhdm == NULL) {
+            TEST_FAIL("%s", mvhd_strerr(err));
+        }
+        if (mvhd_get_type(vhdm) != MVHD_TYPE_DYNAMIC) {
+            TEST_FAIL("the flattened image is not a dynamic image");
+        }
+        if (expect_sectors(vhdm, 0, n, view) != 0 || expect_sectors(vhdm, TEST_BLOCK, n, NULL) != 0 ||
+            expect_sectors(vhdm, TEST_BLOCK * 2, n, blk2) != 0 || expect_sectors(vhdm, TEST_BLOCK * 3, n, blk3) != 0) {
+            TEST_FAIL("the flattened image reads differently from the chain%s", (i > 0) ? " after reopening" : "");
+        }
+        if (i == 0) {
+            mvhd_close(vhdm);
+            vhdm = mvhd_open(out_path, true, &err);
+        }
+    }
+    ret = 0;
+
+cleanup:
+    mvhd_close(vhdm);
+    free(view);
+    remove(out_path);
+    printf("  flatten: %s\n", (ret == 0) ? "ok" : "FAILED");
+
+    return ret;
+}
+
+
+static int run_tests(const char* vhd_sparse_path) {
+    char path[1024], path2[1024], path3[1024];
+    int failed = 0;
+
+    snprintf(path, sizeof path, "%s.test.vhd", vhd_sparse_path);
+    snprintf(path2, sizeof path2, "%s.test2.vhd", vhd_sparse_path);
+    snprintf(path3, sizeof path3, "%s.test3.vhd", vhd_sparse_path);
+    failed |= test_sparse_runs(path);
+    failed |= test_bitmap_write_back(path, path2);
+    failed |= test_map_sectors(path, is_absolute(vhd_sparse_path) ? path2 : NULL);
+    failed |= test_readv_writev(path);
+    failed |= test_batch(path);
+    failed |= test_async(path);
+    failed |= test_zero_detect(path);
+    failed |= test_discard(path);
+    failed |= test_format(path);
+    failed |= test_full_block(path);
+    failed |= test_free_slots(path);
+    failed |= test_placement(path);
+    failed |= test_prealloc_tail(path, path2);
+    failed |= test_preallocate(path);
+    failed |= test_bat_write_back(path);
+    if (is_absolute(vhd_sparse_path)) {
+        failed |= test_chain_runs(path, path2);
+        failed |= test_shared_parent(path, path2, path3);
+        failed |= test_chain_owner(path, path2, path3);
+        failed |= test_deep_chain(vhd_sparse_path);
+        failed |= test_parent_path_cache(path, path2, path3);
+        failed |= test_flatten(path, path2, path3);
+    } else {
+        printf("  differencing image tests skipped, VHD_SPARSE is not an absolute path\n");
+    }
+    remove(path);
+    remove(path2);
+    remove(path3);
+
+    return failed;
+}
+
+
+/* Open benchmark. Opening a large sparse VHD is dominated by loading its BAT */
+static int bench_open(const char* vhd_sparse_path) {
+    char bench_path[1024];
+    MVHDCreationOptions bench_opts;
+    MVHDMeta *vhdm;
+    clock_t cstart;
+    int err, i, bench_opens = 10;
+
+    snprintf(bench_path, sizeof bench_path, "%s.bench.vhd", vhd_sparse_path);
+    memset(&bench_opts, 0, sizeof bench_opts);
+    bench_opts.type = MVHD_TYPE_DYNAMIC;
+    bench_opts.path = bench_path;
+    bench_opts.size_in_bytes = 2040ULL * 1024 * 1024 * 1024;
+    bench_opts.block_size_in_sectors = MVHD_BLOCK_SMALL;
+    printf("Creating 2040 GB sparse VHD with 512 KB blocks\n");
+    vhdm = mvhd_create_ex(bench_opts, &err);
+    if (vhdm == NULL) {
+        printf("%s\n", mvhd_strerr(err));
+        remove(bench_path);
+        return -1;
+    }
+    mvhd_close(vhdm);
+
+    printf("Opening 2040 GB sparse VHD %d times\n", bench_opens);
+    cstart = clock();
+    for (i = 0; i < bench_opens; i++) {
+        vhdm = mvhd_open(bench_path, true, &err);
+        if (vhdm == NULL) {
+            printf("%s\n", mvhd_strerr(err));
+            remove(bench_path);
+            return -1;
+        }
+        mvhd_close(vhdm);
+    }
+    printf("Sparse VHD opened in %f ms on average\n",
+           ((double)(clock() - cstart) * 1000.0 / CLOCKS_PER_SEC) / bench_opens);
+    remove(bench_path);
+
+    return 0;
+}
+
+
 int main(int argc, char* argv[]) {
-    if (argc != 6) {
+    if (argc != 6 && (argc != 7 || strcmp(argv[6], "--bench") != 0)) {
         char *help_text = 
             "Incorrect num arguments. Expected args as follows:\n"
-            "minivhd_test RAW_SRC, VHD_FIXED, VHD_SPARSE, RAW_DEST_FIXED, RAW_DEST_SPARSE\n";
+            "minivhd_test RAW_SRC, VHD_FIXED, VHD_SPARSE, RAW_DEST_FIXED, RAW_DEST_SPARSE [--bench]\n";
         printf("%s\n", help_text);
         return 1;
     }
@@ -107,5 +1897,15 @@ int main(int argc, char* argv[]) {
     fclose(raw);
     end = time(0);
     printf("Sparse VHD converted to raw image in %f seconds\n", difftime(end, start));
+
+    printf("Running behavioural tests\n");
+    if (run_tests(vhd_sparse_path) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    if (argc == 7 && bench_open(vhd_sparse_path) != 0) {
+        return EXIT_FAILURE;
+    }
+
     return EXIT_SUCCESS;
 }
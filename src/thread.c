@@ -0,0 +1,300 @@
+/*
+ * MiniVHD	Minimalist VHD implementation in C.
+ *
+ *		This file is part of the MiniVHD Project.
+ *
+ *		Thread, mutex and condition variable wrappers.
+ *
+ * Version:	@(#)thread.c	1.0.0	2021/04/16
+ *
+ * Author:	Sherman Perry, <shermperry@gmail.com>
+ *
+ *		Copyright 2019-2021 Sherman Perry.
+ *
+ *		MIT License
+ *
+ *		Permission is hereby granted, free of  charge, to any person
+ *		obtaining a copy of this software  and associated documenta-
+ *		tion files (the "Software"), to deal in the Software without
+ *		restriction, including without limitation the rights to use,
+ *		copy, modify, merge, publish, distribute, sublicense, and/or
+ *		sell copies of  the Software, and  to permit persons to whom
+ *		the Software is furnished to do so, subject to the following
+ *		conditions:
+ *
+ *		The above  copyright notice and this permission notice shall
+ *		be included in  all copies or  substantial  portions of  the
+ *		Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING  BUT NOT LIMITED TO THE  WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A  PARTICULAR PURPOSE AND NONINFRINGEMENT. IN  NO EVENT  SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER  IN AN ACTION OF  CONTRACT, TORT OR  OTHERWISE, ARISING
+ * FROM, OUT OF  O R IN  CONNECTION WITH THE  SOFTWARE OR  THE USE  OR  OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#ifdef _WIN32
+# include <windows.h>
+# include <process.h>
+#else
+# include <pthread.h>
+#endif
+#include "minivhd.h"
+#include "internal.h"
+
+
+#ifdef _WIN32
+struct MVHDMutex {
+    CRITICAL_SECTION	cs;
+};
+
+struct MVHDCond {
+    CONDITION_VARIABLE	cv;
+};
+
+struct MVHDThread {
+    HANDLE		handle;
+    void		(*func)(void*);
+    void*		arg;
+};
+#else
+struct MVHDMutex {
+    pthread_mutex_t	mutex;
+};
+
+struct MVHDCond {
+    pthread_cond_t	cond;
+};
+
+struct MVHDThread {
+    pthread_t		thread;
+    void		(*func)(void*);
+    void*		arg;
+};
+#endif
+
+
+#ifdef _WIN32
+static MVHDMutex global_mutex;
+static INIT_ONCE global_once = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK
+init_global_mutex(PINIT_ONCE once, PVOID param, PVOID* context)
+{
+    (void)once;
+    (void)param;
+    (void)context;
+    InitializeCriticalSection(&global_mutex.cs);
+
+    return TRUE;
+}
+#else
+static MVHDMutex global_mutex = { PTHREAD_MUTEX_INITIALIZER };
+#endif
+
+
+MVHDMutex*
+mvhd_mutex_global(void)
+{
+#ifdef _WIN32
+    InitOnceExecuteOnce(&global_once, init_global_mutex, NULL, NULL);
+#endif
+
+    return &global_mutex;
+}
+
+
+MVHDMutex*
+mvhd_mutex_create(void)
+{
+    MVHDMutex* m = calloc(1, sizeof *m);
+
+    if (m == NULL) {
+        return NULL;
+    }
+#ifdef _WIN32
+    InitializeCriticalSection(&m->cs);
+#else
+    if (pthread_mutex_init(&m->mutex, NULL) != 0) {
+        free(m);
+        return NULL;
+    }
+#endif
+
+    return m;
+}
+
+
+void
+mvhd_mutex_destroy(MVHDMutex* m)
+{
+    if (m == NULL) {
+        return;
+    }
+#ifdef _WIN32
+    DeleteCriticalSection(&m->cs);
+#else
+    pthread_mutex_destroy(&m->mutex);
+#endif
+    free(m);
+}
+
+
+void
+mvhd_mutex_lock(MVHDMutex* m)
+{
+#ifdef _WIN32
+    EnterCriticalSection(&m->cs);
+#else
+    pthread_mutex_lock(&m->mutex);
+#endif
+}
+
+
+void
+mvhd_mutex_unlock(MVHDMutex* m)
+{
+#ifdef _WIN32
+    LeaveCriticalSection(&m->cs);
+#else
+    pthread_mutex_unlock(&m->mutex);
+#endif
+}
+
+
+MVHDCond*
+mvhd_cond_create(void)
+{
+    MVHDCond* c = calloc(1, sizeof *c);
+
+    if (c == NULL) {
+        return NULL;
+    }
+#ifdef _WIN32
+    InitializeConditionVariable(&c->cv);
+#else
+    if (pthread_cond_init(&c->cond, NULL) != 0) {
+        free(c);
+        return NULL;
+    }
+#endif
+
+    return c;
+}
+
+
+void
+mvhd_cond_destroy(MVHDCond* c)
+{
+    if (c == NULL) {
+        return;
+    }
+#ifndef _WIN32
+    pthread_cond_destroy(&c->cond);
+#endif
+    free(c);
+}
+
+
+void
+mvhd_cond_wait(MVHDCond* c, MVHDMutex* m)
+{
+#ifdef _WIN32
+    SleepConditionVariableCS(&c->cv, &m->cs, INFINITE);
+#else
+    pthread_cond_wait(&c->cond, &m->mutex);
+#endif
+}
+
+
+void
+mvhd_cond_signal(MVHDCond* c)
+{
+#ifdef _WIN32
+    WakeConditionVariable(&c->cv);
+#else
+    pthread_cond_signal(&c->cond);
+#endif
+}
+
+
+void
+mvhd_cond_broadcast(MVHDCond* c)
+{
+#ifdef _WIN32
+    WakeAllConditionVariable(&c->cv);
+#else
+    pthread_cond_broadcast(&c->cond);
+#endif
+}
+
+
+#ifdef _WIN32
+static unsigned __stdcall
+thread_start(void* arg)
+{
+    MVHDThread* t = (MVHDThread*)arg;
+
+    t->func(t->arg);
+
+    return 0;
+}
+#else
+static void*
+thread_start(void* arg)
+{
+    MVHDThread* t = (MVHDThread*)arg;
+
+    t->func(t->arg);
+
+    return NULL;
+}
+#endif
+
+
+MVHDThread*
+mvhd_thread_create(void (*func)(void*), void* arg)
+{
+    MVHDThread* t = calloc(1, sizeof *t);
+
+    if (t == NULL) {
+        return NULL;
+    }
+    t->func = func;
+    t->arg = arg;
+#ifdef _WIN32
+    t->handle = (HANDLE)_beginthreadex(NULL, 0, thread_start, t, 0, NULL);
+    if (t->handle == NULL) {
+        free(t);
+        return NULL;
+    }
+#else
+    if (pthread_create(&t->thread, NULL, thread_start, t) != 0) {
+        free(t);
+        return NULL;
+    }
+#endif
+
+    return t;
+}
+
+
+void
+mvhd_thread_join(MVHDThread* t)
+{
+    if (t == NULL) {
+        return;
+    }
+#ifdef _WIN32
+    WaitForSingleObject(t->handle, INFINITE);
+    CloseHandle(t->handle);
+#else
+    pthread_join(t->thread, NULL);
+#endif
+    free(t);
+}
@@ -37,6 +37,9 @@
 #ifndef _FILE_OFFSET_BITS
 # define _FILE_OFFSET_BITS 64
 #endif
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE
+#endif
 #include <errno.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -46,6 +49,22 @@
 #include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef _WIN32
+# include <io.h>
+# include <windows.h>
+#else
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/uio.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# include <emmintrin.h>
+# define MVHD_HAVE_SSE2
+#elif defined(__ARM_NEON)
+# include <arm_neon.h>
+# define MVHD_HAVE_NEON
+#endif
 #define BUILDING_LIBRARY
 #include "minivhd.h"
 #include "internal.h"
@@ -99,6 +118,76 @@ mvhd_from_be64(uint64_t val)
 }
 
 
+void
+mvhd_from_be32_array(uint32_t* vals, size_t count)
+{
+    size_t i = 0;
+
+#if defined(MVHD_HAVE_SSE2)
+    /* These are only ever little endian. Swap the bytes in each 16 bit word,
+       then swap the words in each 32 bit value, four values at a time */
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)&vals[i]);
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        _mm_storeu_si128((__m128i*)&vals[i], v);
+    }
+#elif defined(MVHD_HAVE_NEON) && !defined(__ARM_BIG_ENDIAN)
+    for (; i + 4 <= count; i += 4) {
+        uint8x16_t v = vld1q_u8((const uint8_t*)&vals[i]);
+        vst1q_u8((uint8_t*)&vals[i], vrev32q_u8(v));
+    }
+#endif
+
+    for (; i < count; i++) {
+        vals[i] = mvhd_from_be32(vals[i]);
+    }
+}
+
+
+bool
+mvhd_is_zero(const void* buf, size_t len)
+{
+    const uint8_t* p = (const uint8_t*)buf;
+    size_t i = 0;
+    uint64_t acc = 0, v;
+
+#if defined(MVHD_HAVE_SSE2)
+    /* OR 64 bytes at a time together, and test the result once per iteration */
+    for (; i + 64 <= len; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(p + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(p + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i*)(p + i + 48));
+        a = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, _mm_setzero_si128())) != 0xffff) {
+            return false;
+        }
+    }
+#elif defined(MVHD_HAVE_NEON)
+    for (; i + 64 <= len; i += 64) {
+        uint8x16_t a = vorrq_u8(vld1q_u8(p + i), vld1q_u8(p + i + 16));
+        uint8x16_t b = vorrq_u8(vld1q_u8(p + i + 32), vld1q_u8(p + i + 48));
+        uint64x2_t c = vreinterpretq_u64_u8(vorrq_u8(a, b));
+        if ((vgetq_lane_u64(c, 0) | vgetq_lane_u64(c, 1)) != 0) {
+            return false;
+        }
+    }
+#endif
+
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&v, p + i, sizeof v);
+        acc |= v;
+    }
+    for (; i < len; i++) {
+        acc |= p[i];
+    }
+
+    return acc == 0;
+}
+
+
 uint16_t
 mvhd_to_be16(uint16_t val)
 {
@@ -401,6 +490,10 @@ mvhd_strerr(MVHDError err)
 		s = "error converting image. Size mismatch detected";
 		break;
 
+	case MVHD_ERR_FOOTER_MISSING:
+		s = "no VHD footer at end of file, and unknown data follows the image";
+		break;
+
 	default:
 		break;
     }
@@ -435,6 +528,316 @@ mvhd_fseeko64(FILE* stream, int64_t offset, int origin)
 }
 
 
+int
+mvhd_ftruncate64(int fd, int64_t length)
+{
+#ifdef _WIN32
+    return _chsize_s(fd, length);
+#else
+    return ftruncate(fd, (off_t)length);
+#endif
+}
+
+
+int
+mvhd_fsync(int fd)
+{
+#ifdef _WIN32
+    return _commit(fd);
+#else
+    return fsync(fd);
+#endif
+}
+
+
+int
+mvhd_fallocate(int fd, int64_t offset, int64_t length)
+{
+#if defined(__linux__)
+    return fallocate(fd, 0, (off_t)offset, (off_t)length);
+#else
+    (void)fd;
+    (void)offset;
+    (void)length;
+    return -1;
+#endif
+}
+
+
+void
+mvhd_punch_hole(int fd, int64_t offset, int sector_count)
+{
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)sector_count * MVHD_SECTOR_SIZE) == 0) {
+        return;
+    }
+#endif
+    /* The host can't deallocate the range, so just zero it */
+    mvhd_pwrite_empty_sectors(fd, offset, sector_count);
+}
+
+
+int64_t
+mvhd_file_size(int fd)
+{
+#ifdef _WIN32
+    struct _stati64 file_stat;
+
+    if (_fstati64(fd, &file_stat) != 0) {
+#else
+    struct stat file_stat;
+
+    if (fstat(fd, &file_stat) != 0) {
+#endif
+        mvhd_errno = errno;
+        return -1;
+    }
+
+    return (int64_t)file_stat.st_size;
+}
+
+
+void*
+mvhd_map_file(int fd, int64_t size, void** handle)
+{
+    void* addr;
+
+    *handle = NULL;
+    if (size <= 0 || (uint64_t)size > (uint64_t)SIZE_MAX) {
+        return NULL;
+    }
+#ifdef _WIN32
+    HANDLE mh = CreateFileMapping((HANDLE)_get_osfhandle(fd), NULL, PAGE_READONLY, 0, 0, NULL);
+
+    if (mh == NULL) {
+        return NULL;
+    }
+    addr = MapViewOfFile(mh, FILE_MAP_READ, 0, 0, (SIZE_T)size);
+    if (addr == NULL) {
+        CloseHandle(mh);
+        return NULL;
+    }
+    *handle = mh;
+#else
+    addr = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+#endif
+
+    return addr;
+}
+
+
+void
+mvhd_unmap_file(void* addr, int64_t size, void* handle)
+{
+    if (addr == NULL) {
+        return;
+    }
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(addr);
+    CloseHandle((HANDLE)handle);
+#else
+    (void)handle;
+    munmap(addr, (size_t)size);
+#endif
+}
+
+
+/**
+ * \brief Transfer a buffer to or from an absolute file offset
+ * 
+ * Short transfers are retried until the whole buffer is done, an error 
+ * occurs, or (when reading) the end of the file is reached.
+ * 
+ * On Windows, ReadFile() and WriteFile() move the file pointer even when given an 
+ * offset, so it is saved and put back afterwards. Stream I/O on the same file must 
+ * still not run at the same time as this function.
+ * 
+ * \param [in] fd The file descriptor
+ * \param [in] buf The buffer to transfer
+ * \param [in] count The number of bytes to transfer
+ * \param [in] offset The absolute file offset to start at
+ * \param [in] write true to write to the file, false to read from it
+ * 
+ * \return The number of bytes transferred, or -1 on error
+ */
+static int64_t
+mvhd_prw(int fd, void* buf, size_t count, int64_t offset, bool write)
+{
+    uint8_t* p = (uint8_t*)buf;
+    size_t done = 0;
+    bool failed = false;
+#ifdef _WIN32
+    HANDLE h = (HANDLE)_get_osfhandle(fd);
+    LARGE_INTEGER zero, pos;
+    BOOL restore;
+
+    zero.QuadPart = 0;
+    restore = SetFilePointerEx(h, zero, &pos, FILE_CURRENT);
+#endif
+
+    while (done < count) {
+#ifdef _WIN32
+        OVERLAPPED ov;
+        DWORD chunk, n = 0;
+        BOOL ok;
+
+        memset(&ov, 0, sizeof ov);
+        ov.Offset = (DWORD)((uint64_t)(offset + done) & 0xffffffff);
+        ov.OffsetHigh = (DWORD)((uint64_t)(offset + done) >> 32);
+        chunk = (count - done) > 0x40000000 ? 0x40000000 : (DWORD)(count - done);
+        if (write) {
+            ok = WriteFile(h, p + done, chunk, &n, &ov);
+        } else {
+            ok = ReadFile(h, p + done, chunk, &n, &ov);
+        }
+        if (!ok) {
+            if (!write && GetLastError() == ERROR_HANDLE_EOF) {
+                break;
+            }
+            mvhd_errno = EIO;
+            failed = true;
+            break;
+        }
+#else
+        ssize_t n;
+
+        if (write) {
+            n = pwrite(fd, p + done, count - done, (off_t)(offset + done));
+        } else {
+            n = pread(fd, p + done, count - done, (off_t)(offset + done));
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            mvhd_errno = errno;
+            return -1;
+        }
+#endif
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+#ifdef _WIN32
+    if (restore) {
+        SetFilePointerEx(h, pos, NULL, FILE_BEGIN);
+    }
+#endif
+
+    return failed ? -1 : (int64_t)done;
+}
+
+
+int64_t
+mvhd_pread(int fd, void* buf, size_t count, int64_t offset)
+{
+    return mvhd_prw(fd, buf, count, offset, false);
+}
+
+
+int64_t
+mvhd_pwrite(int fd, const void* buf, size_t count, int64_t offset)
+{
+    return mvhd_prw(fd, (void*)buf, count, offset, true);
+}
+
+
+/**
+ * \brief Transfer a list of buffers to or from an absolute file offset
+ * 
+ * Where the host has preadv() and pwritev(), the buffers are handed to the 
+ * kernel in batches. Otherwise each buffer is transferred in turn.
+ * 
+ * \param [in] fd The file descriptor
+ * \param [in] iov The list of buffers
+ * \param [in] iovcnt The number of buffers in iov
+ * \param [in] offset The absolute file offset to start at
+ * \param [in] write true to write to the file, false to read from it
+ * 
+ * \return The number of bytes transferred, or -1 on error
+ */
+static int64_t
+mvhd_prwv(int fd, const MVHDIOVec* iov, int iovcnt, int64_t offset, bool write)
+{
+    int64_t done = 0;
+    int i = 0;
+
+#if defined(__linux__)
+    struct iovec vec[MVHD_IOV_BATCH];
+    size_t skip = 0, want;
+    ssize_t n;
+    int cnt;
+
+    while (i < iovcnt) {
+        want = 0;
+        for (cnt = 0; cnt < MVHD_IOV_BATCH && i + cnt < iovcnt; cnt++) {
+            vec[cnt].iov_base = (uint8_t*)iov[i + cnt].base + (cnt == 0 ? skip : 0);
+            vec[cnt].iov_len = iov[i + cnt].len - (cnt == 0 ? skip : 0);
+            want += vec[cnt].iov_len;
+        }
+        if (write) {
+            n = pwritev(fd, vec, cnt, (off_t)(offset + done));
+        } else {
+            n = preadv(fd, vec, cnt, (off_t)(offset + done));
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            mvhd_errno = errno;
+            return -1;
+        }
+        if (n == 0 && want > 0) {
+            break;
+        }
+        done += n;
+
+        /* Work out where the next batch starts, allowing for a short transfer */
+        n += (ssize_t)skip;
+        while (i < iovcnt && (size_t)n >= iov[i].len) {
+            n -= (ssize_t)iov[i].len;
+            i++;
+        }
+        skip = (size_t)n;
+    }
+#else
+    int64_t n;
+
+    for (; i < iovcnt; i++) {
+        n = mvhd_prw(fd, iov[i].base, iov[i].len, offset + done, write);
+        if (n < 0) {
+            return -1;
+        }
+        done += n;
+        if ((size_t)n < iov[i].len) {
+            break;
+        }
+    }
+#endif
+
+    return done;
+}
+
+
+int64_t
+mvhd_preadv(int fd, const MVHDIOVec* iov, int iovcnt, int64_t offset)
+{
+    return mvhd_prwv(fd, iov, iovcnt, offset, false);
+}
+
+
+int64_t
+mvhd_pwritev(int fd, const MVHDIOVec* iov, int iovcnt, int64_t offset)
+{
+    return mvhd_prwv(fd, iov, iovcnt, offset, true);
+}
+
+
 uint32_t
 mvhd_crc32_for_byte(uint32_t r)
 {
@@ -504,3 +907,25 @@ mvhd_file_mod_timestamp(const char* path, int *err)
     return mvhd_epoch_to_vhd_ts(file_stat.st_mtime);
 #endif
 }
+
+
+uint32_t
+mvhd_file_mod_timestamp_f(FILE* f, int *err)
+{
+    *err = 0;
+#ifdef _WIN32
+    struct _stati64 file_stat;
+
+    if (_fstati64(_fileno(f), &file_stat) != 0) {
+#else
+    struct stat file_stat;
+
+    if (fstat(fileno(f), &file_stat) != 0) {
+#endif
+        mvhd_errno = errno;
+        *err = MVHD_ERR_FILE;
+        return 0;
+    }
+
+    return mvhd_epoch_to_vhd_ts(file_stat.st_mtime);
+}